@@ -0,0 +1,61 @@
+/**
+ * @file binary_mask.h
+ * @brief Run-length encoded binary image.
+ */
+
+#ifndef _PICOPTERX_BINARY_MASK_H
+#define _PICOPTERX_BINARY_MASK_H
+
+#include "camera_threshold.h"
+#include "component_labeller.h"
+#include <opencv2/opencv.hpp>
+
+namespace picopter {
+    /**
+     * A binary (thresholded) image stored as run-length encoded rows.
+     *
+     * Our masks are mostly empty, so storing the runs rather than a byte per
+     * pixel cuts the memory traffic of every consumer. The runs of all rows
+     * live in one arena (in row order) that keeps its capacity when the mask
+     * is reset, so refilling a mask every frame does not allocate.
+     *
+     * Rows are added in order, either from thresholded rows or from runs that
+     * have already been encoded. Rows that were never added are empty.
+     */
+    class BinaryMask {
+        public:
+            BinaryMask();
+
+            void Reset(int width, int height);
+            void AddRow(const uint8_t *row, int gap = 0);
+            void AddRuns(const PixelRun *runs, size_t count);
+            void AddRuns(const std::vector<PixelRun> &runs);
+            void FromMat(const cv::Mat &mask, int gap = 0);
+            void ToMat(cv::Mat &out) const;
+            void ToMat(cv::Mat &out, const cv::Rect &roi) const;
+
+            int GetWidth() const;
+            int GetHeight() const;
+            const std::vector<PixelRun>& GetRuns() const;
+            void GetRow(int y, size_t *begin, size_t *end) const;
+
+            int64_t Area() const;
+            MaskMoments Moments(bool second_order) const;
+            bool BoundingBox(cv::Rect *bounds) const;
+            int64_t Overlap(const BinaryMask &other) const;
+            int64_t Overlap(const cv::Rect &roi) const;
+        private:
+            /** Mask dimensions. **/
+            int m_width, m_height;
+            /** The runs of every row, in row order. **/
+            std::vector<PixelRun> m_runs;
+            /** Index of the first run of each row that has been added. **/
+            std::vector<size_t> m_row_start;
+            /** The number of rows that have been added. **/
+            int m_next_row;
+
+            void StartRows(int y);
+    };
+}
+
+#endif // _PICOPTERX_BINARY_MASK_H
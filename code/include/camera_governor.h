@@ -0,0 +1,85 @@
+/**
+ * @file camera_governor.h
+ * @brief Trades camera quality for detection rate.
+ */
+
+#ifndef _PICOPTERX_CAMERA_GOVERNOR_H
+#define _PICOPTERX_CAMERA_GOVERNOR_H
+
+#include <string>
+#include <vector>
+
+namespace picopter {
+    /**
+     * The camera settings at one level of the governor.
+     */
+    typedef struct GovernorLevel {
+        /** The processing width **/
+        int process_width;
+        /** The smallest detected area (pixels at the processing width) **/
+        int pixel_threshold;
+        /** Shortest time between streamed frames (ms) **/
+        int stream_interval;
+        /** Draw the HUD **/
+        bool hud;
+        /** Record (and display) the annotated frames **/
+        bool record;
+    } GovernorLevel;
+
+    /**
+     * Limits on what the governor may change.
+     */
+    typedef struct GovernorBounds {
+        /** The input width (processing widths are this over an integer skip) **/
+        int input_width;
+        /** The largest and smallest processing widths **/
+        int max_process_width, min_process_width;
+        /** The smallest detected area (pixels at the largest processing width) **/
+        int pixel_threshold;
+        /** The shortest and longest times between streamed frames (ms) **/
+        int min_stream_interval, max_stream_interval;
+        /** Whether the HUD, and the recording, may be turned off **/
+        bool shed_hud, shed_record;
+    } GovernorBounds;
+
+    /**
+     * Steps the camera settings down when frames take longer to process than
+     * the target detection rate allows, and back up when there is time to
+     * spare.
+     *
+     * The levels run from the best settings (level 0) to the cheapest. Each
+     * level gives up one thing, cheapest to lose first: the stream rate is
+     * halved, then the HUD is turned off, then the processing width is
+     * reduced, then the recording is stopped.
+     */
+    class CameraGovernor {
+        public:
+            CameraGovernor(const GovernorBounds &bounds, double target_fps,
+                int holdoff = 30);
+            virtual ~CameraGovernor() {};
+
+            static std::vector<GovernorLevel> BuildLevels(const GovernorBounds &bounds);
+
+            bool Update(double frame_ms);
+            int GetLevel(void);
+            int GetLevels(void);
+            const GovernorLevel& GetSettings(void);
+            double GetFrameTime(void);
+            std::string Describe(void);
+        private:
+            /** The settings at each level **/
+            std::vector<GovernorLevel> m_levels;
+            /** The current level **/
+            int m_level;
+            /** The time available to process each frame (ms) **/
+            double m_budget;
+            /** Smoothed frame processing time (ms) **/
+            double m_average;
+            /** Frames to wait after a step before the next one **/
+            int m_holdoff;
+            /** Frames since the last step **/
+            int m_since_step;
+    };
+}
+
+#endif // _PICOPTERX_CAMERA_GOVERNOR_H
@@ -12,18 +12,31 @@
 #include "navigation.h"
 #include "flightboard.h" //For HUDInfo
 #include "threadpool.h"
+#include "parallel_for.h"
+#include "frame_queue.h"
+#include "camera_threshold.h"
+#include "component_labeller.h"
+#include "binary_mask.h"
+#include "tracking_window.h"
+#include "camshift_tracker.h"
+#include "hog_detector.h"
+#include "glyph_library.h"
+#include "mjpeg_server.h"
+#include "frame_ring.h"
+#include "latency_histogram.h"
+#include "frame_source.h"
+#include "camera_governor.h"
+#include "motion_gate.h"
+#include "colour_learner.h"
 #include <opencv2/opencv.hpp>
 #ifdef IS_ON_PI
 #  include "omxcv.h"
  #endif
 
-#define STREAM_FILE "/mnt/ramdisk/out.jpg"
-/** The size of the threshold lookup (number of colour bins per channel) **/
-#define THRESH_SIZE 16
-/** The scaling factor for reducing a value into its respective colour bin **/
-#define THRESH_DIV (256/THRESH_SIZE)
-/** Un-reduces a threshold value into the midpoint of the colour bin. **/
-#define UNREDUCE(x) (((x)*255 + 127) / THRESH_SIZE)
+/** The number of frame slots between each stage of the camera pipeline **/
+#define PIPELINE_DEPTH 2
+/** The largest number of photos waiting to be saved **/
+#define PHOTO_QUEUE_DEPTH 8
 
 namespace picopter {
     /**
@@ -63,10 +76,88 @@ namespace picopter {
         navigation::Point3D offset;
         /** Bounding rectangle of the object */
         cv::Rect bounds;
+        /** Orientation of the major axis (radians, image frame), if known **/
+        double orientation;
         /** Real-world location (lat/lon/alt) **/
         navigation::Coord3D location;
+        /** The time at which the frame it was detected in was captured **/
+        std::chrono::steady_clock::time_point capture_time;
     } ObjectInfo;
     
+    /**
+     * A frame travelling through the camera processing pipeline.
+     */
+    typedef struct CameraFrame {
+        /** The frame sequence number (assigned at capture). **/
+        uint64_t id;
+        /** The time at which the frame was captured. **/
+        std::chrono::steady_clock::time_point capture_time;
+        /** The captured image, as BGR (annotated by the overlay stage). For a
+            YUYV source, it is only converted once a stage needs it. **/
+        cv::Mat image;
+        /** Indicates that image holds this frame. **/
+        bool has_image;
+        /** The captured image in the source's YUYV layout (YUYV sources only). **/
+        cv::Mat yuv;
+        /** Keeps the source's buffer, if yuv was lent by the source, from
+            being reused; released once the overlay stage is done with it. **/
+        FrameLease lease;
+        /** The working copy (e.g. thresholded image), if any. **/
+        cv::Mat backend;
+        /** The camera mode used to process this frame. **/
+        int mode;
+        /** Indicates that the working copy should be streamed. **/
+        bool show_backend;
+        /** Objects detected in this frame. **/
+        std::vector<ObjectInfo> detected;
+        /** The region that was searched, if not the whole frame. **/
+        cv::Rect search_window;
+    } CameraFrame;
+
+    /**
+     * The results of processing a frame, as published to other threads.
+     */
+    typedef struct CameraSnapshot {
+        /** The frame sequence number (assigned at capture). **/
+        uint64_t frame_id;
+        /** The time at which the frame was captured. **/
+        std::chrono::steady_clock::time_point capture_time;
+        /** The camera mode used to process the frame. **/
+        int mode;
+        /** The processing rate (FPS) at the time. **/
+        double fps;
+        /** Objects detected in the frame. **/
+        std::vector<ObjectInfo> detected;
+        /** The detections were reused from an earlier, unchanged frame. **/
+        bool reused;
+        /** The thresholds learnt from the frame (colour learning mode). **/
+        ThresholdParams learned;
+    } CameraSnapshot;
+
+    /**
+     * A photo waiting to be saved.
+     */
+    typedef struct CameraPhoto {
+        /** The location to store the photo. **/
+        std::string filename;
+        /** The (unannotated) captured image. **/
+        cv::Mat image;
+    } CameraPhoto;
+
+    /**
+     * Statistics of the encoding sinks (stream, recording and photos).
+     */
+    typedef struct EncoderStats {
+        /** Frames waiting in each sink's queue **/
+        size_t stream_depth, record_depth, photo_depth;
+        /** Frames dropped because a sink fell behind (photos are never dropped) **/
+        uint64_t stream_dropped, record_dropped;
+        /** Frames streamed **/
+        uint64_t streamed;
+        /** Photos saved, and photos that could not be written **/
+        uint64_t photos_saved, photos_failed;
+    } EncoderStats;
+
     /**
      * Holds information about a glyph.
      */
@@ -98,6 +189,27 @@ namespace picopter {
                 MODE_LEARN_COLOUR = 999
             } CameraMode;
 
+            /** The latencies that are measured. **/
+            typedef enum {
+                /** Decoding a captured frame **/
+                LATENCY_GRAB = 0,
+                /** Colour thresholding **/
+                LATENCY_THRESHOLD,
+                /** Running the detector (including thresholding) **/
+                LATENCY_DETECT,
+                /** Annotating a frame **/
+                LATENCY_OVERLAY,
+                /** JPEG encoding a frame for the stream **/
+                LATENCY_ENCODE,
+                /** Capture to publication on the stream **/
+                LATENCY_STREAM,
+                /** Capture to publication of the detections **/
+                LATENCY_RESULT,
+                /** Capture to use of the detections (recorded by the user) **/
+                LATENCY_DECISION,
+                LATENCY_STAGES
+            } LatencyStage;
+
             CameraStream();
             CameraStream(Options *opts);
             virtual ~CameraStream(void);
@@ -116,59 +228,211 @@ namespace picopter {
             void DoAutoLearning(void);
 
             void GetDetectedObjects(std::vector<ObjectInfo>* objects);
+            std::shared_ptr<const CameraSnapshot> GetSnapshot(void);
             double GetFramerate(void);
+            void GetEncoderStats(EncoderStats *stats);
+            bool GetSourceStats(SourceStats *stats);
+            void GetLatency(LatencyStage stage, LatencySummary *summary);
+            void RecordLatency(LatencyStage stage,
+                std::chrono::steady_clock::duration latency);
+            void LogLatency(DataLog *log);
+            void ResetLatency(void);
             bool TakePhoto(std::string filename);
             void SetTrackingArrow(navigation::Point3D arrow);
         private:
+            /** The values that the rendered HUD text depends on. **/
+            typedef struct HUDState {
+                /** The HUD info version **/
+                uint64_t version;
+                /** The displayed time (seconds) **/
+                time_t time;
+                /** The displayed frame rate **/
+                double fps;
+                /** The frame size **/
+                cv::Size size;
+            } HUDState;
+
             /** A list of distinct colours **/
             static const std::vector<cv::Scalar> m_colours;
-            /** The OpenCV video capture handle **/
-            cv::VideoCapture m_capture;
+            /** The source of the frames (camera or replay) **/
+            FrameSource *m_source;
             /** Flag to indicate that the worker thread should be stopped **/
             std::atomic<bool> m_stop;
-            /** The current camera mode **/
+            /** The current camera mode (processing thread) **/
             CameraMode m_mode;
+            /** The last camera mode set **/
+            std::atomic<CameraMode> m_mode_requested;
             /** Worker thread pool **/
             ThreadPool m_pool;
+            /** Parallel-for over the worker thread pool **/
+            ParallelFor m_parallel;
 
-            /** The main mutex to interact with the thread **/
-            std::mutex m_worker_mutex;
+            /** Protects the command queue **/
+            std::mutex m_command_mutex;
+            /** Changes for the processing thread to apply between frames **/
+            std::vector<std::function<void()>> m_commands;
+            /** The changes being applied (processing thread) **/
+            std::vector<std::function<void()>> m_pending_commands;
+            /** Protects the configuration (thresholds) **/
+            std::mutex m_config_mutex;
+            /** The results of the latest frame (use std::atomic_load/store) **/
+            std::shared_ptr<const CameraSnapshot> m_snapshot;
             /** Secondary mutex to interact with worker **/
             std::mutex m_aux_mutex;
-            /** The video processing thread **/
+            /** Serialises rebuilds of the threshold lookup table **/
+            std::mutex m_build_mutex;
+            /** Colourspace converted LUT cells, per input layout, colourspace and LUT size (build mutex) **/
+            std::shared_ptr<const std::vector<uint8_t>> m_colour_cubes[2][2][3];
+            /** The frame capture thread **/
+            std::future<void> m_capture_thread;
+            /** The video processing (detection) thread **/
             std::future<void> m_worker_thread;
+            /** The overlay (annotation) thread **/
+            std::future<void> m_overlay_thread;
+            /** The stream encoding thread **/
+            std::future<void> m_stream_thread;
+            /** The recording (and demo display) thread **/
+            std::future<void> m_record_thread;
+            /** The photo saving thread **/
+            std::future<void> m_photo_thread;
+            /** Captured frames waiting to be processed **/
+            FrameQueue<CameraFrame> m_capture_queue;
+            /** Processed frames waiting to be annotated **/
+            FrameQueue<CameraFrame> m_overlay_queue;
+            /** The latest annotated frame to be streamed **/
+            FrameQueue<CameraFrame> m_stream_queue;
+            /** Annotated frames waiting to be recorded/displayed **/
+            FrameQueue<CameraFrame> m_record_queue;
+            /** Photos waiting to be saved **/
+            FrameQueue<CameraPhoto> m_photo_queue;
 
-            /** The colour thresholding parameters **/
+            /** The colour thresholding parameters (config mutex) **/
             ThresholdParams m_thresholds;
-            /** The colour auto-learning thresholding parameters **/
+            /** The colour auto-learning thresholding parameters (processing thread) **/
             ThresholdParams m_learning_thresholds;
+            /** The colours seen in the learning region (processing thread) **/
+            ColourLearner m_learner;
+            /** The colour cube the learnt ranges are read through (processing thread) **/
+            std::shared_ptr<const std::vector<uint8_t>> m_learn_cube;
+            /** The colourspace of m_learn_cube **/
+            ThresholdColourspace m_learn_colourspace;
             /** The processing rate (FPS) **/
-            double m_fps;
+            std::atomic<double> m_fps;
             /** Demo mode (displays camera stream in GTK window) **/
             bool m_demo_mode;
-            /** Show the working copy (e.g. thresholded image) **/
+            /** Show the working copy (e.g. thresholded image; processing thread) **/
             bool m_show_backend;
-            /** Indicates that a snapshot should be taken **/
-            bool m_save_photo;
-            /** The path to store the snapshot to **/
-            std::string m_save_filename;
+            /** The last value of m_show_backend set **/
+            std::atomic<bool> m_backend_requested;
+            /** Paths of the photos to take from the next frame (processing thread) **/
+            std::vector<std::string> m_photo_requests;
+            /** Photos requested but not yet saved **/
+            std::atomic<int> m_photos_pending;
+            /** Photos saved, and photos that could not be written **/
+            std::atomic<uint64_t> m_photos_saved, m_photos_failed;
+            /** Frames streamed **/
+            std::atomic<uint64_t> m_streamed;
+            /** Latency histograms, by stage **/
+            LatencyHistogram m_latency[LATENCY_STAGES];
             /** The current HUD info. **/
             HUDInfo m_hud;
+            /** Incremented whenever the HUD info is set **/
+            uint64_t m_hud_version;
+            /** What the rendered HUD text shows (overlay thread) **/
+            HUDState m_hud_drawn;
+            /** The rendered HUD text (overlay thread) **/
+            cv::Mat m_hud_mask;
             /** Arrow indicating movement **/
             navigation::Point3D m_arrow;
             /** Detected objects **/
             std::vector<ObjectInfo> m_detected;
             /** List of glyphs **/
             std::vector<CameraGlyph> m_glyphs;
-            /** Colour lookup thresholding table **/
-            uint8_t m_lookup_threshold[THRESH_SIZE][THRESH_SIZE][THRESH_SIZE];
+            /** The glyphs, packed for matching (indexes into m_glyphs) **/
+            GlyphLibrary m_glyph_library;
+            /** Largest number of differing glyph cells that is a match **/
+            int m_glyph_max_distance;
+            /** Low resolution dark region mask for proposing glyphs **/
+            cv::Mat m_glyph_gate;
+            /** Colour lookup thresholding table (use std::atomic_load/store) **/
+            std::shared_ptr<const ThresholdLUT> m_lut;
+            /** The lookup table for YUYV frames, if the source provides them (as m_lut) **/
+            std::shared_ptr<const ThresholdLUT> m_yuv_lut;
+            /** Bits per channel of the lookup table (config mutex) **/
+            int m_thresh_bits;
+            /** The (CPU dependent) row thresholding kernel **/
+            ThresholdKernel m_threshold_kernel;
+            /** Per-band thresholded row buffers **/
+            std::vector<uint8_t> m_row_scratch;
+            /** Compute the orientation of the centre of mass **/
+            bool m_com_orientation;
+            /** Connected component labelling of the thresholded runs **/
+            ComponentLabeller m_labeller;
+            /** Per-band runs of the thresholded image **/
+            std::vector<std::vector<PixelRun>> m_band_runs;
+            /** The thresholded image **/
+            BinaryMask m_mask;
+            /** The largest connected components **/
+            std::vector<Blob> m_blobs;
+            /** Label connected components at the full input resolution **/
+            bool m_cc_full_res;
+            /** Largest gap (in processing resolution pixels) closed within a row **/
+            int m_cc_gap;
+            /** Only search a window around a tracked object **/
+            bool m_track_window;
+            /** Predicts where the tracked object will be **/
+            TrackingWindow m_tracking;
+            /** The capture time of the frame being processed **/
+            std::chrono::steady_clock::time_point m_frame_time;
+            /** The region of the frame being processed that was searched **/
+            cv::Rect m_search_window;
+            /** Search window parameters for each CamShift target **/
+            TrackingWindow m_target_window;
+            /** CamShift target trackers **/
+            std::vector<CamShiftTracker> m_trackers;
+            /** Colour models of previously tracked targets **/
+            HistogramCache m_hist_cache;
+            /** The ID of the next CamShift target **/
+            int m_next_target;
+            /** Frames since new CamShift targets were last searched for **/
+            int m_acquire_count;
+            /** The processing resolution frame used by CamShift **/
+            cv::Mat m_camshift_bgr, m_camshift_hsv;
 
             /** HOG Detector **/
-            cv::HOGDescriptor m_hog;
+            HOGDetector m_hog;
+            /** People found by the HOG detector **/
+            std::vector<cv::Rect> m_hog_found;
 
             int INPUT_WIDTH, INPUT_HEIGHT, PROCESS_WIDTH, PROCESS_HEIGHT;
             int STREAM_WIDTH, STREAM_HEIGHT, PIXEL_SKIP, PIXEL_THRESHOLD;
-            int LEARN_SIZE;
+            int LEARN_SIZE, THRESHOLD_BANDS;
+            int CAMSHIFT_TARGETS, CAMSHIFT_ACQUIRE;
+
+            /** The web stream server, if any **/
+            MjpegServer *m_server;
+            /** Shortest time between streamed frames (ms) **/
+            std::atomic<int> m_stream_interval;
+            /** Draw the HUD on the annotated frames **/
+            std::atomic<bool> m_hud_enabled;
+            /** Record (and display) the annotated frames **/
+            std::atomic<bool> m_record_enabled;
+            /** Adjusts the settings to the detection rate, if enabled (processing thread) **/
+            CameraGovernor *m_governor;
+            /** Log of the governor's steps **/
+            DataLog *m_governor_log;
+            /** Skips the detectors on unchanged frames, if enabled (processing thread) **/
+            MotionGate *m_motion_gate;
+            /** The thresholds that the reusable detections were found with **/
+            std::shared_ptr<const ThresholdLUT> m_gate_lut;
+            /** Whether the last fully processed frame found anything **/
+            bool m_gate_found;
+            /** The backend of the last fully processed frame, if shown **/
+            cv::Mat m_gate_backend;
+            /** The number of frames whose detections were reused **/
+            std::atomic<uint64_t> m_frames_reused;
+            /** Shared memory ring of captured frames, if enabled **/
+            FrameRingWriter *m_ring;
 
 #ifdef IS_ON_PI
             omxcv::OmxCv *m_enc;
@@ -176,20 +440,44 @@ namespace picopter {
 
             void LoadGlyphs(Options *opts);
 
+            void PostCommand(std::function<void()> command);
+            bool RunCommands(void);
+            void CaptureFrames(void);
+            void GetPose(FramePose *pose);
+            void PublishFrame(const CameraFrame& frame);
+            cv::Mat& GetImage(CameraFrame *frame);
             void ProcessImages(void);
+            void ApplyGovernor(void);
+            void OverlayFrames(void);
+            void EncodeStream(void);
+            void RecordFrames(void);
+            void SavePhotos(void);
+            void DrawDetections(CameraFrame& frame);
             void DrawHUD(cv::Mat& img);
+            void RenderHUD(const HUDInfo& hud, time_t ts, double fps,
+                cv::Size size, cv::Mat *mask);
             void DrawCrosshair(cv::Mat& img, cv::Point centre, const cv::Scalar& colour, int size);
             void DrawTrackingArrow(cv::Mat& img);
 
             void RGB2HSV(uint8_t r, uint8_t g, uint8_t b, uint8_t *h, uint8_t *s, uint8_t *v);
             void RGB2YCbCr(uint8_t r, uint8_t g, uint8_t b, uint8_t *y, uint8_t *cb, uint8_t *cr);
-            void BuildThreshold(uint8_t lookup[][THRESH_SIZE][THRESH_SIZE], ThresholdParams thresh);
-            void ThresholdSlice(const cv::Mat& src, cv::Mat &out, int skip, int offset, int slice_height);
-            void Threshold(const cv::Mat& src, cv::Mat &out, int width);
-            void LearnThresholds(cv::Mat& src, cv::Mat& threshold, cv::Rect roi);
+            void YUV2RGB(uint8_t y, uint8_t u, uint8_t v, uint8_t *r, uint8_t *g, uint8_t *b);
+            template <int Bits>
+            void BuildColourCube(ThresholdColourspace colourspace,
+                ThresholdInput input, uint8_t *cube);
+            std::shared_ptr<const std::vector<uint8_t>> GetColourCube(
+                ThresholdColourspace colourspace, ThresholdInput input, int bits);
+            void RebuildThreshold(const ThresholdParams& thresh, int bits);
+            void ThresholdMask(const cv::Mat& src, int width, int gap, BinaryMask *mask);
+            bool GetSearchWindow(const cv::Size& frame, int align,
+                const cv::Size& min_size, cv::Rect *window);
+            void UpdateTracking(void);
+            void LearnThresholds(const cv::Mat& src, cv::Mat& threshold, cv::Rect roi);
             bool CentreOfMass(cv::Mat& src, cv::Mat& threshold);
             int ConnectedComponents(cv::Mat& src, cv::Mat& threshold);
             bool CamShift(cv::Mat& src, cv::Mat& threshold);
+            void StopTrackers(void);
+            void GlyphCandidates(const cv::Mat& gray, std::vector<cv::Rect> *candidates);
             bool CannyGlyphDetection(cv::Mat& src, cv::Mat& proc);
             bool ThresholdingGlyphDetection(cv::Mat& src, cv::Mat& proc);
             bool GlyphDetection(cv::Mat &src, cv::Mat& roi, cv::Rect bounds);
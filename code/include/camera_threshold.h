@@ -0,0 +1,195 @@
+/**
+ * @file camera_threshold.h
+ * @brief Colour lookup table thresholding kernels.
+ */
+
+#ifndef _PICOPTERX_CAMERA_THRESHOLD_H
+#define _PICOPTERX_CAMERA_THRESHOLD_H
+
+#include <stdint.h>
+#include <vector>
+
+namespace picopter {
+    /**
+     * The available implementations of the row thresholding kernel.
+     */
+    typedef enum ThresholdKernel {
+        /** Portable scalar implementation. **/
+        THRESH_KERNEL_SCALAR = 0,
+        /** x86 SSE2 implementation. **/
+        THRESH_KERNEL_SSE2 = 1,
+        /** x86 AVX2 implementation (hardware gather). **/
+        THRESH_KERNEL_AVX2 = 2,
+        /** ARM NEON implementation. **/
+        THRESH_KERNEL_NEON = 3
+    } ThresholdKernel;
+
+    /**
+     * The pixel layouts that a lookup table can be indexed with.
+     */
+    typedef enum ThresholdInput {
+        /** Interleaved BGR(A); the table is indexed as [r][g][b]. **/
+        THRESH_INPUT_BGR = 0,
+        /** Packed YUV 4:2:2 (Y0 Cb Y1 Cr); the table is indexed as [y][cb][cr]. **/
+        THRESH_INPUT_YUYV = 1
+    } ThresholdInput;
+
+    /**
+     * Raw spatial moments of a binary (thresholded) image, in thresholded
+     * image coordinates. Only m00, m10 and m01 are always computed; the
+     * second order moments are only valid if requested.
+     */
+    typedef struct MaskMoments {
+        /** Zeroth order moment (number of set pixels). **/
+        int64_t m00;
+        /** First order moments. **/
+        int64_t m10, m01;
+        /** Second order moments. **/
+        int64_t m20, m02, m11;
+    } MaskMoments;
+
+    /**
+     * Compile-time description of a colour lookup table with `Bits` bits per
+     * channel (i.e. SIZE bins per channel, SIZE^3 one-byte entries, indexed
+     * as `[r bin][g bin][b bin]`, or `[y bin][cb bin][cr bin]` for YUV input).
+     *
+     * Cache footprint of each size:
+     *  - 4 bits: 16^3 =   4 KiB; stays in L1 on every Pi.
+     *  - 5 bits: 32^3 =  32 KiB; the whole L1 D-cache of a Pi 2/3 (twice
+     *            that of the original Pi), so expect some L1 misses.
+     *  - 6 bits: 64^3 = 256 KiB; L2 resident (half of the Pi 2/3's shared L2,
+     *            more than the original Pi's). Lookups typically hit only the
+     *            few thousand cells near the colours actually in view, but a
+     *            busy scene will be noticeably slower than with 4 bits.
+     */
+    template <int Bits>
+    struct ColourLUT {
+        static_assert(Bits >= 4 && Bits <= 6, "Unsupported LUT resolution");
+        enum {
+            /** Bits per channel. **/
+            BITS = Bits,
+            /** Number of colour bins per channel. **/
+            SIZE = 1 << Bits,
+            /** Shift that reduces a channel value to its bin. **/
+            SHIFT = 8 - Bits,
+            /** Number of entries in the table. **/
+            ENTRIES = SIZE * SIZE * SIZE
+        };
+
+        /** Computes the table index of a pixel. **/
+        static inline int Index(uint8_t r, uint8_t g, uint8_t b) {
+            return ((r >> SHIFT) << (2*Bits)) | ((g >> SHIFT) << Bits) | (b >> SHIFT);
+        }
+
+        /** Un-reduces a colour bin into the midpoint of the bin. **/
+        static inline uint8_t Unreduce(int bin) {
+            return static_cast<uint8_t>((bin*255 + 127) / SIZE);
+        }
+    };
+
+    /**
+     * Row thresholding kernel. Classifies every `skip`-th pixel of a BGR(A)
+     * row using a colour lookup table (see ColourLUT for the layout).
+     * @param [in] lut The colour lookup table.
+     * @param [in] src The source row (interleaved BGR or BGRA).
+     * @param [out] dst The destination row (`width` entries).
+     * @param [in] width The number of destination pixels.
+     * @param [in] channels The number of channels per source pixel (3 or 4).
+     * @param [in] skip The source pixel stride.
+     */
+    typedef void (*ThresholdRowFn)(const uint8_t *lut, const uint8_t *src,
+        uint8_t *dst, int width, int channels, int skip);
+
+    /**
+     * Portable row thresholding kernel. This is the reference implementation
+     * that the vectorised kernels must match bit-for-bit.
+     * @see ThresholdRowFn
+     */
+    template <int Bits>
+    void ThresholdRowScalar(const uint8_t *lut, const uint8_t *src,
+        uint8_t *dst, int width, int channels, int skip)
+    {
+        int i, k;
+        for (i = 0; i < width; i++) {
+            k = i*channels*skip;
+            dst[i] = lut[ColourLUT<Bits>::Index(src[k+2], src[k+1], src[k])];
+        }
+    }
+
+    /**
+     * Row thresholding kernel for packed YUV 4:2:2 (YUYV) rows, with a table
+     * indexed on [y][cb][cr]. Each pixel is classified with the chroma of its
+     * pixel pair, so the row must start on an even pixel. The `channels`
+     * argument is ignored (YUYV is always two bytes per pixel).
+     * @see ThresholdRowFn
+     */
+    template <int Bits>
+    void ThresholdRowYUYV(const uint8_t *lut, const uint8_t *src,
+        uint8_t *dst, int width, int channels, int skip)
+    {
+        int i, p;
+        for (i = 0; i < width; i++) {
+            p = i*skip;
+            const uint8_t *pair = src + 4*(p >> 1);
+            dst[i] = lut[ColourLUT<Bits>::Index(src[2*p], pair[1], pair[3])];
+        }
+    }
+
+    template <int Bits>
+    void ThresholdRowSSE2(const uint8_t *lut, const uint8_t *src,
+        uint8_t *dst, int width, int channels, int skip);
+    template <int Bits>
+    void ThresholdRowAVX2(const uint8_t *lut, const uint8_t *src,
+        uint8_t *dst, int width, int channels, int skip);
+    template <int Bits>
+    void ThresholdRowNEON(const uint8_t *lut, const uint8_t *src,
+        uint8_t *dst, int width, int channels, int skip);
+
+    /**
+     * A colour lookup table whose resolution is chosen at runtime, together
+     * with the kernel specialised for that resolution.
+     */
+    class ThresholdLUT {
+        public:
+            ThresholdLUT(int bits = 4, ThresholdKernel kernel = THRESH_KERNEL_SCALAR,
+                ThresholdInput input = THRESH_INPUT_BGR);
+
+            int GetBits() const;
+            ThresholdInput GetInput() const;
+            int GetSize() const;
+            size_t GetEntries() const;
+            uint8_t* GetTable();
+            const uint8_t* GetTable() const;
+            ThresholdRowFn GetRowKernel() const;
+        private:
+            /** Bits per channel. **/
+            int m_bits;
+            /** The pixel layout the table is indexed with. **/
+            ThresholdInput m_input;
+            /** The table entries. **/
+            std::vector<uint8_t> m_table;
+            /** The row kernel specialised for this resolution. **/
+            ThresholdRowFn m_row;
+    };
+
+    /**
+     * Per-channel pass tables for thresholding a colour cube; a colour
+     * passes iff pass[c][value of channel c] is non-zero for every channel.
+     */
+    typedef uint8_t ColourPassTable[3][256];
+
+    void SetPassRange(ColourPassTable pass, int channel, int min, int max,
+        bool hue = false);
+    void ThresholdColourCube(const uint8_t *cube, size_t entries,
+        const ColourPassTable pass, uint8_t *lut);
+
+    double MomentsOrientation(const MaskMoments &m);
+
+    bool ThresholdKernelSupported(ThresholdKernel kernel);
+    ThresholdKernel DetectThresholdKernel(void);
+    ThresholdRowFn GetThresholdRowKernel(ThresholdKernel kernel, int bits = 4,
+        ThresholdInput input = THRESH_INPUT_BGR);
+    const char* GetThresholdKernelName(ThresholdKernel kernel);
+}
+
+#endif // _PICOPTERX_CAMERA_THRESHOLD_H
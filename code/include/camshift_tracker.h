@@ -0,0 +1,87 @@
+/**
+ * @file camshift_tracker.h
+ * @brief CamShift (colour histogram) object tracking.
+ */
+
+#ifndef _PICOPTERX_CAMSHIFT_TRACKER_H
+#define _PICOPTERX_CAMSHIFT_TRACKER_H
+
+#include "tracking_window.h"
+#include <chrono>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace picopter {
+    /**
+     * Tracks one object with the CamShift algorithm.
+     *
+     * The tracker holds its own hue/saturation histogram (the colour model)
+     * and only back-projects a search window around the predicted position
+     * of the object, so several trackers may be updated in parallel on the
+     * same (read-only) HSV image.
+     */
+    class CamShiftTracker {
+        public:
+            CamShiftTracker();
+
+            static void LearnHistogram(const cv::Mat &hsv,
+                const cv::Rect &bounds, cv::Mat *hist);
+
+            void Start(int id, const cv::Mat &hist, const cv::Rect &bounds,
+                std::chrono::steady_clock::time_point time,
+                const TrackingWindow &window);
+            void Stop();
+            bool Update(const cv::Mat &hsv,
+                std::chrono::steady_clock::time_point time);
+
+            bool IsActive() const;
+            int GetId() const;
+            const cv::Mat& GetHistogram() const;
+            const cv::RotatedRect& GetBox() const;
+            const cv::Rect& GetBounds() const;
+            const cv::Rect& GetSearchWindow() const;
+            const cv::Mat& GetBackProjection() const;
+        private:
+            /** Whether the tracker is following an object **/
+            bool m_active;
+            /** The target ID **/
+            int m_id;
+            /** The colour model (hue/saturation histogram) **/
+            cv::Mat m_hist;
+            /** The last CamShift result **/
+            cv::RotatedRect m_box;
+            /** The CamShift window (bounds of the object) **/
+            cv::Rect m_bounds;
+            /** Predicts where the object will be **/
+            TrackingWindow m_window;
+            /** The region that was last searched **/
+            cv::Rect m_search;
+            /** Working buffers (back projection of the search window) **/
+            cv::Mat m_backproj, m_mask;
+    };
+
+    /**
+     * A small most-recently-used cache of colour models, so that a model
+     * learned for an object can be reused when the same colour is seen again.
+     */
+    class HistogramCache {
+        public:
+            HistogramCache(size_t capacity = 8, double max_distance = 0.3);
+
+            bool Find(const cv::Mat &hist, cv::Mat *cached);
+            void Store(const cv::Mat &hist);
+            void Clear();
+            size_t Size() const;
+        private:
+            /** The maximum number of models kept **/
+            size_t m_capacity;
+            /** Largest Bhattacharyya distance for two models to be the same colour **/
+            double m_max_distance;
+            /** The models, most recently used first **/
+            std::vector<cv::Mat> m_entries;
+
+            int Closest(const cv::Mat &hist);
+    };
+}
+
+#endif // _PICOPTERX_CAMSHIFT_TRACKER_H
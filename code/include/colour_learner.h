@@ -0,0 +1,67 @@
+/**
+ * @file colour_learner.h
+ * @brief Learns colour thresholds from the pixels in a region of the frame.
+ */
+
+#ifndef _PICOPTERX_COLOUR_LEARNER_H
+#define _PICOPTERX_COLOUR_LEARNER_H
+
+#include <cstdint>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace picopter {
+    /**
+     * Accumulates the colours seen in a region over several frames, and
+     * derives threshold ranges that cover most of them.
+     *
+     * Each sampled pixel is reduced to its colour lookup table cell (see
+     * ColourLUT), so learning costs one index and one increment per pixel,
+     * like thresholding does. The counts are only converted into channel
+     * histograms when the ranges are asked for, by way of a colour cube that
+     * holds each cell's value in the threshold colourspace.
+     *
+     * The counts cover the last `frames` to 2*`frames` frames: they are kept
+     * in two blocks, and the older block is dropped whenever the newer one
+     * fills up. The ranges are the given percentiles of the channel
+     * histograms (taken around the circular mean for hue), widened by a
+     * margin to allow for the size of the cells. Finding them takes a pass
+     * over every cell, so callers need not do so on every frame.
+     */
+    class ColourLearner {
+        public:
+            ColourLearner(int frames = 15, int percentile = 5, int margin = 4);
+            virtual ~ColourLearner() {};
+
+            void Reset(int bits);
+            void Accumulate(const cv::Mat &image, const cv::Rect &roi, int skip);
+            int GetBits() const;
+            uint64_t GetFrames() const;
+            size_t GetEntries() const;
+            uint64_t GetSamples() const;
+            bool GetRange(const uint8_t *plane, int *min, int *max) const;
+            bool GetHueRange(const uint8_t *hue, const uint8_t *sat,
+                int *min, int *max) const;
+        private:
+            /** Frames per block of counts **/
+            int m_frames;
+            /** Fraction (%) of the samples left out at either end of a range **/
+            int m_percentile;
+            /** Amount each range is widened by **/
+            int m_margin;
+            /** The LUT resolution (bits per channel) **/
+            int m_bits;
+            /** Frames accumulated into the newer block **/
+            int m_count;
+            /** Frames accumulated since the last reset **/
+            uint64_t m_total_frames;
+            /** Samples per cell in the newer and older blocks **/
+            std::vector<uint32_t> m_cells[2];
+            /** Samples in the newer and older blocks **/
+            uint64_t m_samples[2];
+
+            void Percentiles(const std::vector<uint64_t> &hist, int *lo, int *hi) const;
+    };
+}
+
+#endif // _PICOPTERX_COLOUR_LEARNER_H
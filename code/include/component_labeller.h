@@ -0,0 +1,67 @@
+/**
+ * @file component_labeller.h
+ * @brief Run-length connected component labelling.
+ */
+
+#ifndef _PICOPTERX_COMPONENT_LABELLER_H
+#define _PICOPTERX_COMPONENT_LABELLER_H
+
+#include <stdint.h>
+#include <vector>
+
+namespace picopter {
+    /**
+     * A horizontal run of set pixels in a binary image.
+     */
+    typedef struct PixelRun {
+        /** The row of the run. **/
+        int y;
+        /** The first pixel of the run. **/
+        int start;
+        /** One past the last pixel of the run. **/
+        int end;
+    } PixelRun;
+
+    /**
+     * A connected component (blob) of a binary image.
+     */
+    typedef struct Blob {
+        /** Number of set pixels. **/
+        int64_t area;
+        /** Sum of the x and y coordinates of the set pixels. **/
+        int64_t sum_x, sum_y;
+        /** Bounding box (inclusive). **/
+        int min_x, min_y, max_x, max_y;
+    } Blob;
+
+    void EncodeRuns(const uint8_t *row, int width, int y, int gap,
+        std::vector<PixelRun> *runs);
+
+    /**
+     * Labels the 8-connected components of a run-length encoded binary image
+     * with union-find over the runs, computing the area, centroid and
+     * bounding box of every component in the same pass. The buffers are
+     * reused between calls, so labelling does not allocate once warmed up.
+     */
+    class ComponentLabeller {
+        public:
+            ComponentLabeller();
+
+            int Label(const PixelRun *runs, size_t count);
+            int Label(const std::vector<PixelRun> &runs);
+            const std::vector<Blob>& GetBlobs() const;
+            int SelectLargest(int k, int64_t min_area, std::vector<Blob> *out);
+        private:
+            /** Union-find parent of each run. **/
+            std::vector<int> m_parent;
+            /** Blob index of each root run. **/
+            std::vector<int> m_blob_index;
+            /** The labelled components. **/
+            std::vector<Blob> m_blobs;
+
+            int Find(int i);
+            void Union(int a, int b);
+    };
+}
+
+#endif // _PICOPTERX_COMPONENT_LABELLER_H
@@ -44,6 +44,8 @@ namespace picopter {
         float lidar;
         /** Gimbal position **/
         navigation::EulerAngle gimbal;
+        /** Aircraft attitude, from the IMU (degrees) **/
+        navigation::EulerAngle attitude;
         
         /** Battery voltage, in Volts **/
         float batt_voltage;
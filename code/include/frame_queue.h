@@ -0,0 +1,164 @@
+/**
+ * @file frame_queue.h
+ * @brief Bounded frame queue used between camera pipeline stages.
+ */
+
+#ifndef _PICOPTERX_FRAME_QUEUE_H
+#define _PICOPTERX_FRAME_QUEUE_H
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <stdint.h>
+
+namespace picopter {
+    /**
+     * A bounded queue of preallocated slots that hands frames from one
+     * pipeline stage to the next.
+     *
+     * Items are exchanged by swapping with the slot contents instead of being
+     * copied, so the image buffers held by each slot circulate between the
+     * producer and the consumer rather than being reallocated every frame.
+     * Pushing never blocks: if the queue is full, the oldest queued item is
+     * dropped to make room (drop-oldest policy), so a slow consumer always
+     * sees the most recent frames.
+     */
+    template <typename T>
+    class FrameQueue {
+        public:
+            FrameQueue(size_t depth);
+            virtual ~FrameQueue() {};
+
+            bool Push(T &item);
+            bool Pop(T &item);
+            void Close(bool drain = false);
+
+            size_t GetDepth();
+            uint64_t GetDropped();
+        private:
+            /** The preallocated slots. **/
+            std::vector<T> m_slots;
+            /** Index of the oldest queued item. **/
+            size_t m_head;
+            /** Number of queued items. **/
+            size_t m_count;
+            /** Number of items dropped because the queue was full. **/
+            uint64_t m_dropped;
+            /** Indicates that the queue has been closed. **/
+            bool m_closed;
+            /** Indicates that queued items may still be popped once closed. **/
+            bool m_drain;
+            /** Mutex protecting the queue state. **/
+            std::mutex m_mutex;
+            /** Signalled when an item is queued or the queue is closed. **/
+            std::condition_variable m_cv;
+
+            /** Copy constructor (disabled) **/
+            FrameQueue(const FrameQueue &other);
+            /** Assignment operator (disabled) **/
+            FrameQueue& operator= (const FrameQueue &other);
+    };
+
+    /**
+     * Constructor. Preallocates the queue slots.
+     * @param [in] depth The maximum number of queued items (at least 1).
+     */
+    template <typename T>
+    FrameQueue<T>::FrameQueue(size_t depth)
+    : m_slots(depth > 0 ? depth : 1)
+    , m_head(0)
+    , m_count(0)
+    , m_dropped(0)
+    , m_closed(false)
+    , m_drain(false)
+    {
+    }
+
+    /**
+     * Queues an item. The item is swapped into a free slot; on return, `item`
+     * holds the previous contents of that slot so its buffers can be reused.
+     * @param [in,out] item The item to queue.
+     * @return true iff the item was queued without dropping an older item.
+     */
+    template <typename T>
+    bool FrameQueue<T>::Push(T &item) {
+        bool dropped = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_closed) {
+                return false;
+            }
+            if (m_count == m_slots.size()) {
+                //Drop the oldest item; its slot becomes the new tail.
+                m_head = (m_head + 1) % m_slots.size();
+                m_count--;
+                m_dropped++;
+                dropped = true;
+            }
+            using std::swap;
+            swap(m_slots[(m_head + m_count) % m_slots.size()], item);
+            m_count++;
+        }
+        m_cv.notify_one();
+        return !dropped;
+    }
+
+    /**
+     * Dequeues the oldest item, blocking until one is available. On return,
+     * the slot holds the previous contents of `item`.
+     * @param [in,out] item The location to store the item.
+     * @return true iff an item was dequeued; false if the queue was closed
+     *         (and, if draining, is empty).
+     */
+    template <typename T>
+    bool FrameQueue<T>::Pop(T &item) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this] { return m_closed || m_count > 0; });
+        if (m_closed && (!m_drain || m_count == 0)) {
+            return false;
+        }
+        using std::swap;
+        swap(m_slots[m_head], item);
+        m_head = (m_head + 1) % m_slots.size();
+        m_count--;
+        return true;
+    }
+
+    /**
+     * Closes the queue, waking any blocked consumer. Subsequent pushes will
+     * fail, as will pops (once the queue is empty, if draining).
+     * @param [in] drain Let the consumer pop the items that are still queued.
+     */
+    template <typename T>
+    void FrameQueue<T>::Close(bool drain) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+            m_drain = drain;
+        }
+        m_cv.notify_all();
+    }
+
+    /**
+     * Retrieves the number of currently queued items.
+     * @return The queue depth.
+     */
+    template <typename T>
+    size_t FrameQueue<T>::GetDepth() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_count;
+    }
+
+    /**
+     * Retrieves the number of items dropped because the queue was full.
+     * @return The drop count.
+     */
+    template <typename T>
+    uint64_t FrameQueue<T>::GetDropped() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_dropped;
+    }
+}
+
+#endif // _PICOPTERX_FRAME_QUEUE_H
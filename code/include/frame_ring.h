@@ -0,0 +1,142 @@
+/**
+ * @file frame_ring.h
+ * @brief Shared memory ring of camera frames for external processes.
+ */
+
+#ifndef _PICOPTERX_FRAME_RING_H
+#define _PICOPTERX_FRAME_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <opencv2/opencv.hpp>
+
+/** Identifies a frame ring ('PXFR') **/
+#define FRAME_RING_MAGIC 0x52465850
+/** Layout version of the frame ring **/
+#define FRAME_RING_VERSION 2
+/** The default shared memory object name **/
+#define FRAME_RING_NAME "/picopter_frames"
+
+namespace picopter {
+    /**
+     * The pose of the aircraft when a frame was captured.
+     */
+    typedef struct FramePose {
+        /** Position (degrees; altitude above ground in m) **/
+        double lat, lon, alt;
+        /** Altitude above mean sea level (m) **/
+        float alt_msl;
+        /** Heading (degrees) **/
+        float heading;
+        /** Aircraft attitude from the IMU (degrees). The yaw is the IMU's,
+            which need not match the heading. **/
+        float roll, pitch, yaw;
+        /** Gimbal orientation (degrees) **/
+        float gimbal_roll, gimbal_pitch, gimbal_yaw;
+        /** LIDAR range (m) **/
+        float lidar;
+    } FramePose;
+
+    /**
+     * Describes a frame in the ring.
+     */
+    typedef struct FrameInfo {
+        /** The frame sequence number (assigned at capture) **/
+        uint64_t id;
+        /** Capture time (steady clock, microseconds) **/
+        int64_t capture_time_us;
+        /** Capture time (UNIX epoch, microseconds) **/
+        int64_t unix_time_us;
+        /** Image dimensions, row stride (bytes) and OpenCV type **/
+        int32_t width, height, stride, type;
+        /** The pose at capture time **/
+        FramePose pose;
+    } FrameInfo;
+
+    /**
+     * Header of each slot. The sequence number is a seqlock: it is odd while
+     * the slot is being written, and changes on every write.
+     */
+    typedef struct FrameRingSlot {
+        std::atomic<uint32_t> sequence;
+        uint32_t reserved;
+        /** The number of frames written before this one **/
+        uint64_t index;
+        FrameInfo info;
+    } FrameRingSlot;
+
+    /**
+     * Header of the shared memory object. It is followed by the slots, each
+     * a FrameRingSlot and then the image data, slot_stride bytes apart.
+     */
+    typedef struct FrameRingHeader {
+        uint32_t magic;
+        uint32_t version;
+        /** Number of slots **/
+        uint32_t slots;
+        /** Largest image (bytes) a slot holds **/
+        uint32_t capacity;
+        /** Offset of the first slot, and distance between slots (bytes) **/
+        uint64_t slot_offset, slot_stride;
+        /** Number of frames written; the latest is in slot (written-1) % slots **/
+        std::atomic<uint64_t> written;
+    } FrameRingHeader;
+
+    /**
+     * Publishes frames into a shared memory ring.
+     *
+     * The writer copies each frame into the next slot once, under the
+     * slot's seqlock. It never waits for readers; a reader that was reading
+     * an overwritten slot sees the sequence change and retries.
+     */
+    class FrameRingWriter {
+        public:
+            FrameRingWriter(const char *name, int slots, size_t capacity);
+            virtual ~FrameRingWriter();
+
+            bool Write(const cv::Mat &image, const FrameInfo &info);
+        private:
+            /** The shared memory object name **/
+            std::string m_name;
+            /** The mapping **/
+            void *m_map;
+            /** Size of the mapping **/
+            size_t m_size;
+            /** The ring header (in the mapping) **/
+            FrameRingHeader *m_header;
+
+            /** Copy constructor (disabled) **/
+            FrameRingWriter(const FrameRingWriter &other);
+            /** Assignment operator (disabled) **/
+            FrameRingWriter& operator= (const FrameRingWriter &other);
+    };
+
+    /**
+     * Reads frames from a shared memory ring. Readers never block the
+     * writer (or each other).
+     */
+    class FrameRingReader {
+        public:
+            FrameRingReader(const char *name = FRAME_RING_NAME);
+            virtual ~FrameRingReader();
+
+            uint64_t GetWritten();
+            bool ReadLatest(cv::Mat *image, FrameInfo *info);
+            bool Read(uint64_t index, cv::Mat *image, FrameInfo *info);
+        private:
+            /** The mapping **/
+            void *m_map;
+            /** Size of the mapping **/
+            size_t m_size;
+            /** The ring header (in the mapping) **/
+            const FrameRingHeader *m_header;
+
+            /** Copy constructor (disabled) **/
+            FrameRingReader(const FrameRingReader &other);
+            /** Assignment operator (disabled) **/
+            FrameRingReader& operator= (const FrameRingReader &other);
+    };
+}
+
+#endif // _PICOPTERX_FRAME_RING_H
@@ -0,0 +1,211 @@
+/**
+ * @file frame_source.h
+ * @brief Sources of camera frames (camera, video file or image directory).
+ */
+
+#ifndef _PICOPTERX_FRAME_SOURCE_H
+#define _PICOPTERX_FRAME_SOURCE_H
+
+#include "opts.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace picopter {
+    /**
+     * The pixel layouts that a source can deliver frames in.
+     */
+    typedef enum FrameFormat {
+        /** Interleaved BGR (CV_8UC3). **/
+        FRAME_BGR = 0,
+        /** Packed YUV 4:2:2, Y0 Cb Y1 Cr (CV_8UC2; BT.601 video range). **/
+        FRAME_YUYV = 1
+    } FrameFormat;
+
+    /**
+     * Keeps a frame buffer lent by a source (see FrameSource::Borrow) from
+     * being reused; the buffer is returned once every copy is released.
+     */
+    typedef std::shared_ptr<const void> FrameLease;
+
+    /**
+     * Buffer statistics of a frame source.
+     */
+    typedef struct SourceStats {
+        /** The number of frames grabbed **/
+        uint64_t frames;
+        /** The number of frames lost because the driver had no free buffer **/
+        uint64_t dropped;
+        /** The number of frames copied rather than lent (buffers ran low) **/
+        uint64_t copied;
+        /** The number of buffers queued to the driver **/
+        int queued;
+        /** The number of buffers lent to the pipeline **/
+        int lent;
+    } SourceStats;
+
+    void ConvertToYUYV(const cv::Mat &bgr, cv::Mat *yuyv);
+
+    /**
+     * A source of frames for the camera stream. A frame is read in two
+     * steps, so that it can be timestamped as soon as it arrives: Grab waits
+     * for the next frame, and Retrieve decodes it.
+     */
+    class FrameSource {
+        public:
+            virtual ~FrameSource() {};
+
+            static FrameSource* Create(Options *opts, int width, int height);
+
+            /**
+             * Waits for the next frame.
+             * @return true iff a frame is available (false at the end of a
+             *         replayed source, or on error).
+             */
+            virtual bool Grab() = 0;
+            /**
+             * Decodes the grabbed frame.
+             * @param [out] image The frame, in the source's format.
+             * @return true iff the frame was decoded.
+             */
+            virtual bool Retrieve(cv::Mat *image) = 0;
+            virtual bool Borrow(cv::Mat *image, FrameLease *lease);
+            virtual bool GetCaptureTime(std::chrono::steady_clock::time_point *time);
+            virtual bool GetStats(SourceStats *stats);
+            /**
+             * Retrieves the pixel layout of the frames.
+             * @return The frame format.
+             */
+            virtual FrameFormat GetFormat() = 0;
+            /**
+             * Retrieves the size of the frames.
+             * @return The frame size.
+             */
+            virtual cv::Size GetSize() = 0;
+            /**
+             * Determines if the frames arrive in real time (a camera, or a
+             * paced replay), as opposed to as fast as they are asked for.
+             * @return true iff the source is real time.
+             */
+            virtual bool IsRealTime() = 0;
+    };
+
+    /**
+     * Frames from a camera (cv::VideoCapture device). If YUYV frames are
+     * requested, the capture is asked for the camera's raw frames; cameras
+     * (or capture backends) that cannot provide them fall back to BGR.
+     */
+    class DeviceSource : public FrameSource {
+        public:
+            DeviceSource(int device, int width, int height, int fps,
+                FrameFormat format = FRAME_BGR);
+            virtual ~DeviceSource() {};
+
+            bool Grab() override;
+            bool Retrieve(cv::Mat *image) override;
+            FrameFormat GetFormat() override;
+            cv::Size GetSize() override;
+            bool IsRealTime() override;
+        private:
+            /** The OpenCV video capture handle **/
+            cv::VideoCapture m_capture;
+            /** The format frames are delivered in **/
+            FrameFormat m_format;
+    };
+
+    /**
+     * Frames replayed from a recording (a video file or a directory of
+     * images), either as fast as they are asked for or paced to real time.
+     * Frames that are not of the requested size are resized. Replaying as
+     * YUYV converts every frame, so it is only useful to exercise the YUYV
+     * processing path offline.
+     */
+    class ReplaySource : public FrameSource {
+        public:
+            ReplaySource(const std::string &path, int width, int height,
+                double fps, bool loop, FrameFormat format = FRAME_BGR);
+            virtual ~ReplaySource() {};
+
+            bool Grab() override;
+            bool Retrieve(cv::Mat *image) override;
+            FrameFormat GetFormat() override;
+            cv::Size GetSize() override;
+            bool IsRealTime() override;
+        private:
+            /** The video file, if replaying one **/
+            cv::VideoCapture m_video;
+            /** The image files, if replaying a directory (sorted) **/
+            std::vector<std::string> m_files;
+            /** The index of the next image file **/
+            size_t m_next;
+            /** The decoded frame (before resizing) **/
+            cv::Mat m_frame;
+            /** The resized frame (YUYV replay only) **/
+            cv::Mat m_resized;
+            /** The format frames are delivered in **/
+            FrameFormat m_format;
+            /** The size frames are resized to **/
+            cv::Size m_size;
+            /** Time between frames (zero: as fast as possible) **/
+            std::chrono::steady_clock::duration m_interval;
+            /** When the next frame is due **/
+            std::chrono::steady_clock::time_point m_due;
+            /** Restart from the beginning at the end **/
+            bool m_loop;
+
+            bool ReadNext(void);
+    };
+
+    /**
+     * Frames from a Video4Linux2 device, using streaming (mmap) I/O. The
+     * driver captures into a ring of mapped buffers. YUYV frames are lent
+     * to the pipeline in place (see Borrow) and each buffer is queued back
+     * to the driver once the last reference to it is released, so frames
+     * are never copied. Frames are stamped with the driver's capture time.
+     */
+    class V4L2Source : public FrameSource {
+        public:
+            V4L2Source(const std::string &device, int width, int height,
+                int fps, FrameFormat format = FRAME_YUYV, int buffers = 6);
+            virtual ~V4L2Source();
+
+            bool Grab() override;
+            bool Retrieve(cv::Mat *image) override;
+            bool Borrow(cv::Mat *image, FrameLease *lease) override;
+            bool GetCaptureTime(std::chrono::steady_clock::time_point *time) override;
+            bool GetStats(SourceStats *stats) override;
+            FrameFormat GetFormat() override;
+            cv::Size GetSize() override;
+            bool IsRealTime() override;
+        private:
+            /** The device and its buffers (shared with the leases) **/
+            struct Device;
+            std::shared_ptr<Device> m_device;
+            /** The format frames are delivered in **/
+            FrameFormat m_format;
+            /** The frame size, and row stride of the buffers (bytes) **/
+            cv::Size m_size;
+            size_t m_stride;
+            /** The grabbed buffer, or -1 **/
+            std::atomic<int> m_current;
+            /** The driver's capture time of the grabbed frame, if known **/
+            std::chrono::steady_clock::time_point m_capture_time;
+            bool m_has_time;
+            /** The driver's sequence number of the last frame **/
+            uint32_t m_sequence;
+            /** Buffer statistics **/
+            std::atomic<uint64_t> m_frames, m_dropped, m_copied;
+
+            void Requeue(void);
+
+            /** Copy constructor (disabled) **/
+            V4L2Source(const V4L2Source &other);
+            /** Assignment operator (disabled) **/
+            V4L2Source& operator= (const V4L2Source &other);
+    };
+}
+
+#endif // _PICOPTERX_FRAME_SOURCE_H
@@ -0,0 +1,85 @@
+/**
+ * @file glyph_library.h
+ * @brief Bit-packed glyph matching.
+ */
+
+#ifndef _PICOPTERX_GLYPH_LIBRARY_H
+#define _PICOPTERX_GLYPH_LIBRARY_H
+
+#include <cstdint>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace picopter {
+    /**
+     * A glyph reduced to a binary grid, packed one bit per cell (row major).
+     */
+    typedef struct GlyphBits {
+        enum {
+            /** Side length of the grid **/
+            GRID = 16,
+            /** Number of cells **/
+            CELLS = GRID * GRID,
+            /** Number of 64-bit words holding the cells **/
+            WORDS = CELLS / 64,
+            /** Side length of the coarse signature cells **/
+            BLOCK = 4,
+            /** Number of coarse signature cells **/
+            BLOCKS = (GRID / BLOCK) * (GRID / BLOCK)
+        };
+        uint64_t words[WORDS];
+    } GlyphBits;
+
+    /**
+     * A library of glyphs that binarised quads are matched against.
+     *
+     * Each glyph is packed into a bit grid for each of its four rotations,
+     * so a match is an XOR and popcount (Hamming distance) per rotation.
+     * Before the full compare, candidates are narrowed by their number of
+     * set cells (kept sorted, so this is a binary search) and then by a
+     * coarse signature of the set cells per block. Both give lower bounds on
+     * the Hamming distance, so they never reject a glyph that would have
+     * matched.
+     */
+    class GlyphLibrary {
+        public:
+            GlyphLibrary();
+
+            static void Pack(const cv::Mat &mask, GlyphBits *bits);
+            static void Rotate(const GlyphBits &bits, GlyphBits *rotated);
+            static int Distance(const GlyphBits &a, const GlyphBits &b);
+
+            void Clear();
+            void Add(int index, const cv::Mat &mask);
+            void Add(int index, const GlyphBits &bits);
+            int Match(const cv::Mat &mask, int max_distance,
+                int *rotation = NULL, int *distance = NULL) const;
+            int Match(const GlyphBits &bits, int max_distance,
+                int *rotation = NULL, int *distance = NULL) const;
+            size_t Size() const;
+        private:
+            /** One rotation of a glyph. **/
+            typedef struct Entry {
+                /** The glyph index given to Add **/
+                int index;
+                /** Number of 90 degree clockwise turns of the glyph **/
+                int rotation;
+                /** Number of set cells **/
+                int count;
+                /** Number of set cells in each coarse block **/
+                uint8_t signature[GlyphBits::BLOCKS];
+                /** The packed cells **/
+                GlyphBits bits;
+            } Entry;
+
+            /** The entries, sorted by number of set cells **/
+            std::vector<Entry> m_entries;
+            /** The number of glyphs added **/
+            size_t m_glyphs;
+
+            static void MakeEntry(int index, int rotation,
+                const GlyphBits &bits, Entry *entry);
+    };
+}
+
+#endif // _PICOPTERX_GLYPH_LIBRARY_H
@@ -0,0 +1,55 @@
+/**
+ * @file hog_detector.h
+ * @brief Multi-scale HOG (people) detection over the thread pool.
+ */
+
+#ifndef _PICOPTERX_HOG_DETECTOR_H
+#define _PICOPTERX_HOG_DETECTOR_H
+
+#include "parallel_for.h"
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace picopter {
+    /**
+     * Detects people with a HOG descriptor over a pyramid of image scales.
+     *
+     * This replaces cv::HOGDescriptor::detectMultiScale. The pyramid levels
+     * and the per-level results are kept between calls, so that detecting
+     * on frames of the same size does not reallocate them, and each level
+     * is searched as one iteration of a parallel-for (largest level first).
+     * The scale range can be narrowed per call, e.g. to the scale of a
+     * person that is already being tracked.
+     */
+    class HOGDetector {
+        public:
+            HOGDetector(ParallelFor *parallel);
+
+            void SetScales(double min_scale, double max_scale, double step);
+            void SetStride(int stride);
+            cv::Size GetWindowSize() const;
+            double GetScaleStep() const;
+            void Detect(const cv::Mat &grey, std::vector<cv::Rect> *found,
+                double min_scale = 0, double max_scale = 0);
+        private:
+            /** The HOG descriptor (with the default people detector) **/
+            cv::HOGDescriptor m_hog;
+            /** Runs the pyramid levels **/
+            ParallelFor *m_parallel;
+            /** Range of scales (image downscaling factors) to search **/
+            double m_min_scale, m_max_scale;
+            /** Ratio between successive pyramid levels **/
+            double m_scale_step;
+            /** Detection window stride (pixels) **/
+            cv::Size m_stride;
+            /** The scale of each pyramid level of the current call **/
+            std::vector<double> m_scales;
+            /** The pyramid levels (buffers kept between calls) **/
+            std::vector<cv::Mat> m_levels;
+            /** Detection window hits and weights of each level **/
+            std::vector<std::vector<cv::Point>> m_hits;
+            std::vector<std::vector<double>> m_weights;
+    };
+}
+
+#endif // _PICOPTERX_HOG_DETECTOR_H
@@ -0,0 +1,58 @@
+/**
+ * @file latency_histogram.h
+ * @brief Fixed-bucket latency histogram.
+ */
+
+#ifndef _PICOPTERX_LATENCY_HISTOGRAM_H
+#define _PICOPTERX_LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace picopter {
+    /**
+     * Summary statistics of a latency histogram (milliseconds). The
+     * percentiles are interpolated within their bucket.
+     */
+    typedef struct LatencySummary {
+        uint64_t count;
+        double mean, max;
+        double p50, p95, p99;
+    } LatencySummary;
+
+    /**
+     * Counts latencies into a fixed set of buckets. Recording is lock free
+     * and never allocates, so it can be done from any thread on every frame.
+     */
+    class LatencyHistogram {
+        public:
+            /** The number of buckets **/
+            static const int BUCKETS = 16;
+            /** Upper bounds of the buckets (us); the last bucket is unbounded **/
+            static const int64_t BOUNDS[BUCKETS - 1];
+
+            LatencyHistogram();
+            virtual ~LatencyHistogram() {};
+
+            void Record(std::chrono::steady_clock::duration latency);
+            void Record(int64_t us);
+            void GetCounts(uint64_t *counts);
+            void GetSummary(LatencySummary *summary);
+            void Reset();
+        private:
+            /** The number of latencies in each bucket **/
+            std::atomic<uint64_t> m_counts[BUCKETS];
+            /** The sum of the latencies (us) **/
+            std::atomic<uint64_t> m_total;
+            /** The largest latency (us) **/
+            std::atomic<int64_t> m_max;
+
+            /** Copy constructor (disabled) **/
+            LatencyHistogram(const LatencyHistogram &other);
+            /** Assignment operator (disabled) **/
+            LatencyHistogram& operator= (const LatencyHistogram &other);
+    };
+}
+
+#endif // _PICOPTERX_LATENCY_HISTOGRAM_H
@@ -0,0 +1,92 @@
+/**
+ * @file mjpeg_server.h
+ * @brief Serves JPEG frames as an MJPEG (multipart) HTTP stream.
+ */
+
+#ifndef _PICOPTERX_MJPEG_SERVER_H
+#define _PICOPTERX_MJPEG_SERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace picopter {
+    /** An encoded JPEG frame, shared by every client sending it. **/
+    typedef std::shared_ptr<const std::vector<uint8_t>> JpegBuffer;
+
+    /**
+     * A minimal HTTP server for the camera stream. It is compatible with the
+     * mjpg-streamer URLs used by the web interface:
+     *   /?action=stream    A multipart/x-mixed-replace stream of frames.
+     *   /?action=snapshot  A single frame.
+     *
+     * Each client is served from its own thread and always sends the latest
+     * frame; frames published while a client is still sending are skipped
+     * for that client, so a slow client never holds up the camera. The
+     * frames are reference counted, so a frame is encoded once no matter
+     * how many clients are sending it. Only so many clients are served at
+     * once, and streaming clients are checked for hangup between frames.
+     */
+    class MjpegServer {
+        public:
+            MjpegServer(uint16_t port);
+            virtual ~MjpegServer();
+
+            bool WantsFrame();
+            void Publish(JpegBuffer jpeg);
+            int GetClients();
+            uint16_t GetPort();
+        private:
+            /** A connected client. **/
+            typedef struct Client {
+                /** The client socket **/
+                int fd;
+                /** The thread serving the client **/
+                std::future<void> thread;
+                /** Set once the client has finished **/
+                std::atomic<bool> done;
+            } Client;
+
+            /** The listening socket **/
+            int m_fd;
+            /** The port that is listened on **/
+            uint16_t m_port;
+            /** Indicates that the server should stop **/
+            std::atomic<bool> m_stop;
+            /** The thread accepting clients **/
+            std::future<void> m_accept_thread;
+            /** The connected clients (accept thread only) **/
+            std::list<Client> m_clients;
+            /** The number of connected clients **/
+            std::atomic<int> m_client_count;
+
+            /** Protects the frame state below **/
+            std::mutex m_mutex;
+            /** Signalled when a frame is published or on shutdown **/
+            std::condition_variable m_frame_cv;
+            /** The latest frame **/
+            JpegBuffer m_latest;
+            /** The number of frames published **/
+            uint64_t m_sequence;
+            /** The number of clients waiting for a new frame **/
+            int m_waiting;
+
+            void AcceptClients();
+            void ServeClient(Client *client);
+            JpegBuffer WaitFrame(uint64_t *sequence, int timeout_ms);
+            bool ClientClosed(int fd);
+            bool SendAll(int fd, const void *data, size_t length);
+
+            /** Copy constructor (disabled) **/
+            MjpegServer(const MjpegServer &other);
+            /** Assignment operator (disabled) **/
+            MjpegServer& operator= (const MjpegServer &other);
+    };
+}
+
+#endif // _PICOPTERX_MJPEG_SERVER_H
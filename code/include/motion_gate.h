@@ -0,0 +1,58 @@
+/**
+ * @file motion_gate.h
+ * @brief Detects when the camera view has not changed.
+ */
+
+#ifndef _PICOPTERX_MOTION_GATE_H
+#define _PICOPTERX_MOTION_GATE_H
+
+#include "frame_ring.h" //For FramePose
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace picopter {
+    /**
+     * Decides whether a frame is unchanged from the last one that was fully
+     * processed, so that its detections can be reused.
+     *
+     * The frame is reduced to the mean brightness of a coarse grid of cells
+     * (sampling a few pixels of each), which is compared against the cells
+     * of the reference frame. The view is unchanged if no cell differs by
+     * more than a threshold and the aircraft and gimbal have not turned (the
+     * heading, the IMU roll and pitch, and the gimbal angles are compared).
+     * Detections are only reused for so many frames in a row, so a slow
+     * change cannot go unnoticed.
+     */
+    class MotionGate {
+        public:
+            /** The size of the grid of cells **/
+            enum {GRID_WIDTH = 16, GRID_HEIGHT = 12};
+
+            MotionGate(int threshold = 12, int max_reuse = 15,
+                double max_rotation = 2.0);
+            virtual ~MotionGate() {};
+
+            bool Unchanged(const cv::Mat &image, const FramePose &pose);
+            void Reset(void);
+        private:
+            /** Largest change in cell brightness that is not motion **/
+            int m_threshold;
+            /** Most consecutive frames whose detections are reused **/
+            int m_max_reuse;
+            /** Largest change in heading, attitude or gimbal angle (degrees) **/
+            double m_max_rotation;
+            /** Cell brightness of the reference frame **/
+            std::vector<int> m_reference;
+            /** Cell brightness of the current frame **/
+            std::vector<int> m_cells;
+            /** Pose at the reference frame **/
+            FramePose m_pose;
+            /** Frames reused since the reference frame **/
+            int m_reused;
+
+            void Measure(const cv::Mat &image, std::vector<int> *cells);
+            bool Turned(const FramePose &pose);
+    };
+}
+
+#endif // _PICOPTERX_MOTION_GATE_H
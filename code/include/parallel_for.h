@@ -0,0 +1,95 @@
+/**
+ * @file parallel_for.h
+ * @brief Allocation-free parallel-for on top of the thread pool.
+ */
+
+#ifndef _PICOPTERX_PARALLEL_FOR_H
+#define _PICOPTERX_PARALLEL_FOR_H
+
+#include "threadpool.h"
+#include <type_traits>
+
+namespace picopter {
+    /**
+     * Runs the iterations of a loop across a set of worker threads.
+     *
+     * The workers are long-lived loops that are queued onto a ThreadPool once,
+     * at construction; they occupy those pool threads until this object is
+     * destroyed. Dispatching a loop only publishes a function pointer and a
+     * context pointer, so running a loop every frame does not allocate. The
+     * calling thread also takes part in the loop.
+     *
+     * Run may be called from several threads (calls are serialised), but must
+     * not be called from inside a loop body.
+     */
+    class ParallelFor {
+        public:
+            ParallelFor(ThreadPool *pool, int workers);
+            virtual ~ParallelFor();
+
+            /**
+             * Calls fn(i) for every i in [0, count), in parallel. Returns
+             * once every iteration has completed. Falls back to running the
+             * loop on the calling thread if there are no workers or only one
+             * iteration.
+             * @param [in] count The number of iterations.
+             * @param [in] fn The loop body, callable as fn(int).
+             */
+            template <typename F>
+            void Run(int count, F&& fn) {
+                typedef typename std::remove_reference<F>::type Fn;
+                if (m_workers.empty() || count <= 1) {
+                    for (int i = 0; i < count; i++) {
+                        fn(i);
+                    }
+                } else {
+                    Dispatch(count, &ParallelFor::Invoke<Fn>,
+                        const_cast<void*>(static_cast<const void*>(&fn)));
+                }
+            }
+
+            int GetThreads();
+        private:
+            /** Type-erased loop body. **/
+            typedef void (*Body)(void *ctx, int i);
+
+            /** Worker loops (running on the pool). **/
+            std::vector<std::future<void>> m_workers;
+            /** Serialises concurrent calls to Run. **/
+            std::mutex m_dispatch_mutex;
+            /** Protects the loop state below. **/
+            std::mutex m_mutex;
+            /** Signalled when a loop is published or on shutdown. **/
+            std::condition_variable m_start_cv;
+            /** Signalled when the last iteration of a loop completes. **/
+            std::condition_variable m_done_cv;
+            /** The current loop body. **/
+            Body m_body;
+            /** The current loop context. **/
+            void *m_ctx;
+            /** Number of iterations in the current loop. **/
+            int m_count;
+            /** The next iteration to hand out. **/
+            int m_next;
+            /** The number of completed iterations. **/
+            int m_done;
+            /** Indicates that the workers should exit. **/
+            bool m_stop;
+
+            template <typename Fn>
+            static void Invoke(void *ctx, int i) {
+                (*static_cast<Fn*>(ctx))(i);
+            }
+
+            void Dispatch(int count, Body body, void *ctx);
+            void RunIterations(std::unique_lock<std::mutex> &lock);
+            void Worker();
+
+            /** Copy constructor (disabled) **/
+            ParallelFor(const ParallelFor &other);
+            /** Assignment operator (disabled) **/
+            ParallelFor& operator= (const ParallelFor &other);
+    };
+}
+
+#endif // _PICOPTERX_PARALLEL_FOR_H
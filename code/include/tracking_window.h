@@ -0,0 +1,59 @@
+/**
+ * @file tracking_window.h
+ * @brief Predictive search window for tracking a detected object.
+ */
+
+#ifndef _PICOPTERX_TRACKING_WINDOW_H
+#define _PICOPTERX_TRACKING_WINDOW_H
+
+#include <chrono>
+#include <opencv2/opencv.hpp>
+
+namespace picopter {
+    /**
+     * Predicts where a tracked object will be in the next frame, so that only
+     * a window around it needs to be processed.
+     *
+     * Once an object has been detected (a lock), the window is centred on the
+     * position predicted from the object's velocity, and is the size of the
+     * object plus a margin. The margin grows with the distance the object
+     * could move in the time since it was last seen. A full frame scan is
+     * requested periodically (to pick up other objects) and whenever the
+     * lock is lost.
+     */
+    class TrackingWindow {
+        public:
+            TrackingWindow(double margin = 0.5, int full_scan_interval = 15,
+                int max_misses = 2);
+
+            void Reset();
+            bool IsLocked() const;
+            bool GetWindow(const cv::Size &frame,
+                std::chrono::steady_clock::time_point now, cv::Rect *window);
+            void Update(std::chrono::steady_clock::time_point time,
+                const cv::Rect *bounds);
+        private:
+            /** Fraction of the object size to add around the object **/
+            double m_margin;
+            /** Number of windowed frames between full frame scans **/
+            int m_full_scan_interval;
+            /** Number of consecutive misses before the lock is lost **/
+            int m_max_misses;
+            /** Whether an object is currently locked **/
+            bool m_locked;
+            /** Number of consecutive frames the object was not found **/
+            int m_misses;
+            /** Number of windowed frames since the last full scan **/
+            int m_windowed;
+            /** Last known centre of the object (pixels) **/
+            double m_cx, m_cy;
+            /** Estimated velocity of the object (pixels/second) **/
+            double m_vx, m_vy;
+            /** Last known size of the object **/
+            cv::Size m_size;
+            /** Time at which the object was last seen **/
+            std::chrono::steady_clock::time_point m_last_seen;
+    };
+}
+
+#endif // _PICOPTERX_TRACKING_WINDOW_H
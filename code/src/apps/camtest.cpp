@@ -1,10 +1,11 @@
 /**
  * @file camtest.cpp
- * @brief Camera testing routine for thresholding
+ * @brief Camera testing routine for thresholding, and camera benchmarks
  */
 
 #include <cstdio>
 #include <cstdlib>
+#include <ctime>
 #include "common.h"
 #include "camera_stream.h"
  
@@ -12,13 +13,17 @@ using picopter::CameraStream;
 using picopter::Options;
 using picopter::ThresholdParams;
 using picopter::ThresholdColourspace;
+using picopter::LatencySummary;
+using picopter::SourceStats;
+
+typedef picopter::ColourLUT<4> LUT;
 
 #define BLACK 0
 #define WHITE 255
 
 cv::Mat g_src, g_proc;
 ThresholdParams g_thresh;
-uint8_t g_lut[THRESH_SIZE][THRESH_SIZE][THRESH_SIZE];
+uint8_t g_lut[LUT::ENTRIES];
 
 void RGB2HSV(uint8_t r, uint8_t g, uint8_t b, uint8_t *h, uint8_t *s, uint8_t *v) {
     uint8_t rgb_max = std::max(r, std::max(g, b));
@@ -51,36 +56,37 @@ void RGB2YCbCr(uint8_t r, uint8_t g, uint8_t b, uint8_t *y, uint8_t *cb, uint8_t
     *cr = 0.500 * r - 0.418688 * g - 0.081312 * b + 128;
 }
 
-void BuildThreshold(uint8_t lookup[][THRESH_SIZE][THRESH_SIZE], ThresholdParams thresh) {
-    uint8_t r, g, b;
-    for(r = 0; r < THRESH_SIZE; r++) {
-        for(g = 0; g < THRESH_SIZE; g++) {
-            for(b = 0; b < THRESH_SIZE; b++) {
-                lookup[r][g][b] = 0;
+void BuildThreshold(uint8_t *lookup, ThresholdParams thresh) {
+    int r, g, b;
+    for(r = 0; r < LUT::SIZE; r++) {
+        for(g = 0; g < LUT::SIZE; g++) {
+            for(b = 0; b < LUT::SIZE; b++) {
+                uint8_t *cell = &lookup[(r << (2*LUT::BITS)) | (g << LUT::BITS) | b];
+                *cell = 0;
 
                 if (thresh.colourspace == ThresholdColourspace::THRESH_HSV) {
                     uint8_t h, s, v;
-                    RGB2HSV(UNREDUCE(r), UNREDUCE(g), UNREDUCE(b), &h, &s, &v);
+                    RGB2HSV(LUT::Unreduce(r), LUT::Unreduce(g), LUT::Unreduce(b), &h, &s, &v);
 
                     if (v >= thresh.p3_min && v <= thresh.p3_max &&
                         s >= thresh.p2_min && s <= thresh.p2_max) {
                         if (thresh.p1_min < 0) {
                             if ((h >= thresh.p1_min+180 && h <= 180) ||
                                 (h >= 0 && h <= thresh.p1_max)) {
-                                    lookup[r][g][b] = 1;
+                                    *cell = 1;
                                 }
                         } else if (h >= thresh.p1_min && h <= thresh.p1_max) {
-                            lookup[r][g][b] = 1;
+                            *cell = 1;
                         }
                     }
                 } else if (thresh.colourspace == ThresholdColourspace::THRESH_YCbCr) {
                     uint8_t y, cb, cr;
-                    RGB2YCbCr(UNREDUCE(r), UNREDUCE(g), UNREDUCE(b), &y, &cb, &cr);
+                    RGB2YCbCr(LUT::Unreduce(r), LUT::Unreduce(g), LUT::Unreduce(b), &y, &cb, &cr);
 
                     if (y >= thresh.p1_min && y <= thresh.p1_max &&
                         cb >= thresh.p2_min && cb <= thresh.p2_max &&
                         cr >= thresh.p3_min && cr <= thresh.p3_max) {
-                        lookup[r][g][b] = 1;
+                        *cell = 1;
                     }
                 }
             }
@@ -88,7 +94,7 @@ void BuildThreshold(uint8_t lookup[][THRESH_SIZE][THRESH_SIZE], ThresholdParams
     }
 }
 
-void Threshold(uint8_t thresh[][THRESH_SIZE][THRESH_SIZE], const cv::Mat& src, cv::Mat &out, int width) {
+void Threshold(const uint8_t *thresh, const cv::Mat& src, cv::Mat &out, int width) {
     int i, j, k;
     const uint8_t* srcp;
     uint8_t* destp;
@@ -101,7 +107,7 @@ void Threshold(uint8_t thresh[][THRESH_SIZE][THRESH_SIZE], const cv::Mat& src, c
         destp = out.ptr<uint8_t>(j);
         for (i=0; i < out.cols; i++) {
             k = i*nChannels*skip;
-            if(thresh[srcp[k+2]/THRESH_DIV][srcp[k+1]/THRESH_DIV][srcp[k]/THRESH_DIV]) {
+            if(thresh[LUT::Index(srcp[k+2], srcp[k+1], srcp[k])]) {
                 destp[i] = WHITE;
             } else {
                 destp[i] = BLACK;
@@ -121,9 +127,171 @@ void on_call(int p, void* unused) {
     cv::imshow("Threshold", tmp);
 }
  
+/**
+ * Parses a comma separated list of widths.
+ * @param [in] list The list (e.g. "320,640").
+ * @return The widths.
+ */
+std::vector<int> ParseWidths(const char *list) {
+    std::vector<int> widths;
+    while (*list) {
+        char *end;
+        int width = strtol(list, &end, 10);
+        if (width > 0) {
+            widths.push_back(width);
+        }
+        list = *end ? end + 1 : end;
+    }
+    return widths;
+}
+
+/**
+ * Retrieves the CPU time used by the process (all threads).
+ * @return The CPU time, in seconds.
+ */
+double CpuTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Benchmarks every camera mode, at each input and processing width, on a
+ * replayed recording or a V4L2 device. Prints one JSON object per run.
+ */
+int Bench(int argc, char *argv[]) {
+    static const std::pair<CameraStream::CameraMode, const char*> modes[] = {
+        {CameraStream::MODE_NO_PROCESSING, "none"},
+        {CameraStream::MODE_COM, "com"},
+        {CameraStream::MODE_CAMSHIFT, "camshift"},
+        {CameraStream::MODE_CONNECTED_COMPONENTS, "connected_components"},
+        {CameraStream::MODE_CANNY_GLYPH, "canny_glyph"},
+        {CameraStream::MODE_THRESH_GLYPH, "thresh_glyph"},
+        {CameraStream::MODE_HOUGH, "hough"},
+        {CameraStream::MODE_HOG_PEOPLE, "hog_people"},
+        {CameraStream::MODE_LEARN_COLOUR, "learn_colour"}
+    };
+    static const char *stages[CameraStream::LATENCY_STAGES] = {
+        "grab", "threshold", "detect", "overlay",
+        "encode", "stream", "result", "decision"
+    };
+    std::vector<int> input_widths{320, 640}, process_widths{80, 160, 320};
+    const char *source = NULL, *options = NULL;
+    double seconds = 5, warmup = 1;
+    bool real_time = false;
+
+    for (int i = 0; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "-o" && i + 1 < argc) {
+            options = argv[++i];
+        } else if (arg == "-i" && i + 1 < argc) {
+            input_widths = ParseWidths(argv[++i]);
+        } else if (arg == "-p" && i + 1 < argc) {
+            process_widths = ParseWidths(argv[++i]);
+        } else if (arg == "-t" && i + 1 < argc) {
+            seconds = std::max(atof(argv[++i]), 0.5);
+        } else if (arg == "-r") {
+            real_time = true;
+        } else if (!source && arg[0] != '-') {
+            source = argv[i];
+        } else {
+            source = NULL;
+            break;
+        }
+    }
+    if (!source) {
+        fprintf(stderr, "Usage: camtest --bench source [-o options] "
+            "[-i input widths] [-p process widths] [-t seconds] [-r]\n"
+            "  source  A video file, directory of images or V4L2 device\n"
+            "  -i, -p  Comma separated widths (default: 320,640 and 80,160,320)\n"
+            "  -t      Seconds to measure each run for (default: 5)\n"
+            "  -r      Replay in real time, instead of as fast as possible\n");
+        return 1;
+    }
+
+    Options opts(options);
+    opts.SetFamily("GLOBAL");
+    opts.Set("DEMO_MODE", false);
+
+    for (int input_width : input_widths) {
+        for (int process_width : process_widths) {
+            if (process_width > input_width) {
+                continue;
+            }
+            for (const auto &mode : modes) {
+                opts.SetFamily("CAMERA_STREAM");
+                opts.Set("SOURCE", source);
+                opts.Set("SOURCE_FPS", real_time ? -1 : 0);
+                opts.Set("SOURCE_LOOP", true);
+                opts.Set("INPUT_WIDTH", input_width);
+                opts.Set("INPUT_HEIGHT", (input_width * 3) / 4);
+                opts.Set("PROCESS_WIDTH", process_width);
+                opts.Set("STREAM_PORT", 0);
+                opts.Set("FRAME_RING", false);
+
+                try {
+                    CameraStream cam(&opts);
+                    LatencySummary summary;
+
+                    cam.SetMode(mode.first);
+                    std::this_thread::sleep_for(
+                        std::chrono::duration<double>(warmup));
+                    cam.ResetLatency();
+                    double cpu_start = CpuTime();
+                    auto start = std::chrono::steady_clock::now();
+                    std::this_thread::sleep_for(
+                        std::chrono::duration<double>(seconds));
+                    double cpu = CpuTime() - cpu_start;
+                    double elapsed = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start).count();
+
+                    cam.GetLatency(CameraStream::LATENCY_DETECT, &summary);
+                    uint64_t frames = summary.count;
+                    printf("{\"mode\": \"%s\", \"input_width\": %d, "
+                        "\"input_height\": %d, \"process_width\": %d, "
+                        "\"frames\": %llu, \"fps\": %.2f, "
+                        "\"cpu_ms_per_frame\": %.3f, \"latency_ms\": {",
+                        mode.second, cam.GetInputWidth(), cam.GetInputHeight(),
+                        std::min(process_width, cam.GetInputWidth()),
+                        static_cast<unsigned long long>(frames),
+                        frames / elapsed, frames ? (cpu * 1000) / frames : 0.0);
+                    for (int stage = 0; stage < CameraStream::LATENCY_STAGES; stage++) {
+                        cam.GetLatency(static_cast<CameraStream::LatencyStage>(stage),
+                            &summary);
+                        printf("%s\"%s\": {\"n\": %llu, \"mean\": %.3f, "
+                            "\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, "
+                            "\"max\": %.3f}", stage ? ", " : "", stages[stage],
+                            static_cast<unsigned long long>(summary.count),
+                            summary.mean, summary.p50, summary.p95,
+                            summary.p99, summary.max);
+                    }
+                    printf("}");
+                    SourceStats source_stats;
+                    if (cam.GetSourceStats(&source_stats)) {
+                        printf(", \"source\": {\"frames\": %llu, "
+                            "\"dropped\": %llu, \"copied\": %llu}",
+                            static_cast<unsigned long long>(source_stats.frames),
+                            static_cast<unsigned long long>(source_stats.dropped),
+                            static_cast<unsigned long long>(source_stats.copied));
+                    }
+                    printf("}\n");
+                    fflush(stdout);
+                } catch (const std::invalid_argument &e) {
+                    fprintf(stderr, "Cannot benchmark %s: %s\n", source, e.what());
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
+    if (argc >= 2 && std::string(argv[1]) == "--bench") {
+        return Bench(argc - 2, argv + 2);
+    } else if (argc < 3) {
         printf("Usage: %s options file1 [files...]\n", argv[0]);
+        printf("       %s --bench source [-o options] [-i widths] [-p widths] [-t seconds] [-r]\n", argv[0]);
         return 1;
     }
     
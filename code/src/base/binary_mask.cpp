@@ -0,0 +1,273 @@
+/**
+ * @file binary_mask.cpp
+ * @brief Run-length encoded binary image.
+ */
+
+#include "common.h"
+#include "binary_mask.h"
+#include <algorithm>
+
+using namespace picopter;
+
+/**
+ * Constructor. Creates an empty mask.
+ */
+BinaryMask::BinaryMask()
+: m_width(0)
+, m_height(0)
+, m_next_row(0)
+{
+}
+
+/**
+ * Clears the mask. The run arena keeps its capacity.
+ * @param [in] width The mask width.
+ * @param [in] height The mask height.
+ */
+void BinaryMask::Reset(int width, int height) {
+    m_width = width;
+    m_height = height;
+    m_runs.clear();
+    m_row_start.resize(height);
+    m_next_row = 0;
+}
+
+/**
+ * Marks every row up to and including the given row as added.
+ * @param [in] y The row.
+ */
+void BinaryMask::StartRows(int y) {
+    while (m_next_row <= y && m_next_row < m_height) {
+        m_row_start[m_next_row++] = m_runs.size();
+    }
+}
+
+/**
+ * Encodes a thresholded row as the next row of the mask.
+ * @param [in] row The thresholded row (non-zero = set; width pixels).
+ * @param [in] gap Gaps of up to this many pixels are closed (see EncodeRuns).
+ */
+void BinaryMask::AddRow(const uint8_t *row, int gap) {
+    int y = m_next_row;
+    if (y < m_height) {
+        StartRows(y);
+        EncodeRuns(row, m_width, y, gap, &m_runs);
+    }
+}
+
+/**
+ * Appends runs that have already been encoded.
+ * @param [in] runs The runs, in row order, all below the rows already added.
+ * @param [in] count The number of runs.
+ */
+void BinaryMask::AddRuns(const PixelRun *runs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        StartRows(runs[i].y);
+        m_runs.push_back(runs[i]);
+    }
+}
+
+/**
+ * Appends runs that have already been encoded.
+ * @param [in] runs The runs (see above).
+ */
+void BinaryMask::AddRuns(const std::vector<PixelRun> &runs) {
+    AddRuns(runs.data(), runs.size());
+}
+
+/**
+ * Encodes a dense (byte per pixel) mask.
+ * @param [in] mask The mask (CV_8UC1; non-zero = set).
+ * @param [in] gap Gaps of up to this many pixels are closed (see EncodeRuns).
+ */
+void BinaryMask::FromMat(const cv::Mat &mask, int gap) {
+    Reset(mask.cols, mask.rows);
+    for (int y = 0; y < mask.rows; y++) {
+        AddRow(mask.ptr<uint8_t>(y), gap);
+    }
+}
+
+/**
+ * Renders the mask as a dense image (e.g. for display).
+ * @param [out] out The rendered mask (CV_8UC1; 255 = set).
+ */
+void BinaryMask::ToMat(cv::Mat &out) const {
+    ToMat(out, cv::Rect(0, 0, m_width, m_height));
+}
+
+/**
+ * Renders part of the mask as a dense image.
+ * @param [out] out The rendered region (CV_8UC1; 255 = set).
+ * @param [in] roi The region of the mask to render.
+ */
+void BinaryMask::ToMat(cv::Mat &out, const cv::Rect &roi) const {
+    out.create(roi.height, roi.width, CV_8UC1);
+    for (int y = 0; y < roi.height; y++) {
+        uint8_t *destp = out.ptr<uint8_t>(y);
+        size_t begin, end;
+
+        memset(destp, 0, roi.width);
+        GetRow(roi.y + y, &begin, &end);
+        for (size_t i = begin; i < end; i++) {
+            int start = std::max(m_runs[i].start, roi.x);
+            int stop = std::min(m_runs[i].end, roi.x + roi.width);
+            if (start < stop) {
+                memset(destp + start - roi.x, 255, stop - start);
+            }
+        }
+    }
+}
+
+/**
+ * Retrieves the width of the mask.
+ * @return The mask width.
+ */
+int BinaryMask::GetWidth() const {
+    return m_width;
+}
+
+/**
+ * Retrieves the height of the mask.
+ * @return The mask height.
+ */
+int BinaryMask::GetHeight() const {
+    return m_height;
+}
+
+/**
+ * Retrieves the runs of the mask.
+ * @return The runs, ordered by row and then by start.
+ */
+const std::vector<PixelRun>& BinaryMask::GetRuns() const {
+    return m_runs;
+}
+
+/**
+ * Retrieves the runs of one row.
+ * @param [in] y The row.
+ * @param [out] begin The index of the first run of the row.
+ * @param [out] end One past the index of the last run of the row.
+ */
+void BinaryMask::GetRow(int y, size_t *begin, size_t *end) const {
+    if (y < 0) {
+        *begin = *end = 0;
+        return;
+    }
+    *begin = y < m_next_row ? m_row_start[y] : m_runs.size();
+    *end = y + 1 < m_next_row ? m_row_start[y + 1] : m_runs.size();
+}
+
+/**
+ * Computes the number of set pixels.
+ * @return The area of the mask.
+ */
+int64_t BinaryMask::Area() const {
+    int64_t area = 0;
+    for (const PixelRun &run : m_runs) {
+        area += run.end - run.start;
+    }
+    return area;
+}
+
+/**
+ * Computes the raw spatial moments of the mask. Each run contributes its
+ * length, its sum of x and (optionally) its sum of x^2; the y terms follow
+ * from those.
+ * @param [in] second_order true iff m20, m02 and m11 should be computed.
+ * @return The moments.
+ */
+MaskMoments BinaryMask::Moments(bool second_order) const {
+    MaskMoments m = {};
+
+    for (const PixelRun &run : m_runs) {
+        int64_t len = run.end - run.start, y = run.y;
+        int64_t sx = (len * (run.start + run.end - 1)) / 2;
+
+        m.m00 += len;
+        m.m10 += sx;
+        m.m01 += len * y;
+        if (second_order) {
+            //Sum of squares of [start, end)
+            int64_t a = run.start - 1, b = run.end - 1;
+            m.m20 += (b*(b+1)*(2*b+1) - a*(a+1)*(2*a+1)) / 6;
+            m.m02 += len * y * y;
+            m.m11 += sx * y;
+        }
+    }
+    return m;
+}
+
+/**
+ * Computes the bounding box of the set pixels.
+ * @param [out] bounds The bounding box.
+ * @return true iff the mask is not empty.
+ */
+bool BinaryMask::BoundingBox(cv::Rect *bounds) const {
+    if (m_runs.empty()) {
+        return false;
+    }
+
+    int min_x = m_runs.front().start, max_x = m_runs.front().end;
+    for (const PixelRun &run : m_runs) {
+        min_x = std::min(min_x, run.start);
+        max_x = std::max(max_x, run.end);
+    }
+
+    int min_y = m_runs.front().y, max_y = m_runs.back().y;
+    *bounds = cv::Rect(min_x, min_y, max_x - min_x, max_y - min_y + 1);
+    return true;
+}
+
+/**
+ * Computes the number of pixels that are set in both masks.
+ * @param [in] other The other mask.
+ * @return The area of the intersection.
+ */
+int64_t BinaryMask::Overlap(const BinaryMask &other) const {
+    int height = std::min(m_height, other.m_height);
+    int64_t area = 0;
+
+    for (int y = 0; y < height; y++) {
+        size_t a, a_end, b, b_end;
+        GetRow(y, &a, &a_end);
+        other.GetRow(y, &b, &b_end);
+
+        while (a < a_end && b < b_end) {
+            const PixelRun &ra = m_runs[a], &rb = other.m_runs[b];
+            int start = std::max(ra.start, rb.start);
+            int stop = std::min(ra.end, rb.end);
+            if (start < stop) {
+                area += stop - start;
+            }
+            //Advance whichever run finishes first.
+            if (ra.end < rb.end) {
+                a++;
+            } else {
+                b++;
+            }
+        }
+    }
+    return area;
+}
+
+/**
+ * Computes the number of set pixels within a region.
+ * @param [in] roi The region.
+ * @return The area of the mask within the region.
+ */
+int64_t BinaryMask::Overlap(const cv::Rect &roi) const {
+    int64_t area = 0;
+
+    for (int y = std::max(roi.y, 0); y < roi.y + roi.height; y++) {
+        size_t begin, end;
+        GetRow(y, &begin, &end);
+        for (size_t i = begin; i < end; i++) {
+            int start = std::max(m_runs[i].start, roi.x);
+            int stop = std::min(m_runs[i].end, roi.x + roi.width);
+            if (start < stop) {
+                area += stop - start;
+            }
+        }
+    }
+    return area;
+}
@@ -12,10 +12,17 @@
 
 using picopter::CameraStream;
 using picopter::CameraGlyph;
+using picopter::GlyphBits;
 using picopter::Options;
 using namespace rapidjson;
 
 #define GLYPH_BLACK_THRESHOLD 140
+/** Downscaling of the processing image used to propose glyph regions **/
+#define GLYPH_GATE_SKIP 4
+/** Most glyph regions proposed per frame **/
+#define GLYPH_MAX_CANDIDATES 8
+/** Smallest dark region (pixels at the gate resolution) that may be a glyph **/
+#define GLYPH_MIN_CANDIDATE 6
 
 /**
  * Unpacks a glyph from the given options entry.
@@ -61,9 +68,18 @@ static void GlyphUnpickler(const void *val, void *closure) {
  * @param [in] opts The instance to load glyphs from.
  */
 void CameraStream::LoadGlyphs(Options *opts) {
+    //Default to 15% of the glyph cells.
+    m_glyph_max_distance = (15 * GlyphBits::CELLS) / 100;
     if (opts) {
         opts->SetFamily("CAMERA_GLYPHS");
         opts->GetList("GLYPH_LIST", (void*)&m_glyphs, GlyphUnpickler);
+        m_glyph_max_distance = (picopter::clamp(opts->GetInt(
+            "GLYPH_MAX_DISTANCE", 15), 0, 50) * GlyphBits::CELLS) / 100;
+    }
+
+    m_glyph_library.Clear();
+    for (size_t i = 0; i < m_glyphs.size(); i++) {
+        m_glyph_library.Add(static_cast<int>(i), m_glyphs[i].image);
     }
 }
 
@@ -135,67 +151,51 @@ static bool WarpPerspective(cv::Mat &in, cv::Mat &out, std::vector<cv::Point2f>
 }
 
 /**
- * Attempts to match the provided image with a known glyph.
+ * Attempts to match the provided image with a known glyph. The image is
+ * binarised and packed, then matched against every glyph in every
+ * rotation by Hamming distance.
  * @param [in] src The source image. Only used to get image bounds.
  * @param [in] roi The image to match to a glpyh.
  * @param [in] bounds The bounding rectangle of the glyph.
  * @return true iff glyphs were matched.
  */
 bool CameraStream::GlyphDetection(cv::Mat &src, cv::Mat& roi, cv::Rect bounds) {
-    bool ret = false;
+    int rotation, distance;
     cv::Mat rquad;
     ObjectInfo obj{};
-    
-    //Perform initial resize.
-    if (m_glyphs.size() > 0) {
-        cv::resize(roi, rquad, 
-            cv::Size(m_glyphs[0].image.cols, m_glyphs[0].image.rows));
-        cv::cvtColor(rquad, rquad, CV_BGR2GRAY);
-        cv::inRange(rquad, cv::Scalar(0), cv::Scalar(GLYPH_BLACK_THRESHOLD), rquad);
+
+    if (m_glyph_library.Size() == 0) {
+        return false;
     }
-    
-    for(size_t i = 0; i < m_glyphs.size(); i++) {
-        //Resize if necessary
-        if (rquad.cols != m_glyphs[i].image.cols || rquad.rows != m_glyphs[i].image.rows) {
-            cv::resize(roi, rquad, 
-                cv::Size(m_glyphs[i].image.cols, m_glyphs[i].image.rows));
-            cv::cvtColor(rquad, rquad, CV_BGR2GRAY);
-            cv::inRange(rquad, cv::Scalar(0), cv::Scalar(GLYPH_BLACK_THRESHOLD), rquad);
-        }
-        
-        //Display the warped and resized image
-        if (m_demo_mode) {
-            cv::imshow("Test", rquad);
-            //cv::imwrite("test.png", rquad);
-            //cv::waitKey(0);
-        }
-        
-        //Perform template matching. This is the bottleneck if the template image is large.
-        cv::Mat result(1, 1, CV_32FC1);
-        cv::matchTemplate(rquad, m_glyphs[i].image, result, CV_TM_CCORR_NORMED);
 
-        //Get the correlation value (no need for minMaxLoc - one result only)
-        //double minVal; double maxVal;
-        //cv::minMaxLoc(result, &minVal, &maxVal, NULL, NULL, cv::Mat());
-        
-        //Check goodness of fit. If good, add it.
-        if (result.at<float>(0,0) > 0.8) {
-            Log(LOG_DEBUG, "DETECTED %d<%s>! %.2f", 
-                m_glyphs[i].id, m_glyphs[i].description.c_str(),
-                result.at<float>(0,0));
-            obj.id = m_glyphs[i].id;
-            obj.image_width = src.cols;
-            obj.image_height = src.rows;
-            obj.bounds = bounds;
-            obj.position = navigation::Point2D{
-                obj.bounds.x + obj.bounds.width/2.0,
-                obj.bounds.y + obj.bounds.height/2.0};
-            m_detected.push_back(obj);
-            
-            ret = true;
-        }
+    cv::cvtColor(roi, rquad, CV_BGR2GRAY);
+    cv::inRange(rquad, cv::Scalar(0), cv::Scalar(GLYPH_BLACK_THRESHOLD), rquad);
+
+    //Display the warped image
+    if (m_demo_mode) {
+        cv::imshow("Test", rquad);
     }
-    return ret;
+
+    int match = m_glyph_library.Match(rquad, m_glyph_max_distance,
+        &rotation, &distance);
+    if (match < 0) {
+        return false;
+    }
+
+    const CameraGlyph &glyph = m_glyphs[match];
+    Log(LOG_DEBUG, "DETECTED %d<%s>! %d/%d", glyph.id,
+        glyph.description.c_str(), distance, static_cast<int>(GlyphBits::CELLS));
+    obj.id = glyph.id;
+    obj.image_width = src.cols;
+    obj.image_height = src.rows;
+    obj.bounds = bounds;
+    obj.position = navigation::Point2D{
+        obj.bounds.x + obj.bounds.width/2.0,
+        obj.bounds.y + obj.bounds.height/2.0};
+    //The glyph appears turned clockwise by this much.
+    obj.orientation = rotation * M_PI / 2;
+    m_detected.push_back(obj);
+    return true;
 }
 
 /**
@@ -229,22 +229,90 @@ bool CameraStream::GlyphContourDetection(cv::Mat& src, std::vector<std::vector<c
 }
 
 /**
- * Perform glyph detection. Potential glyphs are first found using Canny
- * line detection to detect square objects.
+ * Proposes regions that may contain a glyph. Glyphs have a dark border, so
+ * the dark regions of a low resolution copy of the image are labelled and
+ * the roughly square ones are kept (largest first). Overlapping regions
+ * are merged.
+ * @param [in] gray The greyscale image (processing resolution).
+ * @param [out] candidates The candidate regions (processing resolution).
+ */
+void CameraStream::GlyphCandidates(const cv::Mat& gray, std::vector<cv::Rect> *candidates) {
+    cv::Rect frame(0, 0, gray.cols, gray.rows);
+
+    cv::resize(gray, m_glyph_gate, cv::Size(gray.cols / GLYPH_GATE_SKIP,
+        gray.rows / GLYPH_GATE_SKIP), 0, 0, cv::INTER_AREA);
+    cv::inRange(m_glyph_gate, cv::Scalar(0),
+        cv::Scalar(GLYPH_BLACK_THRESHOLD), m_glyph_gate);
+    m_mask.FromMat(m_glyph_gate);
+    m_labeller.Label(m_mask.GetRuns());
+    m_labeller.SelectLargest(GLYPH_MAX_CANDIDATES, GLYPH_MIN_CANDIDATE, &m_blobs);
+
+    candidates->clear();
+    for (const Blob &blob : m_blobs) {
+        int width = blob.max_x - blob.min_x + 1;
+        int height = blob.max_y - blob.min_y + 1;
+        if (width > 3 * height || height > 3 * width) {
+            continue;
+        }
+
+        //Back to the processing resolution, with a margin for the edges.
+        int margin = GLYPH_GATE_SKIP * 2;
+        cv::Rect r((blob.min_x * GLYPH_GATE_SKIP) - margin,
+            (blob.min_y * GLYPH_GATE_SKIP) - margin,
+            width * GLYPH_GATE_SKIP + 2 * margin,
+            height * GLYPH_GATE_SKIP + 2 * margin);
+        r &= frame;
+
+        //Merge with any candidate it overlaps.
+        for (size_t i = 0; i < candidates->size();) {
+            if (((*candidates)[i] & r).area() > 0) {
+                r |= (*candidates)[i];
+                candidates->erase(candidates->begin() + i);
+                i = 0;
+            } else {
+                i++;
+            }
+        }
+        candidates->push_back(r);
+    }
+}
+
+/**
+ * Perform glyph detection. Potential glyphs are first proposed by a cheap
+ * dark region gate (see GlyphCandidates); only those regions are then
+ * searched for square objects with Canny edge detection.
  * @param [in] src The source image to search for a glyph.
  * @param [in] proc The process buffer.
  * @return true iff glyph was detected.
  */
 bool CameraStream::CannyGlyphDetection(cv::Mat& src, cv::Mat& proc) {
+    std::vector<std::vector<cv::Point>> contours, roi_contours;
+    std::vector<cv::Rect> candidates;
     cv::Mat gray;
     //Downscale
     cv::resize(src, gray, cv::Size(PROCESS_WIDTH, PROCESS_HEIGHT));
     //Convert to grayscale
     cv::cvtColor(gray, gray, CV_BGR2GRAY);
-    //Blur it a bit
-    cv::GaussianBlur(gray, gray, cv::Size(5,5), 0);
-    //Apply Canny detection
-    cv::Canny(gray, proc, 100, 200);
+
+    GlyphCandidates(gray, &candidates);
+    proc = cv::Mat::zeros(gray.size(), CV_8UC1);
+    for (const cv::Rect &roi : candidates) {
+        cv::Mat blurred, edges = proc(roi);
+
+        //Blur it a bit, then apply Canny detection
+        cv::GaussianBlur(gray(roi), blurred, cv::Size(5,5), 0);
+        cv::Canny(blurred, edges, 100, 200);
+
+        //Find the contours and keep the largest of each candidate. The
+        //edges are copied, as findContours modifies its input and proc is
+        //what the backend shows.
+        cv::findContours(edges.clone(), roi_contours, cv::RETR_LIST,
+            cv::CHAIN_APPROX_SIMPLE, roi.tl());
+        std::sort(roi_contours.begin(), roi_contours.end(), ContourSort);
+        for (size_t i = 0; i < roi_contours.size() && i < 3; i++) {
+            contours.push_back(std::move(roi_contours[i]));
+        }
+    }
     
     if (m_demo_mode) {
         cv::imshow("Thresholded image", proc);
@@ -252,14 +320,6 @@ bool CameraStream::CannyGlyphDetection(cv::Mat& src, cv::Mat& proc) {
         cv::waitKey(1);
     }
     
-    //Find the contours in the image and sort in descending order of contour area.
-    std::vector<std::vector<cv::Point>> contours;
-    cv::findContours(proc, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
-    std::sort(contours.begin(), contours.end(), ContourSort);
-    if (contours.size() > 10) {
-        contours.resize(10);
-    }
-    
     //Translate from threshold point space back into source point space.
     //I'm sure there's an OpenCV way to do this with matrices, but whatever.
     for (size_t i = 0; i < contours.size(); i++) {
@@ -283,27 +343,37 @@ bool CameraStream::CannyGlyphDetection(cv::Mat& src, cv::Mat& proc) {
  * @return true iff glyph was detected.
  */
 bool CameraStream::ThresholdingGlyphDetection(cv::Mat& src, cv::Mat& threshold) {
-    //Threshold the image.
-    Threshold(src, threshold, PROCESS_WIDTH);
-
-    //Blur, dilate and erode the image
-    cv::Mat elementDilate(8, 8, CV_8U, cv::Scalar(255));
-    cv::Mat elementErode(8, 8, CV_8U, cv::Scalar(255));
+    std::vector<std::vector<cv::Point>> contours, blob_contours;
+    cv::Mat patch;
 
-    cv::dilate(threshold, threshold, elementDilate);
-    cv::erode(threshold, threshold, elementErode);
+    //Threshold the image, closing small gaps.
+    ThresholdMask(src, PROCESS_WIDTH, m_cc_gap, &m_mask);
+    if (m_demo_mode || m_show_backend) {
+        m_mask.ToMat(threshold);
+    }
 
     if (m_demo_mode) {
         cv::imshow("Thresholded image", threshold);
         cv::waitKey(1);
     }
 
-    //Find the contours (connected components)
-    std::vector<std::vector<cv::Point>> contours;
-    cv::findContours(threshold, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
-    std::sort(contours.begin(), contours.end(), ContourSort);
-    if (contours.size() > 10) {
-        contours.resize(10);
+    //Find the connected components, and only trace the outlines of the
+    //largest ten (each within its own bounding box).
+    m_labeller.Label(m_mask.GetRuns());
+    m_labeller.SelectLargest(10, 10, &m_blobs);
+    for (size_t i = 0; i < m_blobs.size(); i++) {
+        const Blob &blob = m_blobs[i];
+        cv::Rect bounds(blob.min_x, blob.min_y,
+            blob.max_x - blob.min_x + 1, blob.max_y - blob.min_y + 1);
+
+        m_mask.ToMat(patch, bounds);
+        cv::findContours(patch, blob_contours, cv::RETR_EXTERNAL,
+            cv::CHAIN_APPROX_SIMPLE, bounds.tl());
+        if (!blob_contours.empty()) {
+            //ContourSort orders by decreasing area.
+            contours.push_back(std::move(*std::min_element(
+                blob_contours.begin(), blob_contours.end(), ContourSort)));
+        }
     }
     
     //Translate from threshold point space back into source point space.
@@ -0,0 +1,151 @@
+/**
+ * @file camera_governor.cpp
+ * @brief Trades camera quality for detection rate.
+ */
+
+#include "common.h"
+#include "camera_governor.h"
+
+using namespace picopter;
+
+/** Weight of each new frame time in the smoothed frame time **/
+#define GOVERNOR_GAIN 0.1
+/** Step down when frames take longer than this fraction of the budget **/
+#define GOVERNOR_HIGH 1.0
+/** Step up when frames take less than this fraction of the budget **/
+#define GOVERNOR_LOW 0.6
+
+/**
+ * Constructor. Starts at the best settings.
+ * @param [in] bounds The limits on what may be changed.
+ * @param [in] target_fps The detection rate to aim for.
+ * @param [in] holdoff Frames to wait after a step before stepping again (the
+ *                     wait before stepping back up is three times longer).
+ */
+CameraGovernor::CameraGovernor(const GovernorBounds &bounds, double target_fps,
+    int holdoff)
+: m_levels(BuildLevels(bounds))
+, m_level(0)
+, m_budget(1000.0 / std::max(target_fps, 0.1))
+, m_average(-1)
+, m_holdoff(std::max(holdoff, 1))
+, m_since_step(0)
+{
+}
+
+/**
+ * Builds the levels from the best settings to the cheapest.
+ * @param [in] bounds The limits on what may be changed.
+ * @return The levels (at least one).
+ */
+std::vector<GovernorLevel> CameraGovernor::BuildLevels(const GovernorBounds &bounds) {
+    std::vector<GovernorLevel> levels;
+    int input_width = std::max(bounds.input_width, 1);
+    int max_width = picopter::clamp(bounds.max_process_width, 1, input_width);
+    int min_width = picopter::clamp(bounds.min_process_width, 1, max_width);
+    GovernorLevel level{max_width, bounds.pixel_threshold,
+        std::max(bounds.min_stream_interval, 1), true, true};
+
+    levels.push_back(level);
+    while (level.stream_interval * 2 <= bounds.max_stream_interval) {
+        level.stream_interval *= 2;
+        levels.push_back(level);
+    }
+    if (bounds.shed_hud) {
+        level.hud = false;
+        levels.push_back(level);
+    }
+    //Each processing width is the input width divided by an integer pixel
+    //skip, rounded down (so 320 / 3 gives 106); PIXEL_SKIP is that skip.
+    //The pixel threshold is an area, so it scales with the square of the width.
+    for (int skip = input_width / max_width + 1; input_width / skip >= min_width; skip++) {
+        level.process_width = input_width / skip;
+        level.pixel_threshold = static_cast<int>(
+            (static_cast<int64_t>(bounds.pixel_threshold) *
+            level.process_width * level.process_width) / (max_width * max_width));
+        levels.push_back(level);
+    }
+    if (bounds.shed_record) {
+        level.record = false;
+        levels.push_back(level);
+    }
+    return levels;
+}
+
+/**
+ * Records how long a frame took to process, and steps the level if needed.
+ * @param [in] frame_ms The frame processing time (ms).
+ * @return true iff the level changed.
+ */
+bool CameraGovernor::Update(double frame_ms) {
+    if (m_average < 0) {
+        m_average = frame_ms;
+    } else {
+        m_average += GOVERNOR_GAIN * (frame_ms - m_average);
+    }
+
+    m_since_step++;
+    if (m_average > m_budget * GOVERNOR_HIGH && m_since_step >= m_holdoff &&
+        m_level < static_cast<int>(m_levels.size()) - 1)
+    {
+        m_level++;
+    } else if (m_average < m_budget * GOVERNOR_LOW &&
+        m_since_step >= 3 * m_holdoff && m_level > 0)
+    {
+        m_level--;
+    } else {
+        return false;
+    }
+
+    //Let the new settings take effect before judging them.
+    m_since_step = 0;
+    m_average = -1;
+    return true;
+}
+
+/**
+ * Retrieves the current level.
+ * @return The level (0 is the best settings).
+ */
+int CameraGovernor::GetLevel() {
+    return m_level;
+}
+
+/**
+ * Retrieves the number of levels.
+ * @return The number of levels.
+ */
+int CameraGovernor::GetLevels() {
+    return static_cast<int>(m_levels.size());
+}
+
+/**
+ * Retrieves the settings at the current level.
+ * @return The settings.
+ */
+const GovernorLevel& CameraGovernor::GetSettings() {
+    return m_levels[m_level];
+}
+
+/**
+ * Retrieves the smoothed frame processing time.
+ * @return The frame time (ms), or -1 if not yet known.
+ */
+double CameraGovernor::GetFrameTime() {
+    return m_average;
+}
+
+/**
+ * Describes the current level, for logging.
+ * @return The description.
+ */
+std::string CameraGovernor::Describe() {
+    const GovernorLevel &level = GetSettings();
+    char buf[192];
+
+    snprintf(buf, sizeof(buf), "level %d/%d (budget %.1fms): process width %d (min area %d), "
+        "stream every %dms, HUD %s, recording %s", m_level, GetLevels() - 1,
+        m_budget, level.process_width, level.pixel_threshold, level.stream_interval,
+        level.hud ? "on" : "off", level.record ? "on" : "off");
+    return buf;
+}
@@ -6,9 +6,14 @@
 #include "common.h"
 #include "camera_stream.h"
 #include "flightboard.h"
+#include <limits>
 
 #define BLACK 0
 #define WHITE 255
+/** Frames between updates of the learnt thresholds **/
+#define LEARN_UPDATE_FRAMES 5
+/** Most row bands thresholding can be split into **/
+#define MAX_THRESHOLD_BANDS 16
 
 using namespace picopter;
 using namespace picopter::navigation;
@@ -33,15 +38,37 @@ const std::vector<cv::Scalar> CameraStream::m_colours {
  * @param [in] opts A pointer to options, if any (NULL for defaults).
  */
 CameraStream::CameraStream(Options *opts)
-: m_capture(-1)
+: m_source(nullptr)
 , m_stop{false}
 , m_mode(MODE_NO_PROCESSING)
+, m_mode_requested{MODE_NO_PROCESSING}
 , m_pool(4)
+, m_parallel(&m_pool, 3)
+, m_capture_queue(PIPELINE_DEPTH)
+, m_overlay_queue(PIPELINE_DEPTH)
+, m_stream_queue(1)
+, m_record_queue(PIPELINE_DEPTH)
+, m_photo_queue(PHOTO_QUEUE_DEPTH)
 , m_fps(-1)
 , m_show_backend(false)
-, m_save_photo(false)
+, m_backend_requested{false}
+, m_photos_pending{0}
+, m_photos_saved{0}
+, m_photos_failed{0}
+, m_streamed{0}
 , m_hud{}
+, m_hud_version(0)
+, m_hud_drawn{}
 , m_arrow{}
+, m_hog(&m_parallel)
+, m_stream_interval{0}
+, m_hud_enabled{true}
+, m_record_enabled{true}
+, m_governor(nullptr)
+, m_governor_log(nullptr)
+, m_motion_gate(nullptr)
+, m_gate_found(false)
+, m_frames_reused{0}
 {
     Options clear;
     if (!opts) {
@@ -58,6 +85,33 @@ CameraStream::CameraStream(Options *opts)
     PROCESS_WIDTH = opts->GetInt("PROCESS_WIDTH", 160);
     STREAM_WIDTH  = opts->GetInt("STREAM_WIDTH", 320);
     LEARN_SIZE    = picopter::clamp(opts->GetInt("LEARN_SIZE", 50), 20, 100);
+    //Learn from the last LEARN_FRAMES or so frames, leaving out the outer
+    //LEARN_PERCENTILE% of the colours seen.
+    m_learner = ColourLearner(opts->GetInt("LEARN_FRAMES", 15),
+        opts->GetInt("LEARN_PERCENTILE", 5), opts->GetInt("LEARN_MARGIN", 4));
+    //Number of row bands to split thresholding into (1 = serial)
+    THRESHOLD_BANDS = picopter::clamp(opts->GetInt("THRESHOLD_BANDS",
+        m_parallel.GetThreads()), 1, MAX_THRESHOLD_BANDS);
+    m_com_orientation = opts->GetBool("COM_ORIENTATION", false);
+    m_cc_full_res = opts->GetBool("CC_FULL_RES", false);
+    m_cc_gap = picopter::clamp(opts->GetInt("CC_GAP", 7), 0, 32);
+    m_band_runs.resize(MAX_THRESHOLD_BANDS);
+    //Search only around a tracked object, with a full scan every so often
+    m_track_window = opts->GetBool("TRACK_WINDOW", true);
+    double track_margin = picopter::clamp(opts->GetInt("TRACK_MARGIN", 50), 0, 400) / 100.0;
+    int track_misses = std::max(opts->GetInt("TRACK_MAX_MISSES", 2), 0);
+    m_tracking = TrackingWindow(track_margin,
+        std::max(opts->GetInt("TRACK_FULL_SCAN", 15), 0), track_misses);
+    //CamShift targets are found by connected components, so their trackers
+    //never need a full scan.
+    m_target_window = TrackingWindow(track_margin,
+        m_track_window ? std::numeric_limits<int>::max() : 0, track_misses);
+    //Number of CamShift targets, and frames between searching for new ones
+    CAMSHIFT_TARGETS = picopter::clamp(opts->GetInt("CAMSHIFT_TARGETS", 3), 1, 8);
+    CAMSHIFT_ACQUIRE = std::max(opts->GetInt("CAMSHIFT_ACQUIRE", 10), 1);
+    m_trackers.resize(CAMSHIFT_TARGETS);
+    m_next_target = 0;
+    m_acquire_count = 0;
 
     //Set the default hue thresholds
     m_thresholds.p1_min = opts->GetInt("MIN_HUE", -10);
@@ -68,17 +122,12 @@ CameraStream::CameraStream(Options *opts)
     m_thresholds.p3_max = opts->GetInt("MAX_VAL", 255);
     m_thresholds.colourspace = THRESH_HSV;
     m_learning_thresholds.colourspace = THRESH_HSV;
+    m_learn_colourspace = THRESH_HSV;
 
-   if (!m_capture.isOpened()) {
-        Log(LOG_WARNING, "cv::VideoCapture failed.");
-        throw std::invalid_argument("Could not open camera stream.");
-    }
-    m_capture.set(CV_CAP_PROP_FRAME_WIDTH, INPUT_WIDTH);
-    m_capture.set(CV_CAP_PROP_FRAME_HEIGHT, INPUT_HEIGHT);
-    m_capture.set(CV_CAP_PROP_FPS, 30);
-
-    INPUT_WIDTH  = m_capture.get(CV_CAP_PROP_FRAME_WIDTH);
-    INPUT_HEIGHT = m_capture.get(CV_CAP_PROP_FRAME_HEIGHT);
+    //Open the camera (or the recording to replay)
+    m_source = FrameSource::Create(opts, INPUT_WIDTH, INPUT_HEIGHT);
+    INPUT_WIDTH  = m_source->GetSize().width;
+    INPUT_HEIGHT = m_source->GetSize().height;
 
     //If process resolution is larger than input resolution, don't resize
     if (PROCESS_WIDTH > INPUT_WIDTH) {
@@ -91,11 +140,79 @@ CameraStream::CameraStream(Options *opts)
     PIXEL_THRESHOLD	= opts->GetInt("PIXEL_THRESHOLD", (30 * INPUT_WIDTH) / 320);
     PIXEL_SKIP = INPUT_WIDTH / PROCESS_WIDTH;
 
+    //Select the thresholding kernel for this CPU
+    m_threshold_kernel = THRESH_KERNEL_SCALAR;
+    if (opts->GetBool("THRESHOLD_SIMD", true)) {
+        m_threshold_kernel = DetectThresholdKernel();
+    }
+    Log(LOG_INFO, "Using the %s thresholding kernel",
+        GetThresholdKernelName(m_threshold_kernel));
+
     //Initialise the thresholding lookup table
-    BuildThreshold(m_lookup_threshold, m_thresholds);
+    m_thresh_bits = picopter::clamp(opts->GetInt("THRESH_BITS", 4), 4, 6);
+    {
+        std::lock_guard<std::mutex> build_lock(m_build_mutex);
+        RebuildThreshold(m_thresholds, m_thresh_bits);
+    }
+
+    //Initialise the HOG detector (scales in percent)
+    m_hog.SetScales(opts->GetInt("HOG_MIN_SCALE", 100) / 100.0,
+        opts->GetInt("HOG_MAX_SCALE", 800) / 100.0,
+        opts->GetInt("HOG_SCALE_STEP", 105) / 100.0);
+    m_hog.SetStride(opts->GetInt("HOG_STRIDE", 8));
+
+    //Serve the web stream (compatible with mjpg-streamer's URLs)
+    int stream_port = opts->GetInt("STREAM_PORT", 5000);
+    m_stream_interval = 1000 / picopter::clamp(opts->GetInt("STREAM_MAX_FPS", 15), 1, 60);
+    m_server = nullptr;
+    if (stream_port > 65535) {
+        Log(LOG_WARNING, "Invalid stream port %d; not streaming", stream_port);
+    } else if (stream_port > 0) {
+        try {
+            m_server = new MjpegServer(static_cast<uint16_t>(stream_port));
+            Log(LOG_INFO, "Streaming on port %d", m_server->GetPort());
+        } catch (const std::invalid_argument &e) {
+            Log(LOG_WARNING, "Cannot serve the stream: %s", e.what());
+        }
+    }
+
+    //Trade quality for detection rate, if enabled
+    if (opts->GetBool("GOVERNOR", false)) {
+        GovernorBounds bounds;
+        bounds.input_width = INPUT_WIDTH;
+        bounds.max_process_width = PROCESS_WIDTH;
+        bounds.min_process_width = opts->GetInt("GOVERNOR_MIN_WIDTH",
+            std::min(PROCESS_WIDTH, 80));
+        bounds.pixel_threshold = PIXEL_THRESHOLD;
+        bounds.min_stream_interval = m_stream_interval;
+        bounds.max_stream_interval = opts->GetInt("GOVERNOR_MAX_STREAM_INTERVAL", 1000);
+        bounds.shed_hud = opts->GetBool("GOVERNOR_SHED_HUD", true);
+        bounds.shed_record = opts->GetBool("GOVERNOR_SHED_RECORD", false);
+        m_governor = new CameraGovernor(bounds,
+            picopter::clamp(opts->GetInt("GOVERNOR_FPS", 10), 1, 60));
+        m_governor_log = new DataLog("camera_governor");
+        m_governor_log->Write(": Start: %s", m_governor->Describe().c_str());
+    }
+
+    //Reuse the detections while the view is unchanged, if enabled
+    if (opts->GetBool("MOTION_GATE", false)) {
+        m_motion_gate = new MotionGate(
+            picopter::clamp(opts->GetInt("MOTION_THRESHOLD", 12), 0, 255),
+            std::max(opts->GetInt("MOTION_MAX_REUSE", 15), 0),
+            std::max(opts->GetInt("MOTION_MAX_ROTATION", 2), 0));
+    }
 
-    //Initialise the HOG detector
-    m_hog.setSVMDetector(cv::HOGDescriptor::getDefaultPeopleDetector());
+    //Publish the captured frames to other processes
+    m_ring = nullptr;
+    if (opts->GetBool("FRAME_RING", false)) {
+        try {
+            m_ring = new FrameRingWriter(FRAME_RING_NAME,
+                picopter::clamp(opts->GetInt("FRAME_RING_SLOTS", 4), 2, 32),
+                INPUT_WIDTH * INPUT_HEIGHT * 3);
+        } catch (const std::invalid_argument &e) {
+            Log(LOG_WARNING, "Cannot create the frame ring: %s", e.what());
+        }
+    }
 
     //Determine if we're running in demo mode.
     opts->SetFamily("GLOBAL");
@@ -113,9 +230,28 @@ CameraStream::CameraStream(Options *opts)
     }
 #endif
 
-    //Start the worker thread.
+    //Nothing has been processed yet.
+    auto snapshot = std::make_shared<CameraSnapshot>();
+    snapshot->mode = MODE_NO_PROCESSING;
+    snapshot->fps = m_fps;
+    snapshot->learned = m_learning_thresholds;
+    m_snapshot = std::move(snapshot);
+
+    //Start the pipeline stages (capture -> detect -> overlay -> sinks).
+    //Each sink has its own queue and thread, so a slow sink (e.g. writing
+    //photos to the SD card) never holds up detection or the other sinks.
+    m_stream_thread = std::async(std::launch::async,
+        &CameraStream::EncodeStream, this);
+    m_record_thread = std::async(std::launch::async,
+        &CameraStream::RecordFrames, this);
+    m_photo_thread = std::async(std::launch::async,
+        &CameraStream::SavePhotos, this);
+    m_overlay_thread = std::async(std::launch::async,
+        &CameraStream::OverlayFrames, this);
     m_worker_thread = std::async(std::launch::async,
         &CameraStream::ProcessImages, this);
+    m_capture_thread = std::async(std::launch::async,
+        &CameraStream::CaptureFrames, this);
 }
 
 /**
@@ -124,10 +260,49 @@ CameraStream::CameraStream(Options *opts)
  */
 CameraStream::~CameraStream() {
     m_stop = true;
-    if (m_worker_thread.valid()) {
-        m_worker_thread.wait();
+    m_capture_queue.Close();
+    m_overlay_queue.Close();
+    m_stream_queue.Close();
+    m_record_queue.Close();
+    for (auto *t : {&m_capture_thread, &m_worker_thread, &m_overlay_thread,
+                    &m_stream_thread, &m_record_thread}) {
+        if (t->valid()) {
+            t->wait();
+        }
+    }
+    //Only stop the photo sink once it has saved everything it was given.
+    m_photo_queue.Close(true);
+    if (m_photo_thread.valid()) {
+        m_photo_thread.wait();
     }
 
+    Log(LOG_INFO, "Pipeline frames dropped: %llu (capture), %llu (overlay), "
+        "%llu (stream), %llu (record)",
+        static_cast<unsigned long long>(m_capture_queue.GetDropped()),
+        static_cast<unsigned long long>(m_overlay_queue.GetDropped()),
+        static_cast<unsigned long long>(m_stream_queue.GetDropped()),
+        static_cast<unsigned long long>(m_record_queue.GetDropped()));
+    SourceStats source_stats;
+    if (m_source->GetStats(&source_stats)) {
+        Log(LOG_INFO, "Source frames: %llu (%llu dropped, %llu copied)",
+            static_cast<unsigned long long>(source_stats.frames),
+            static_cast<unsigned long long>(source_stats.dropped),
+            static_cast<unsigned long long>(source_stats.copied));
+    }
+    Log(LOG_INFO, "Frames with reused detections: %llu",
+        static_cast<unsigned long long>(m_frames_reused.load()));
+    Log(LOG_INFO, "Photos saved: %llu (%llu failed)",
+        static_cast<unsigned long long>(m_photos_saved.load()),
+        static_cast<unsigned long long>(m_photos_failed.load()));
+    DataLog latency_log("camera_latency");
+    LogLatency(&latency_log);
+
+    delete m_server;
+    delete m_ring;
+    delete m_source;
+    delete m_governor;
+    delete m_governor_log;
+    delete m_motion_gate;
 #ifdef IS_ON_PI
     delete m_enc;
 #endif
@@ -144,27 +319,69 @@ CameraStream::~CameraStream() {
  * @param [in,out] objects The list of detected objects.
  */
 void CameraStream::GetDetectedObjects(std::vector<ObjectInfo> *objects) {
-    std::lock_guard<std::mutex> lock(m_worker_mutex);
-    *objects = m_detected;
+    *objects = GetSnapshot()->detected;
+}
+
+/**
+ * Retrieves the results of the most recently processed frame. This never
+ * waits for the frame being processed.
+ * @return The latest results (never NULL).
+ */
+std::shared_ptr<const CameraSnapshot> CameraStream::GetSnapshot(void) {
+    return std::atomic_load(&m_snapshot);
 }
 
 /**
  * Retrieves the current mode of the camera.
- * @return The current camera mode.
+ * @return The current camera mode (the last one set, which takes effect
+ *         from the next frame).
  */
 CameraStream::CameraMode CameraStream::GetMode(void) {
-    std::lock_guard<std::mutex> lock(m_worker_mutex);
-    return m_mode;
+    return m_mode_requested;
 }
 
 /**
- * Sets the mode of the camera.
+ * Sets the mode of the camera. The mode takes effect from the next frame.
  * @param [in] mode The mode to set the camera to.
  */
 CameraStream::CameraMode CameraStream::SetMode(CameraMode mode) {
-    std::lock_guard<std::mutex> lock(m_worker_mutex);
-    m_mode = mode;
-    return m_mode;
+    m_mode_requested = mode;
+    PostCommand([this, mode] {
+        if (mode != m_mode) {
+            m_tracking.Reset();
+            StopTrackers();
+            m_learner.Reset(m_learner.GetBits());
+        }
+        m_mode = mode;
+    });
+    return mode;
+}
+
+/**
+ * Queues a change for the processing thread to apply before it processes
+ * the next frame, so that callers never wait for a frame to finish.
+ * @param [in] command The change to make (run on the processing thread).
+ */
+void CameraStream::PostCommand(std::function<void()> command) {
+    std::lock_guard<std::mutex> lock(m_command_mutex);
+    m_commands.push_back(std::move(command));
+}
+
+/**
+ * Applies the queued changes. Called by the processing thread between frames.
+ * @return true iff any changes were applied.
+ */
+bool CameraStream::RunCommands() {
+    {
+        std::lock_guard<std::mutex> lock(m_command_mutex);
+        m_commands.swap(m_pending_commands);
+    }
+    for (auto &command : m_pending_commands) {
+        command();
+    }
+    bool applied = !m_pending_commands.empty();
+    m_pending_commands.clear();
+    return applied;
 }
 
 /**
@@ -188,10 +405,11 @@ int CameraStream::GetInputHeight() {
  * @param [out] config The location to store the camera configuration.
  */
 void CameraStream::GetConfig(Options *config) {
-    std::lock_guard<std::mutex> lock(m_worker_mutex);
+    std::lock_guard<std::mutex> lock(m_config_mutex);
     config->SetFamily("CAMERA_STREAM");
 
     config->Set("THRESH_COLOURSPACE", m_thresholds.colourspace);
+    config->Set("THRESH_BITS", m_thresh_bits);
     if (m_thresholds.colourspace == THRESH_HSV) {
         config->Set("MIN_HUE", m_thresholds.p1_min);
         config->Set("MAX_HUE", m_thresholds.p1_max);
@@ -207,7 +425,7 @@ void CameraStream::GetConfig(Options *config) {
         config->Set("MIN_Cr", m_thresholds.p3_min);
         config->Set("MAX_Cr", m_thresholds.p3_max);
     }
-    config->Set("SHOW_BACKEND", m_show_backend);
+    config->Set("SHOW_BACKEND", m_backend_requested.load());
 }
 
 /**
@@ -215,13 +433,19 @@ void CameraStream::GetConfig(Options *config) {
  * @param [in] config The configuration to use.
  */
 void CameraStream::SetConfig(Options *config) {
-    std::lock_guard<std::mutex> lock(m_worker_mutex);
-    bool refresh = false, decrease = false;
+    std::lock_guard<std::mutex> build_lock(m_build_mutex);
+    std::unique_lock<std::mutex> lock(m_config_mutex);
+    bool refresh = false, decrease = false, show_backend;
     int colourspace = m_thresholds.colourspace;
 
     config->SetFamily("CAMERA_STREAM");
-    config->GetBool("SHOW_BACKEND", &m_show_backend);
-
+    if (config->GetBool("SHOW_BACKEND", &show_backend)) {
+        m_backend_requested = show_backend;
+        PostCommand([this, show_backend] {
+            m_show_backend = show_backend;
+        });
+    }
+    refresh |= config->GetInt("THRESH_BITS", &m_thresh_bits, 4, 6);
 
     config->GetInt("THRESH_COLOURSPACE", &colourspace);
     switch(colourspace) {
@@ -245,18 +469,22 @@ void CameraStream::SetConfig(Options *config) {
             break;
     }
 
-    m_learning_thresholds.colourspace = m_thresholds.colourspace;
+    ThresholdColourspace learn_colourspace = m_thresholds.colourspace;
+    bool resize = config->GetBool("SET_LEARNING_SIZE", &decrease);
+    PostCommand([this, learn_colourspace, resize, decrease] {
+        m_learning_thresholds.colourspace = learn_colourspace;
+        if (resize) {
+            LEARN_SIZE = picopter::clamp(LEARN_SIZE + (decrease ? -10 : 10), 10, 100);
+            m_learner.Reset(m_learner.GetBits());
+        }
+    });
 
     if (refresh) {
-        BuildThreshold(m_lookup_threshold, m_thresholds);
-    }
-
-    if (config->GetBool("SET_LEARNING_SIZE", &decrease)) {
-        if (decrease) {
-            LEARN_SIZE = picopter::clamp(LEARN_SIZE-10, 10, 100);
-        } else {
-            LEARN_SIZE = picopter::clamp(LEARN_SIZE+10, 10, 100);
-        }
+        //Build the new table without holding up the camera.
+        ThresholdParams thresh = m_thresholds;
+        int bits = m_thresh_bits;
+        lock.unlock();
+        RebuildThreshold(thresh, bits);
     }
 }
 
@@ -267,41 +495,65 @@ void CameraStream::SetConfig(Options *config) {
 void CameraStream::SetHUDInfo(HUDInfo *hud) {
     std::lock_guard<std::mutex> lock(m_aux_mutex);
     m_hud = *hud;
+    m_hud_version++;
 }
 
 /**
  * Perform camera auto learning.
  */
 void CameraStream::DoAutoLearning() {
-    std::lock_guard<std::mutex> lock(m_worker_mutex);
-    if (m_mode == CameraMode::MODE_LEARN_COLOUR) {
-        if (m_learning_thresholds.colourspace == THRESH_HSV) {
-            m_thresholds.p1_min = m_learning_thresholds.p1_min;
-            m_thresholds.p1_max = m_learning_thresholds.p1_max;
-        } else if (m_learning_thresholds.colourspace == THRESH_YCbCr) {
-            m_thresholds.p2_min = m_learning_thresholds.p2_min;
-            m_thresholds.p2_max = m_learning_thresholds.p2_max;
-            m_thresholds.p3_min = m_learning_thresholds.p3_min;
-            m_thresholds.p3_max = m_learning_thresholds.p3_max;
+    std::lock_guard<std::mutex> build_lock(m_build_mutex);
+    std::shared_ptr<const CameraSnapshot> snapshot = GetSnapshot();
+    const ThresholdParams &learned = snapshot->learned;
+
+    //Only use thresholds learnt in the current (learning) mode.
+    if (m_mode_requested == CameraMode::MODE_LEARN_COLOUR &&
+        snapshot->mode == CameraMode::MODE_LEARN_COLOUR)
+    {
+        std::unique_lock<std::mutex> lock(m_config_mutex);
+        if (learned.colourspace != m_thresholds.colourspace) {
+            return;
+        } else if (learned.colourspace == THRESH_HSV) {
+            m_thresholds.p1_min = learned.p1_min;
+            m_thresholds.p1_max = learned.p1_max;
+        } else if (learned.colourspace == THRESH_YCbCr) {
+            m_thresholds.p2_min = learned.p2_min;
+            m_thresholds.p2_max = learned.p2_max;
+            m_thresholds.p3_min = learned.p3_min;
+            m_thresholds.p3_max = learned.p3_max;
         }
-        BuildThreshold(m_lookup_threshold, m_thresholds);
+
+        ThresholdParams thresh = m_thresholds;
+        int bits = m_thresh_bits;
+        lock.unlock();
+        RebuildThreshold(thresh, bits);
     }
 }
 
 /**
- * Take a single photo.
+ * Take a single photo, from the next captured frame. The photo is saved in
+ * the background; once accepted, it is never dropped.
  * @param [in] filename Location to store the photo.
  * @return true iff the photo will be taken. This function may return false if
- *         it is in the process of taking another photo.
+ *         too many photos are already waiting to be saved.
  */
 bool CameraStream::TakePhoto(std::string filename) {
-    std::lock_guard<std::mutex> lock(m_worker_mutex);
-    if (!m_save_photo && !filename.empty()) {
-        m_save_filename = filename;
-        m_save_photo = true;
-        return true;
+    if (filename.empty()) {
+        return false;
     }
-    return false;
+
+    //Reserve its place in the photo queue, so that it cannot overflow.
+    int pending = m_photos_pending;
+    do {
+        if (pending >= PHOTO_QUEUE_DEPTH) {
+            return false;
+        }
+    } while (!m_photos_pending.compare_exchange_weak(pending, pending + 1));
+
+    PostCommand([this, filename] {
+        m_photo_requests.push_back(filename);
+    });
+    return true;
 }
 
 /**
@@ -318,47 +570,162 @@ void CameraStream::SetTrackingArrow(navigation::Point3D arrow) {
 //Private methods
 
 /**
- * Worker thread. Processes the images as necessary.
+ * Capture stage. Grabs frames from the camera and hands them to the
+ * processing stage.
+ */
+void CameraStream::CaptureFrames() {
+    CameraFrame frame{};
+    uint64_t frame_id = 0;
+    bool real_time = m_source->IsRealTime();
+    bool yuyv = m_source->GetFormat() == FRAME_YUYV;
+
+    while (!m_stop) {
+        //A buffer lent by the source is no longer referenced by now (the
+        //overlay stage releases it); make sure it goes back before grabbing.
+        if (frame.lease) {
+            frame.yuv.release();
+            frame.lease.reset();
+        }
+
+        //A replay that is not paced only reads a frame once there is room
+        //for it, instead of decoding frames that would just be dropped.
+        if (!real_time && m_capture_queue.GetDepth() >= PIPELINE_DEPTH) {
+            sleep_for(milliseconds(1));
+            continue;
+        }
+
+        //Stamp the frame as soon as it has arrived, before decoding it.
+        if (!m_source->Grab()) {
+            sleep_for(milliseconds(5));
+            continue;
+        }
+        frame.capture_time = steady_clock::now();
+        m_source->GetCaptureTime(&frame.capture_time);
+        if (!m_source->Borrow(yuyv ? &frame.yuv : &frame.image, &frame.lease)) {
+            sleep_for(milliseconds(5));
+            continue;
+        }
+        frame.has_image = !yuyv;
+        frame.id = frame_id++;
+        RecordLatency(LATENCY_GRAB, steady_clock::now() - frame.capture_time);
+        if (m_ring) {
+            PublishFrame(frame);
+        }
+        m_capture_queue.Push(frame);
+    }
+}
+
+/**
+ * Retrieves the current pose of the aircraft (as last given to SetHUDInfo).
+ * @param [out] pose The pose.
+ */
+void CameraStream::GetPose(FramePose *pose) {
+    std::lock_guard<std::mutex> lock(m_aux_mutex);
+    pose->lat = m_hud.pos.lat;
+    pose->lon = m_hud.pos.lon;
+    pose->alt = m_hud.pos.alt;
+    pose->alt_msl = m_hud.alt_msl;
+    pose->heading = m_hud.heading;
+    pose->roll = m_hud.attitude.roll;
+    pose->pitch = m_hud.attitude.pitch;
+    pose->yaw = m_hud.attitude.yaw;
+    pose->gimbal_roll = m_hud.gimbal.roll;
+    pose->gimbal_pitch = m_hud.gimbal.pitch;
+    pose->gimbal_yaw = m_hud.gimbal.yaw;
+    pose->lidar = m_hud.lidar;
+}
+
+/**
+ * Writes a captured frame, with the current pose, to the shared memory ring.
+ * Frames from a YUYV source are written as they were captured (CV_8UC2).
+ * @param [in] frame The captured frame.
+ */
+void CameraStream::PublishFrame(const CameraFrame& frame) {
+    FrameInfo info{};
+
+    info.id = frame.id;
+    info.capture_time_us = duration_cast<microseconds>(
+        frame.capture_time.time_since_epoch()).count();
+    info.unix_time_us = duration_cast<microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    GetPose(&info.pose);
+    m_ring->Write(frame.has_image ? frame.image : frame.yuv, info);
+}
+
+/**
+ * Retrieves the BGR image of a frame, converting it from the captured YUYV
+ * image on first use.
+ * @param [in,out] frame The frame.
+ * @return The BGR image.
+ */
+cv::Mat& CameraStream::GetImage(CameraFrame *frame) {
+    if (!frame->has_image) {
+        cv::cvtColor(frame->yuv, frame->image, CV_YUV2BGR_YUYV);
+        frame->has_image = true;
+    }
+    return frame->image;
+}
+
+/**
+ * Processing stage. Runs the detector for the current camera mode.
  */
 void CameraStream::ProcessImages() {
-    static const std::vector<int> saveparams = {CV_IMWRITE_JPEG_QUALITY, 90};
-    static const std::vector<int> streamparams {CV_IMWRITE_JPEG_QUALITY, 75};
-    int frame_counter = 0, frame_duration = 0, skip_factor = 5;
+    int frame_counter = 0, frame_duration = 0;
     auto sampling_start = steady_clock::now();
-#ifdef IS_ON_PI
-    OmxCvJpeg *streamer = nullptr, *saver = nullptr;
-    try {
-        streamer = new OmxCvJpeg(STREAM_WIDTH, STREAM_HEIGHT, 75);
-        saver = new OmxCvJpeg(INPUT_WIDTH, INPUT_HEIGHT, 90);
-        skip_factor = 2;
-    } catch (std::invalid_argument e) {
-        Log(LOG_WARNING, "Cannot start hardware JPEG encoders: %s", e.what());
-    }
-#endif
+    CameraFrame frame{};
+    CameraPhoto photo;
 
-    while (!m_stop) {
-        std::unique_lock<std::mutex> lock(m_worker_mutex, std::defer_lock);
-        cv::Mat image, backend;
+    while (m_capture_queue.Pop(frame)) {
+        cv::Mat &backend = frame.backend;
+        bool found = false, reused = false;
 
-        //Grab image
-        m_capture >> image;
+        //The slot is recycled, so drop the backend of an earlier frame;
+        //not every detector writes one.
+        backend.release();
 
-        //Acquire the mutex
-        lock.lock();
+        //Apply any changes (mode, configuration, photos) between frames.
+        //The detections of earlier frames no longer apply after a change.
+        if (RunCommands() && m_motion_gate) {
+            m_motion_gate->Reset();
+        }
 
-        //Save it, if requested to.
-        if (m_save_photo) {
-#ifdef IS_ON_PI
-            if (saver) {
-                saver->Encode(m_save_filename.c_str(), image, true);
-            } else
-#endif
-            cv::imwrite(m_save_filename, image, saveparams);
-            m_save_photo = false;
-         }
+        //Hand a copy to the photo sink, if requested to. There is always
+        //room, as TakePhoto reserves a slot for each request.
+        for (std::string &filename : m_photo_requests) {
+            photo.filename = std::move(filename);
+            GetImage(&frame).copyTo(photo.image);
+            m_photo_queue.Push(photo);
+        }
+        m_photo_requests.clear();
 
         //Process image
-        switch(m_mode) {
+        auto detect_start = steady_clock::now();
+        m_frame_time = frame.capture_time;
+        if (m_motion_gate && m_mode != MODE_NO_PROCESSING &&
+            m_mode != MODE_LEARN_COLOUR)
+        {
+            //If nothing has moved since the last detection, reuse it.
+            FramePose pose;
+            std::shared_ptr<const ThresholdLUT> lut = std::atomic_load(&m_lut);
+            GetPose(&pose);
+            if (lut != m_gate_lut) {
+                m_motion_gate->Reset();
+                m_gate_lut = std::move(lut);
+            }
+            reused = m_motion_gate->Unchanged(
+                frame.has_image ? frame.image : frame.yuv, pose);
+        }
+        if (!reused) {
+            m_search_window = cv::Rect();
+        }
+
+        //The thresholding detectors work on YUYV frames as captured; only
+        //the others need them converted.
+        bool native = !frame.has_image && (reused ||
+            m_mode == MODE_NO_PROCESSING || m_mode == MODE_COM ||
+            m_mode == MODE_CONNECTED_COMPONENTS);
+        cv::Mat &image = native ? frame.yuv : GetImage(&frame);
+        switch(reused ? MODE_NO_PROCESSING : m_mode) {
             case MODE_NO_PROCESSING:	//No image processing
             default:
                 break;
@@ -366,75 +733,242 @@ void CameraStream::ProcessImages() {
                 int lwidth = (LEARN_SIZE*image.cols)/100, lheight = (LEARN_SIZE*image.rows)/100;
                 cv::Rect roi((image.cols - lwidth)/2, (image.rows - lheight)/2,
                     lwidth, lheight);
-                Threshold(image, backend, PROCESS_WIDTH);
+                ThresholdMask(image, PROCESS_WIDTH, 0, &m_mask);
+                if (m_demo_mode || m_show_backend) {
+                    m_mask.ToMat(backend);
+                }
                 LearnThresholds(image, backend, roi);
 
+                //Show how much of the region the current thresholds pick up.
+                //The mask samples every skip-th pixel of the frame (which
+                //need not be INPUT_WIDTH wide), and may be a row short.
+                int skip = std::max(image.cols / m_mask.GetWidth(), 1);
+                cv::Rect mask_roi = cv::Rect(roi.x/skip, roi.y/skip,
+                    roi.width/skip, roi.height/skip) &
+                    cv::Rect(0, 0, m_mask.GetWidth(), m_mask.GetHeight());
+                char coverage[16];
+                sprintf(coverage, "%d%%", mask_roi.area() == 0 ? 0 :
+                    static_cast<int>((100 * m_mask.Overlap(mask_roi)) / mask_roi.area()));
                 cv::rectangle(image,roi.tl(), roi.br(), cv::Scalar(255, 255, 255));
+                cv::putText(image, coverage, cv::Point(roi.x + 2, roi.y + 12),
+                    cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255, 255, 255), 1, 8);
             }   break;
             case MODE_COM:
-                if (CentreOfMass(image, backend)) {
-                    DrawCrosshair(image,
-                        cv::Point(m_detected[0].position.x + image.cols/2,
-                            -m_detected[0].position.y + image.rows/2),
-                            cv::Scalar(0,0,0), 100);
-                }
+                found = CentreOfMass(image, backend);
                 break;
             case MODE_CAMSHIFT:
-                if (CamShift(image, backend)) {
-                    cv::rectangle(image, m_detected[0].bounds.tl(),
-                            m_detected[0].bounds.br(), m_colours[0]);
-                }
+                found = CamShift(image, backend);
                 break;
             case MODE_CONNECTED_COMPONENTS:
-                if(ConnectedComponents(image, backend) > 0) {
-                    for(size_t i=0; i < m_detected.size(); i++) {
-                        cv::rectangle(image, m_detected[i].bounds.tl(),
-                            m_detected[i].bounds.br(),
-                            m_colours[i%m_colours.size()], 2);
-                    }
-                }
+                found = ConnectedComponents(image, backend) > 0;
                 break;
             case MODE_CANNY_GLYPH:
-                if (CannyGlyphDetection(image, backend)) {
-                    for(size_t i=0; i < m_detected.size(); i++) {
-                        cv::rectangle(image, m_detected[i].bounds.tl(),
-                            m_detected[i].bounds.br(),
-                            m_colours[i%m_colours.size()], 2);
-                    }
-                }
+                found = CannyGlyphDetection(image, backend);
             break;
             case MODE_THRESH_GLYPH:
-                if (ThresholdingGlyphDetection(image, backend)) {
-                    for(size_t i=0; i < m_detected.size(); i++) {
-                        cv::rectangle(image, m_detected[i].bounds.tl(),
-                            m_detected[i].bounds.br(),
-                            m_colours[i%m_colours.size()], 2);
-                    }
-                }
+                found = ThresholdingGlyphDetection(image, backend);
             break;
             case MODE_HOUGH:
-                if (HoughDetection(image, backend)) {
-                    //??????
-                }
+                found = HoughDetection(image, backend);
             break;
             case MODE_HOG_PEOPLE:
-                if (HOGPeople(image, backend)) {
-                    for (size_t i = 0; i < m_detected.size(); i++) {
-                        cv::rectangle(image, m_detected[i].bounds.tl(),
-                            m_detected[i].bounds.br(),
-                            m_colours[i%m_colours.size()], 2);
-                    }
-                }
+                found = HOGPeople(image, backend);
            break;
         }
+        if (reused) {
+            found = m_gate_found;
+            m_gate_backend.copyTo(backend);
+            m_frames_reused++;
+        } else {
+            m_gate_found = found;
+            //Keep the backend too, so that it is still shown on reused frames.
+            if (m_motion_gate && m_show_backend && !backend.empty()) {
+                backend.copyTo(m_gate_backend);
+            } else {
+                m_gate_backend.release();
+            }
+        }
 
-        DrawCrosshair(image, cv::Point(image.cols/2, image.rows/2),
-            cv::Scalar(255, 255, 255), 20);
-        // Draw an arrow on the image (for displaying where it wants to go for object tracking)
-        DrawTrackingArrow(image);
+        //Hand the results over to the overlay stage.
+        frame.mode = m_mode;
+        frame.show_backend = m_show_backend && m_mode != MODE_NO_PROCESSING;
+        frame.search_window = m_search_window;
+        //A reused frame only took the motion gate's sampling, which says
+        //nothing about how long detection takes; leave it out of both.
+        auto detect_time = steady_clock::now() - detect_start;
+        if (!reused) {
+            RecordLatency(LATENCY_DETECT, detect_time);
+            if (m_governor && m_governor->Update(
+                duration_cast<microseconds>(detect_time).count() / 1000.0))
+            {
+                ApplyGovernor();
+            }
+        }
+        if (found) {
+            for (ObjectInfo &object : m_detected) {
+                object.capture_time = frame.capture_time;
+            }
+            frame.detected = m_detected;
+        } else {
+            frame.detected.clear();
+        }
 
-        //Overlay the HUD
-        DrawHUD(image);
+        //Publish the results without making the readers wait on a frame.
+        auto snapshot = std::make_shared<CameraSnapshot>();
+        snapshot->frame_id = frame.id;
+        snapshot->capture_time = frame.capture_time;
+        snapshot->mode = m_mode;
+        snapshot->fps = m_fps;
+        snapshot->detected = frame.detected;
+        snapshot->reused = reused;
+        snapshot->learned = m_learning_thresholds;
+        std::atomic_store(&m_snapshot,
+            std::shared_ptr<const CameraSnapshot>(std::move(snapshot)));
+        RecordLatency(LATENCY_RESULT, steady_clock::now() - frame.capture_time);
+
+        m_overlay_queue.Push(frame);
+
+        //Update frame rate
+        frame_counter++;
+        frame_duration = duration_cast<milliseconds>(steady_clock::now() - sampling_start).count();
+        if (frame_duration > 1000) {
+            m_fps = (frame_counter * 1000.0) / frame_duration;
+            frame_counter = 0;
+            sampling_start = steady_clock::now();
+            //printf("%f\n", m_fps);
+            //Log(LOG_INFO, "FPS: %.2f", m_fps);
+        }
+    }
+}
+
+/**
+ * Applies the settings of the governor's current level, and logs the step.
+ * The processing width only changes between frames.
+ */
+void CameraStream::ApplyGovernor() {
+    const GovernorLevel &level = m_governor->GetSettings();
+
+    if (level.process_width != PROCESS_WIDTH) {
+        PROCESS_WIDTH = level.process_width;
+        PROCESS_HEIGHT = (INPUT_HEIGHT * PROCESS_WIDTH) / INPUT_WIDTH;
+        PIXEL_SKIP = INPUT_WIDTH / PROCESS_WIDTH;
+        PIXEL_THRESHOLD = level.pixel_threshold;
+        //The CamShift trackers work at the processing resolution.
+        StopTrackers();
+        if (m_motion_gate) {
+            m_motion_gate->Reset();
+        }
+    }
+    m_stream_interval = level.stream_interval;
+    m_hud_enabled = level.hud;
+    m_record_enabled = level.record;
+
+    std::string description = m_governor->Describe();
+    Log(LOG_INFO, "Camera governor: %s", description.c_str());
+    m_governor_log->Write(": Step: %s", description.c_str());
+}
+
+/**
+ * Overlay stage. Annotates processed frames with the detections and HUD,
+ * then hands them to the sinks.
+ */
+void CameraStream::OverlayFrames() {
+    auto last_streamed = steady_clock::now() - milliseconds(m_stream_interval.load());
+    CameraFrame frame{}, stream{};
+    bool can_record = m_demo_mode;
+
+#ifdef IS_ON_PI
+    can_record = can_record || m_enc;
+#endif
+
+    while (m_overlay_queue.Pop(frame)) {
+        bool record = can_record && m_record_enabled;
+
+        //Stream image, if anyone is ready for it.
+        auto now = steady_clock::now();
+        bool want_stream = m_server &&
+            now - last_streamed >= milliseconds(m_stream_interval.load()) &&
+            m_server->WantsFrame();
+        bool show_backend = frame.show_backend && !frame.backend.empty();
+
+        //Only annotate the frame if something is going to show it.
+        if (record || (want_stream && !show_backend)) {
+            auto overlay_start = steady_clock::now();
+            cv::Mat &image = GetImage(&frame);
+            DrawDetections(frame);
+            DrawCrosshair(image, cv::Point(image.cols/2, image.rows/2),
+                cv::Scalar(255, 255, 255), 20);
+            // Draw an arrow on the image (for displaying where it wants to go for object tracking)
+            DrawTrackingArrow(image);
+
+            //Overlay the HUD
+            if (m_hud_enabled) {
+                DrawHUD(image);
+            }
+            RecordLatency(LATENCY_OVERLAY, steady_clock::now() - overlay_start);
+        }
+
+        //Only the latest frame is kept for the stream; an older one still
+        //waiting is replaced.
+        if (want_stream) {
+            if (show_backend) {
+                frame.backend.copyTo(stream.image);
+            } else if (STREAM_WIDTH < INPUT_WIDTH) {
+                cv::resize(frame.image, stream.image,
+                    cv::Size(STREAM_WIDTH, STREAM_HEIGHT));
+            } else {
+                frame.image.copyTo(stream.image);
+            }
+            stream.id = frame.id;
+            stream.capture_time = frame.capture_time;
+            m_stream_queue.Push(stream);
+            last_streamed = now;
+        }
+
+        //Nothing downstream reads the captured image; hand a lent buffer
+        //back to the source.
+        if (frame.lease) {
+            frame.yuv.release();
+            frame.lease.reset();
+        }
+
+        if (record) {
+            m_record_queue.Push(frame);
+        }
+    }
+}
+
+/**
+ * Stream sink. JPEG encodes the frames handed over by the overlay stage (only
+ * when a client is waiting for one) and publishes them to the web stream.
+ */
+void CameraStream::EncodeStream() {
+    static const std::vector<int> streamparams {CV_IMWRITE_JPEG_QUALITY, 75};
+    CameraFrame stream{};
+    std::vector<uint8_t> jpeg;
+
+    while (m_stream_queue.Pop(stream)) {
+        //Encoded once; the clients share the buffer.
+        auto encode_start = steady_clock::now();
+        cv::imencode(".jpg", stream.image, jpeg, streamparams);
+        RecordLatency(LATENCY_ENCODE, steady_clock::now() - encode_start);
+        m_server->Publish(std::make_shared<const std::vector<uint8_t>>(
+            std::move(jpeg)));
+        RecordLatency(LATENCY_STREAM, steady_clock::now() - stream.capture_time);
+        jpeg = std::vector<uint8_t>();
+        m_streamed++;
+    }
+}
+
+/**
+ * Recording sink. Records the annotated frames and, in demo mode, displays
+ * them. If it falls behind, the oldest frames are dropped.
+ */
+void CameraStream::RecordFrames() {
+    CameraFrame frame{};
+
+    while (m_record_queue.Pop(frame)) {
+        cv::Mat &image = frame.image;
 
         //Are we in demo mode? If so, display the image on the screen.
         //Trying to do this when no X server is available will crash the program.
@@ -448,113 +982,276 @@ void CameraStream::ProcessImages() {
             m_enc->Encode(image);
         }
 #endif
-        //Stream image
-        //Only write the image out for web streaming every 5th frame
-        if ((frame_counter % skip_factor) == 0) {
-            if (m_show_backend) {
-                cv::imwrite(STREAM_FILE, backend, streamparams);
-            } else {
-                if (STREAM_WIDTH < INPUT_WIDTH) {
-                    cv::resize(image, image,
-                        cv::Size(STREAM_WIDTH, STREAM_HEIGHT));
-                }
+    }
+}
+
+/**
+ * Photo sink. Saves every requested photo; photos are never dropped, and
+ * the queue is drained before the sink stops.
+ */
+void CameraStream::SavePhotos() {
+    static const std::vector<int> saveparams = {CV_IMWRITE_JPEG_QUALITY, 90};
+    CameraPhoto photo;
+#ifdef IS_ON_PI
+    OmxCvJpeg *saver = nullptr;
+    try {
+        saver = new OmxCvJpeg(INPUT_WIDTH, INPUT_HEIGHT, 90);
+    } catch (const std::invalid_argument &e) {
+        Log(LOG_WARNING, "Cannot start hardware JPEG encoder: %s", e.what());
+    }
+#endif
+
+    while (m_photo_queue.Pop(photo)) {
+        bool saved;
 #ifdef IS_ON_PI
-                if (streamer) {
-                    streamer->Encode(STREAM_FILE, image);
-                } else
+        if (saver) {
+            saved = saver->Encode(photo.filename.c_str(), photo.image, true);
+        } else
 #endif
-                cv::imwrite(STREAM_FILE, image, streamparams);
-            }
-        }
+        saved = cv::imwrite(photo.filename, photo.image, saveparams);
 
-        //Update frame rate
-        frame_counter++;
-        frame_duration = duration_cast<milliseconds>(steady_clock::now() - sampling_start).count();
-        if (frame_duration > 1000) {
-            m_fps = (frame_counter * 1000.0) / frame_duration;
-            frame_counter = 0;
-            sampling_start = steady_clock::now();
-            //printf("%f\n", m_fps);
-            //Log(LOG_INFO, "FPS: %.2f", m_fps);
+        if (saved) {
+            m_photos_saved++;
+        } else {
+            Log(LOG_WARNING, "Could not save photo to %s", photo.filename.c_str());
+            m_photos_failed++;
         }
+        m_photos_pending--;
     }
 #ifdef IS_ON_PI
-    delete streamer;
     delete saver;
 #endif
 }
 
+/**
+ * Retrieves the statistics of the encoding sinks.
+ * @param [out] stats The sink queue depths and counters.
+ */
+void CameraStream::GetEncoderStats(EncoderStats *stats) {
+    stats->stream_depth = m_stream_queue.GetDepth();
+    stats->record_depth = m_record_queue.GetDepth();
+    stats->photo_depth = m_photo_queue.GetDepth();
+    stats->stream_dropped = m_stream_queue.GetDropped();
+    stats->record_dropped = m_record_queue.GetDropped();
+    stats->streamed = m_streamed;
+    stats->photos_saved = m_photos_saved;
+    stats->photos_failed = m_photos_failed;
+}
+
+/**
+ * Retrieves the buffer statistics of the frame source.
+ * @param [out] stats The statistics.
+ * @return true iff the source keeps buffer statistics.
+ */
+bool CameraStream::GetSourceStats(SourceStats *stats) {
+    return m_source->GetStats(stats);
+}
+
+/**
+ * Retrieves the latency statistics of a stage.
+ * @param [in] stage The stage.
+ * @param [out] summary The latency statistics (ms).
+ */
+void CameraStream::GetLatency(LatencyStage stage, LatencySummary *summary) {
+    m_latency[stage].GetSummary(summary);
+}
+
+/**
+ * Records a latency. Used to record how long after capture the detections
+ * were acted upon (LATENCY_DECISION).
+ * @param [in] stage The stage.
+ * @param [in] latency The latency.
+ */
+void CameraStream::RecordLatency(LatencyStage stage,
+    std::chrono::steady_clock::duration latency)
+{
+    m_latency[stage].Record(latency);
+}
+
+/**
+ * Clears the latency statistics of every stage.
+ */
+void CameraStream::ResetLatency() {
+    for (LatencyHistogram &histogram : m_latency) {
+        histogram.Reset();
+    }
+}
+
+/**
+ * Writes the latency statistics and histograms of every stage to a data log.
+ * @param [in] log The data log to write to.
+ */
+void CameraStream::LogLatency(DataLog *log) {
+    static const char *names[LATENCY_STAGES] = {
+        "grab", "threshold", "detect", "overlay",
+        "encode", "stream", "result", "decision"
+    };
+    char buf[32 * LatencyHistogram::BUCKETS];
+    uint64_t counts[LatencyHistogram::BUCKETS];
+    LatencySummary summary;
+    int length;
+
+    length = sprintf(buf, ": Bounds (us):");
+    for (int i = 0; i < LatencyHistogram::BUCKETS - 1; i++) {
+        length += sprintf(buf + length, " %lld",
+            static_cast<long long>(LatencyHistogram::BOUNDS[i]));
+    }
+    log->Write("%s", buf);
+
+    for (int stage = 0; stage < LATENCY_STAGES; stage++) {
+        m_latency[stage].GetSummary(&summary);
+        m_latency[stage].GetCounts(counts);
+        length = 0;
+        for (int i = 0; i < LatencyHistogram::BUCKETS; i++) {
+            length += sprintf(buf + length, " %llu",
+                static_cast<unsigned long long>(counts[i]));
+        }
+        log->Write(": %s: n=%llu mean=%.2fms p50=%.2fms p95=%.2fms p99=%.2fms "
+            "max=%.2fms |%s", names[stage],
+            static_cast<unsigned long long>(summary.count), summary.mean,
+            summary.p50, summary.p95, summary.p99, summary.max, buf);
+    }
+}
+
 /**
  * Retrieves the current frame rate.
  * @return The current frame rate, in frames per second, or -1.0 if unknown.
  */
 double CameraStream::GetFramerate() {
-    std::lock_guard<std::mutex> lock(m_worker_mutex);
     return m_fps;
 }
 
+/**
+ * Draws the detected objects onto the frame.
+ * @param [in] frame The processed frame to draw onto.
+ */
+void CameraStream::DrawDetections(CameraFrame& frame) {
+    cv::Mat &image = frame.image;
+    const std::vector<ObjectInfo> &detected = frame.detected;
+
+    if (frame.search_window.area() > 0) {
+        cv::rectangle(image, frame.search_window.tl(),
+            frame.search_window.br(), cv::Scalar(128, 128, 128));
+    }
+
+    switch (frame.mode) {
+        case MODE_COM:
+            if (detected.size() > 0) {
+                DrawCrosshair(image,
+                    cv::Point(detected[0].position.x + image.cols/2,
+                        -detected[0].position.y + image.rows/2),
+                        cv::Scalar(0,0,0), 100);
+            }
+            break;
+        case MODE_CAMSHIFT:
+        case MODE_CONNECTED_COMPONENTS:
+        case MODE_CANNY_GLYPH:
+        case MODE_THRESH_GLYPH:
+        case MODE_HOG_PEOPLE:
+            for(size_t i=0; i < detected.size(); i++) {
+                cv::rectangle(image, detected[i].bounds.tl(),
+                    detected[i].bounds.br(),
+                    m_colours[i%m_colours.size()], 2);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
 /**
  * Draws a heads-up display onto the frame.
  * @param [in] img The image to draw the HUD onto.
  */
 void CameraStream::DrawHUD(cv::Mat& img) {
     std::unique_lock<std::mutex> lock(m_aux_mutex);
-    HUDInfo hud = m_hud;
+    HUDState state{m_hud_version, time(NULL) + m_hud.unix_time_offset,
+        m_fps.load(), img.size()};
+    bool changed = state.version != m_hud_drawn.version ||
+        state.time != m_hud_drawn.time || state.fps != m_hud_drawn.fps ||
+        state.size != m_hud_drawn.size;
+    HUDInfo hud;
+    if (changed) {
+        hud = m_hud;
+    }
     lock.unlock();
 
+    //The text only changes with the HUD info, once a second (the time and
+    //frame rate) or with the frame size; otherwise reuse the rendered text.
+    if (changed) {
+        RenderHUD(hud, state.time, state.fps, state.size, &m_hud_mask);
+        m_hud_drawn = state;
+    }
+    img.setTo(cv::Scalar(255, 255, 255), m_hud_mask);
+}
+
+/**
+ * Renders the HUD text into a mask.
+ * @param [in] hud The HUD info.
+ * @param [in] ts The current (UNIX) time.
+ * @param [in] fps The current frame rate.
+ * @param [in] size The frame size.
+ * @param [out] mask The mask to render into.
+ */
+void CameraStream::RenderHUD(const HUDInfo& hud, time_t ts, double fps,
+    cv::Size size, cv::Mat *mask)
+{
+    cv::Mat &img = *mask;
     char string_buf[128];
-    time_t ts = time(NULL) + hud.unix_time_offset;
     struct tm tsp;
 
+    img.create(size, CV_8UC1);
+    img.setTo(cv::Scalar(0));
+
     //Enter the time
     localtime_r(&ts, &tsp);
     strftime(string_buf, sizeof(string_buf), "%H:%M:%S", &tsp);
     cv::putText(img, string_buf, cv::Point(70*img.cols/100, 5*img.rows/100),
-        cv::FONT_HERSHEY_SIMPLEX, 0.34, cv::Scalar(255, 255, 255), 1, 8);
+        cv::FONT_HERSHEY_SIMPLEX, 0.34, cv::Scalar(255), 1, 8);
     strftime(string_buf, sizeof(string_buf), "%d-%m-%Y", &tsp);
     cv::putText(img, string_buf, cv::Point(70*img.cols/100, 10*img.rows/100),
-        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255, 255, 255), 1, 8);
+        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255), 1, 8);
     //Enter the FPS
-    sprintf(string_buf, "%3.4f fps", m_fps);
+    sprintf(string_buf, "%3.4f fps", fps);
     cv::putText(img, string_buf, cv::Point(70*img.cols/100, 15*img.rows/100),
-        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255, 255, 255), 1, 8);
+        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255), 1, 8);
     //Enter the LIDAR range
     sprintf(string_buf, "L: %.2fm", hud.lidar);
     cv::putText(img, string_buf, cv::Point(70*img.cols/100, 20*img.rows/100),
-        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255, 255, 255), 1, 8);
+        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255), 1, 8);
     sprintf(string_buf, "P: %.1f, R: %.1f", hud.gimbal.pitch, hud.gimbal.roll);
     cv::putText(img, string_buf, cv::Point(70*img.cols/100, 25*img.rows/100),
-        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255, 255, 255), 1, 8);
+        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255), 1, 8);
 
     //Enter the position
     sprintf(string_buf, "%.7f, %.7f", hud.pos.lat, hud.pos.lon);
     cv::putText(img, string_buf, cv::Point(5*img.cols/100, 5*img.rows/100),
-        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255, 255, 255), 1, 8);
+        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255), 1, 8);
     //Enter the altitude and climb rate
     sprintf(string_buf, "%.1fm, %.1fm/s", hud.pos.alt, hud.climb);
     cv::putText(img, string_buf, cv::Point(5*img.cols/100, 10*img.rows/100),
-        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255, 255, 255), 1, 8);
+        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255), 1, 8);
     //Enter the heading and throttle
     sprintf(string_buf, "%03d deg, %d%%", hud.heading, hud.throttle);
     cv::putText(img, string_buf, cv::Point(5*img.cols/100, 15*img.rows/100),
-        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255, 255, 255), 1, 8);
+        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255), 1, 8);
     //Enter the ground speed and air speed.
     sprintf(string_buf, "GS: %.1fm/s AS:%.1f m/s", hud.ground_speed, hud.air_speed);
     cv::putText(img, string_buf, cv::Point(5*img.cols/100, 20*img.rows/100),
-        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255, 255, 255), 1, 8);
+        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255), 1, 8);
     //Enter the battery statistics
     sprintf(string_buf, "%.2fV, %.1fA (%3d %%)",
         hud.batt_voltage, hud.batt_current, hud.batt_remaining);
     cv::putText(img, string_buf, cv::Point(5*img.cols/100, 25*img.rows/100),
-        cv::FONT_HERSHEY_SIMPLEX, 0.32, cv::Scalar(255, 255, 255), 1, 8);
+        cv::FONT_HERSHEY_SIMPLEX, 0.32, cv::Scalar(255), 1, 8);
 
     if (hud.status2.size()) {
         cv::putText(img, hud.status2,  cv::Point(5*img.cols/100, 87*img.rows/100),
-        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255, 255, 255), 1, 8);
+        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255), 1, 8);
     }
     if (hud.status1.size()) {
         cv::putText(img, hud.status1, cv::Point(5*img.cols/100, 92*img.rows/100),
-        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255, 255, 255), 1, 8);
+        cv::FONT_HERSHEY_SIMPLEX, 0.4, cv::Scalar(255), 1, 8);
     }
 }
 
@@ -642,41 +1339,59 @@ void CameraStream::RGB2YCbCr(uint8_t r, uint8_t g, uint8_t b, uint8_t *y, uint8_
 }
 
 /**
- * Builds the threshold lookup table from the given thresholding parameters.
- * @param [out] lookup The lookup table.
- * @param [in] thresh The thresholding parameters.
+ * Converts from camera YUV (BT.601 video range, as cv::cvtColor does).
+ * @param [in] y The luma component.
+ * @param [in] u The blue difference component.
+ * @param [in] v The red difference component.
+ * @param [out] r The red value.
+ * @param [out] g The green value.
+ * @param [out] b The blue value.
  */
-void CameraStream::BuildThreshold(uint8_t lookup[][THRESH_SIZE][THRESH_SIZE], ThresholdParams thresh) {
-    uint8_t r, g, b;
-    for(r = 0; r < THRESH_SIZE; r++) {
-        for(g = 0; g < THRESH_SIZE; g++) {
-            for(b = 0; b < THRESH_SIZE; b++) {
-                lookup[r][g][b] = BLACK;
-
-                if (thresh.colourspace == THRESH_HSV) {
-                    uint8_t h, s, v;
-                    RGB2HSV(UNREDUCE(r), UNREDUCE(g), UNREDUCE(b), &h, &s, &v);
-
-                    if (v >= thresh.p3_min && v <= thresh.p3_max &&
-                        s >= thresh.p2_min && s <= thresh.p2_max) {
-                        if (thresh.p1_min < 0) {
-                            if ((h >= thresh.p1_min+180 && h <= 180) ||
-                                (h >= 0 && h <= thresh.p1_max)) {
-                                    lookup[r][g][b] = WHITE;
-                                }
-                        } else if (h >= thresh.p1_min && h <= thresh.p1_max) {
-                            lookup[r][g][b] = WHITE;
-                        }
-                    }
-                } else if (thresh.colourspace == THRESH_YCbCr) {
-                    uint8_t y, cb, cr;
-                    RGB2YCbCr(UNREDUCE(r), UNREDUCE(g), UNREDUCE(b), &y, &cb, &cr);
-
-                    if (y >= thresh.p1_min && y <= thresh.p1_max &&
-                        cb >= thresh.p2_min && cb <= thresh.p2_max &&
-                        cr >= thresh.p3_min && cr <= thresh.p3_max) {
-                        lookup[r][g][b] = WHITE;
-                    }
+void CameraStream::YUV2RGB(uint8_t y, uint8_t u, uint8_t v, uint8_t *r, uint8_t *g, uint8_t *b) {
+    double luma = 1.164 * (y - 16);
+    *r = picopter::clamp(static_cast<int>(luma + 1.596 * (v - 128) + 0.5), 0, 255);
+    *g = picopter::clamp(static_cast<int>(luma - 0.813 * (v - 128) - 0.391 * (u - 128) + 0.5), 0, 255);
+    *b = picopter::clamp(static_cast<int>(luma + 2.018 * (u - 128) + 0.5), 0, 255);
+}
+
+/**
+ * Converts the midpoint of every cell of a colour lookup table into the
+ * given colourspace.
+ * @tparam Bits The LUT resolution (bits per channel).
+ * @param [in] colourspace The colourspace to convert to.
+ * @param [in] input The pixel layout the table is indexed with; the cells
+ *                   of a YUYV table are camera YUV colours.
+ * @param [out] cube The converted cells, as three planes of
+ *                   ColourLUT<Bits>::ENTRIES values (one per component).
+ */
+template <int Bits>
+void CameraStream::BuildColourCube(ThresholdColourspace colourspace,
+    ThresholdInput input, uint8_t *cube)
+{
+    typedef ColourLUT<Bits> LUT;
+    uint8_t *p1 = cube, *p2 = cube + LUT::ENTRIES, *p3 = cube + 2*LUT::ENTRIES;
+    uint8_t unreduced[LUT::SIZE];
+    uint8_t cr, cg, cb;
+    int r, g, b, i;
+
+    for (i = 0; i < LUT::SIZE; i++) {
+        unreduced[i] = LUT::Unreduce(i);
+    }
+
+    for(r = 0, i = 0; r < LUT::SIZE; r++) {
+        for(g = 0; g < LUT::SIZE; g++) {
+            for(b = 0; b < LUT::SIZE; b++, i++) {
+                if (input == THRESH_INPUT_YUYV) {
+                    YUV2RGB(unreduced[r], unreduced[g], unreduced[b], &cr, &cg, &cb);
+                } else {
+                    cr = unreduced[r];
+                    cg = unreduced[g];
+                    cb = unreduced[b];
+                }
+                if (colourspace == THRESH_HSV) {
+                    RGB2HSV(cr, cg, cb, &p1[i], &p2[i], &p3[i]);
+                } else {
+                    RGB2YCbCr(cr, cg, cb, &p1[i], &p2[i], &p3[i]);
                 }
             }
         }
@@ -684,99 +1399,119 @@ void CameraStream::BuildThreshold(uint8_t lookup[][THRESH_SIZE][THRESH_SIZE], Th
 }
 
 /**
- * Threshold a slice of a frame.
- * @param [in] src The source frame.
- * @param [in] out The destination frame.
- * @param [in] skip The pixel skip factor.
- * @param [in] offset The starting offset.
- * @param [in] slice_height The number of destination rows to process.
+ * Retrieves the colour cube of a colourspace and LUT size, converting it on
+ * first use. The caller must hold m_build_mutex.
+ * @param [in] colourspace The colourspace.
+ * @param [in] input The pixel layout the table is indexed with.
+ * @param [in] bits The LUT resolution (bits per channel).
+ * @return The colour cube (see BuildColourCube). It is never modified, so it
+ *         may be read without holding m_build_mutex.
  */
-void CameraStream::ThresholdSlice(const cv::Mat &src, cv::Mat &out, int skip, int offset, int slice_height) {
-    const uint8_t *srcp;
-    uint8_t *destp;
-    int nChannels = src.channels();
-    int i, j, k;
-    
-    for(j=offset; j < offset+slice_height; j++) {
-        srcp = src.ptr<const uint8_t>(j*skip);
-        destp = out.ptr<uint8_t>(j);
-        for (i=0; i < out.cols; i++) {
-            k = i*nChannels*skip;
-            destp[i] = m_lookup_threshold[srcp[k+2]/THRESH_DIV][srcp[k+1]/THRESH_DIV][srcp[k]/THRESH_DIV];
+std::shared_ptr<const std::vector<uint8_t>> CameraStream::GetColourCube(
+    ThresholdColourspace colourspace, ThresholdInput input, int bits)
+{
+    std::shared_ptr<const std::vector<uint8_t>> &cube =
+        m_colour_cubes[input == THRESH_INPUT_YUYV][colourspace == THRESH_YCbCr][bits - 4];
+
+    if (!cube) {
+        std::shared_ptr<std::vector<uint8_t>> cells =
+            std::make_shared<std::vector<uint8_t>>(3 * (static_cast<size_t>(1) << (3*bits)));
+        switch (bits) {
+            case 5:
+                BuildColourCube<5>(colourspace, input, cells->data());
+                break;
+            case 6:
+                BuildColourCube<6>(colourspace, input, cells->data());
+                break;
+            default:
+                BuildColourCube<4>(colourspace, input, cells->data());
+                break;
         }
+        cube = std::move(cells);
     }
+    return cube;
 }
 
 /**
- * Thresholds the image using the preset LUT.
- * @param [in] src The input image.
- * @param [out] out The output image.
- * @param [in] width The output processing width.
+ * Builds a new threshold lookup table and publishes it to the camera. The
+ * camera keeps running on the old table until the new one is swapped in.
+ * For a YUYV source, a table indexed directly on the camera's YUV values
+ * is built as well, so its frames never need converting to threshold them.
+ * The caller must hold m_build_mutex, so that concurrent rebuilds are
+ * published in the same order as the thresholds they were built from.
+ * @param [in] thresh The thresholding parameters.
+ * @param [in] bits The resolution of the new table.
  */
-void CameraStream::Threshold(const cv::Mat& src, cv::Mat &out, int width) {
-    //auto start = steady_clock::now();
-    int skip = src.cols/width;
-    out.create((src.rows * width) / src.cols, width, CV_8UC1);
-    
-    ThresholdSlice(src, out, skip, 0, out.rows);
-    
-    //GDB really does not like thread pooling and GDB will segfault
-    //if threaded thresholding is enabled. Probably fixed by upgrading
-    //GDB.
-    /*
-    if ((out.rows%4)) {
-        ThresholdSlice(src, out, skip, 0, out.rows);
-    } else {
-        //Log(LOG_DEBUG, "SLICING");
-        std::vector<std::future<void>> ret;
-        for (int i = 0; i < 4; i++) {
-            ret.emplace_back(m_pool.enqueue(&CameraStream::ThresholdSlice,
-                this, src, out, skip, (i*out.rows)/4, out.rows/4));
-        }
-        for(auto &&result : ret){
-            result.get();
-        }
+void CameraStream::RebuildThreshold(const ThresholdParams& thresh, int bits) {
+    ColourPassTable pass;
+
+    SetPassRange(pass, 0, thresh.p1_min, thresh.p1_max,
+        thresh.colourspace == THRESH_HSV);
+    SetPassRange(pass, 1, thresh.p2_min, thresh.p2_max);
+    SetPassRange(pass, 2, thresh.p3_min, thresh.p3_max);
+
+    auto build = [&] (ThresholdInput input) {
+        std::shared_ptr<ThresholdLUT> lut =
+            std::make_shared<ThresholdLUT>(bits, m_threshold_kernel, input);
+        std::shared_ptr<const std::vector<uint8_t>> cube =
+            GetColourCube(thresh.colourspace, input, lut->GetBits());
+        ThresholdColourCube(cube->data(), lut->GetEntries(), pass, lut->GetTable());
+        return std::shared_ptr<const ThresholdLUT>(lut);
+    };
+
+    if (m_source->GetFormat() == FRAME_YUYV) {
+        std::atomic_store(&m_yuv_lut, build(THRESH_INPUT_YUYV));
     }
-    */
-    //printf("%d\n", (int)duration_cast<microseconds>(steady_clock::now()-start).count());
+    std::atomic_store(&m_lut, build(THRESH_INPUT_BGR));
 }
 
 /**
- * Do auto threshold learning.
+ * Do auto threshold learning. The colours in the region are added to those
+ * of the previous frames, and every LEARN_UPDATE_FRAMES frames the learnt
+ * thresholds are set to the ranges that cover most of them. The source
+ * image is left untouched.
  * @param [in] src The source image.
- * @param [in] threshold Location to store thresholded image.
+ * @param [in] threshold The thresholded image (shown in demo mode).
  * @param [in] roi Region of interest to calculate thresholds.
  */
-void CameraStream::LearnThresholds(cv::Mat& src, cv::Mat& threshold, cv::Rect roi) {
-    cv::Mat sroi(src, roi);
-    cv::medianBlur(sroi, sroi, 7);
-    if (m_learning_thresholds.colourspace == THRESH_HSV) {
-        cv::cvtColor(sroi, sroi, CV_BGR2HSV);
-        std::vector<cv::Mat> channels;
-        cv::split(sroi, channels);
+void CameraStream::LearnThresholds(const cv::Mat& src, cv::Mat& threshold, cv::Rect roi) {
+    std::shared_ptr<const ThresholdLUT> lut = std::atomic_load(&m_lut);
+    ThresholdParams &learned = m_learning_thresholds;
 
-        cv::Scalar mean_hue = cv::mean(channels[0]);
-        m_learning_thresholds.p1_min = mean_hue[0]-10;
-        m_learning_thresholds.p1_max = mean_hue[0]+10;
-        if (m_learning_thresholds.p1_max > 180) {
-            m_learning_thresholds.p1_max -= 180;
-        }
-        if (m_learning_thresholds.p1_min > m_learning_thresholds.p1_max) {
-            m_learning_thresholds.p1_min -= 180;
+    //Count the colours at the resolution of the current table.
+    if (lut->GetBits() != m_learner.GetBits()) {
+        m_learner.Reset(lut->GetBits());
+    }
+    m_learner.Accumulate(src, roi, PIXEL_SKIP);
+    bool update = (m_learner.GetFrames() - 1) % LEARN_UPDATE_FRAMES == 0;
+
+    //Take the colour cube to read the ranges through when the resolution or
+    //colourspace changes. Never wait on a rebuild for it; just retry on the
+    //next frame.
+    bool stale = !m_learn_cube || m_learn_colourspace != learned.colourspace ||
+        m_learn_cube->size() != 3 * m_learner.GetEntries();
+    if (stale) {
+        std::unique_lock<std::mutex> build_lock(m_build_mutex, std::try_to_lock);
+        if (build_lock.owns_lock()) {
+            m_learn_cube = GetColourCube(learned.colourspace,
+                THRESH_INPUT_BGR, m_learner.GetBits());
+            m_learn_colourspace = learned.colourspace;
+            stale = false;
+            update = true;
         }
-    } else if (m_learning_thresholds.colourspace == THRESH_YCbCr) {
-        cv::cvtColor(sroi, sroi, CV_BGR2YCrCb);
-        std::vector<cv::Mat> channels;
-        cv::split(sroi, channels);
-
-        cv::Scalar mean_cr = cv::mean(channels[1]);
-        cv::Scalar mean_cb = cv::mean(channels[2]);
+    }
 
-        m_learning_thresholds.p2_min = std::max((int)mean_cb[0]-15, 0);
-        m_learning_thresholds.p2_max = std::min((int)mean_cb[0]+15, 255);
+    if (update && !stale) {
+        const uint8_t *p1 = m_learn_cube->data();
+        const uint8_t *p2 = p1 + m_learner.GetEntries();
+        const uint8_t *p3 = p2 + m_learner.GetEntries();
 
-        m_learning_thresholds.p3_min = std::max((int)mean_cr[0]-15, 0);
-        m_learning_thresholds.p3_max = std::min((int)mean_cr[0]+15, 255);
+        if (learned.colourspace == THRESH_HSV) {
+            m_learner.GetHueRange(p1, p2, &learned.p1_min, &learned.p1_max);
+        } else if (learned.colourspace == THRESH_YCbCr) {
+            m_learner.GetRange(p2, &learned.p2_min, &learned.p2_max);
+            m_learner.GetRange(p3, &learned.p3_min, &learned.p3_max);
+        }
     }
     if (m_demo_mode) {
         cv::imshow("Thresholded image", threshold);
@@ -786,71 +1521,184 @@ void CameraStream::LearnThresholds(cv::Mat& src, cv::Mat& threshold, cv::Rect ro
 /**
  * Simple centre of mass thresholding calculation.
  * @param [in] src The image to compute from.
- * @param [out] threshold The location to store the thresholded image.
+ * @param [out] threshold The location to store the thresholded image. This
+ *                        is only written in demo mode or when the backend is
+ *                        being shown.
  * @return true iff an object was detected.
  */
 bool CameraStream::CentreOfMass(cv::Mat& src, cv::Mat& threshold) {
-    cv::Moments m;
-    Threshold(src, threshold, PROCESS_WIDTH);
+    //Only write out the thresholded image if someone is going to look at it.
+    bool keep_threshold = m_demo_mode || m_show_backend;
+    ThresholdMask(src, PROCESS_WIDTH, 0, &m_mask);
+    MaskMoments m = m_mask.Moments(m_com_orientation);
+    if (keep_threshold) {
+        m_mask.ToMat(threshold);
+    }
     if (m_demo_mode) {
         cv::imshow("Thresholded image", threshold);
         cv::waitKey(1);
     }
     m_detected.clear();
-    m = cv::moments(threshold, true);
     if(m.m00 > PIXEL_THRESHOLD) {
         ObjectInfo object = {0};
         object.image_width = INPUT_WIDTH;
         object.image_height = INPUT_HEIGHT;
-        object.position.x = PIXEL_SKIP*m.m10/m.m00 - src.cols/2;
-        object.position.y = -(PIXEL_SKIP*m.m01/m.m00 - src.rows/2);
+        object.position.x = PIXEL_SKIP*static_cast<double>(m.m10)/m.m00 - src.cols/2;
+        object.position.y = -(PIXEL_SKIP*static_cast<double>(m.m01)/m.m00 - src.rows/2);
+        if (m_com_orientation) {
+            object.orientation = MomentsOrientation(m);
+        }
         m_detected.push_back(object);
         return true;
     }
     return false;
 }
 
+/**
+ * Thresholds the image into a run-length encoded mask. Each band of rows is
+ * classified into a small per-band buffer that stays in cache and is encoded
+ * into its own list of runs straight away, so no dense mask is written.
+ * @param [in] src The input image (BGR, or YUYV from a YUYV source). A YUYV
+ *                 region must start on an even column.
+ * @param [in] width The output processing width.
+ * @param [in] gap Gaps of up to this many pixels within a row are closed.
+ * @param [out] mask The thresholded image.
+ */
+void CameraStream::ThresholdMask(const cv::Mat& src, int width, int gap, BinaryMask *mask) {
+    int skip = src.cols/width;
+    int rows = (src.rows * width) / src.cols;
+    int bands = std::min(THRESHOLD_BANDS, rows);
+    int nChannels = src.channels();
+    std::shared_ptr<const ThresholdLUT> lut =
+        std::atomic_load(nChannels == 2 ? &m_yuv_lut : &m_lut);
+    const uint8_t *table = lut->GetTable();
+    ThresholdRowFn threshold_row = lut->GetRowKernel();
+
+    if (m_row_scratch.size() < static_cast<size_t>(bands * width)) {
+        m_row_scratch.resize(bands * width);
+    }
+
+    auto start_time = steady_clock::now();
+    m_parallel.Run(bands, [&] (int band) {
+        int start = (band * rows) / bands;
+        int end = ((band + 1) * rows) / bands;
+        uint8_t *row = &m_row_scratch[band * width];
+        std::vector<PixelRun> &band_runs = m_band_runs[band];
+
+        band_runs.clear();
+        for (int j = start; j < end; j++) {
+            threshold_row(table, src.ptr<const uint8_t>(j*skip), row,
+                width, nChannels, skip);
+            EncodeRuns(row, width, j, gap, &band_runs);
+        }
+    });
+
+    mask->Reset(width, rows);
+    for (int i = 0; i < bands; i++) {
+        mask->AddRuns(m_band_runs[i]);
+    }
+    RecordLatency(LATENCY_THRESHOLD, steady_clock::now() - start_time);
+}
+
+/**
+ * Determines the region of the current frame to search. Once an object is
+ * locked, only a window around its predicted position is searched; the
+ * whole frame is searched otherwise (and periodically while locked).
+ * @param [in] frame The size of the frame.
+ * @param [in] align The window is grown to multiples of this many pixels
+ *                   (e.g. the processing pixel skip).
+ * @param [in] min_size The smallest window the detector can use.
+ * @param [out] window The region to search (the whole frame if not windowed).
+ * @return true iff only the window should be searched.
+ */
+bool CameraStream::GetSearchWindow(const cv::Size& frame, int align,
+    const cv::Size& min_size, cv::Rect *window)
+{
+    cv::Rect w;
+
+    *window = cv::Rect(0, 0, frame.width, frame.height);
+    if (!m_track_window || !m_tracking.GetWindow(frame, m_frame_time, &w)) {
+        return false;
+    }
+
+    //Grow the window about its centre to the minimum size.
+    if (w.width < min_size.width) {
+        w.x -= (min_size.width - w.width) / 2;
+        w.width = min_size.width;
+    }
+    if (w.height < min_size.height) {
+        w.y -= (min_size.height - w.height) / 2;
+        w.height = min_size.height;
+    }
+
+    int x0 = (std::max(w.x, 0) / align) * align;
+    int y0 = (std::max(w.y, 0) / align) * align;
+    int x1 = std::min(((w.x + w.width + align - 1) / align) * align,
+        (frame.width / align) * align);
+    int y1 = std::min(((w.y + w.height + align - 1) / align) * align,
+        (frame.height / align) * align);
+    if (x1 - x0 < std::max(align, min_size.width) ||
+        y1 - y0 < std::max(align, min_size.height)) {
+        //Too close to the edge for the detector; search everything.
+        return false;
+    }
+
+    *window = cv::Rect(x0, y0, x1 - x0, y1 - y0);
+    m_search_window = *window;
+    return true;
+}
+
+/**
+ * Updates the tracked object with the largest (first) detection, if any.
+ */
+void CameraStream::UpdateTracking() {
+    m_tracking.Update(m_frame_time,
+        m_detected.empty() ? NULL : &m_detected[0].bounds);
+}
+
 /**
  * Connected components V2
- * Computes position of 4 largest blobs on the image.
+ * Computes position of 4 largest blobs on the image. The thresholded image
+ * is run-length encoded and labelled with union-find; small gaps are closed
+ * within each row instead of dilating and eroding the image. While an object
+ * is being tracked, only a window around it is labelled.
  * @param [in] src The image to compute from.
- * @param [out] threshold The location to store the thresholded image. NB:
- *                        Due to the call to `findContours`, this will likely
- *                        contain a meaningless image, and will not accurately
- *                        display the thresholded image used. To view this,
- *                        switch to 'Centre of Mass' mode.
+ * @param [out] threshold The location to store the thresholded image. This
+ *                        is only written if it is going to be displayed.
  * @return The number of objects detected, sorted by order of decreasing size.
  */
 int CameraStream::ConnectedComponents(cv::Mat& src, cv::Mat& threshold) {
-    Threshold(src, threshold, PROCESS_WIDTH);
-
-    //Blur, dilate and erode the image
-    cv::Mat elementDilate(8, 8, CV_8U, cv::Scalar(255));
-    cv::Mat elementErode(8, 8, CV_8U, cv::Scalar(255));
-
-    cv::dilate(threshold, threshold, elementDilate);
-    cv::erode(threshold, threshold, elementErode);
-
+    //Only write out the thresholded image if someone is going to look at it.
+    bool keep_threshold = m_demo_mode || m_show_backend;
+    int width = m_cc_full_res ? src.cols : PROCESS_WIDTH;
+    //Scale from the labelling resolution back to the input image.
+    int scale = src.cols / width;
+    //PIXEL_THRESHOLD and CC_GAP are given at the processing resolution.
+    int process_scale = width / PROCESS_WIDTH;
+    int64_t min_area = static_cast<int64_t>(PIXEL_THRESHOLD + 1) *
+        process_scale * process_scale;
+    cv::Rect window;
+
+    //Only label around the tracked object, if there is one. A YUYV window
+    //must start on a pixel pair.
+    int align = (src.channels() == 2 && scale % 2) ? 2 * scale : scale;
+    GetSearchWindow(src.size(), align, cv::Size(), &window);
+    ThresholdMask(src(window), window.width / scale,
+        m_cc_gap * process_scale, &m_mask);
+    if (keep_threshold) {
+        threshold = cv::Mat::zeros(src.rows / scale, width, CV_8UC1);
+        cv::Mat mask_window = threshold(cv::Rect(window.x / scale,
+            window.y / scale, m_mask.GetWidth(), m_mask.GetHeight()));
+        m_mask.ToMat(mask_window);
+    }
     if (m_demo_mode) {
         cv::imshow("Thresholded image", threshold);
         cv::waitKey(1);
     }
 
-    //Find the contours (connected components)
-    std::vector<std::vector<cv::Point>> contours;
-    cv::findContours(threshold, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
-
-    //Calculate the contour moments
-    typedef std::pair<std::vector<cv::Point>*, cv::Moments> ctm_t;
-    std::vector<ctm_t> comps(contours.size());
-    for(size_t i = 0; i < contours.size(); i++) {
-        comps[i] = ctm_t(&contours[i], cv::moments(contours[i], true));
-    }
-    //Sort moments in order of decreasing size (largest first)
-    std::sort(comps.begin(), comps.end(),
-    [] (const ctm_t &a, const ctm_t &b) {
-        return (int)b.second.m00 < (int)a.second.m00;
-    });
+    //Label the components and keep the four largest
+    m_labeller.Label(m_mask.GetRuns());
+    m_labeller.SelectLargest(4, min_area, &m_blobs);
 
     m_detected.clear();
 
@@ -858,121 +1706,181 @@ int CameraStream::ConnectedComponents(cv::Mat& src, cv::Mat& threshold) {
     object.image_width = INPUT_WIDTH;
     object.image_height = INPUT_HEIGHT;
 
-    int nCols = threshold.cols * PIXEL_SKIP;
-    int nRows = threshold.rows * PIXEL_SKIP;
-
-    //Calculate the locations on the original image (first 4 only)
-    for(int k=0; k < 4 && k < (int)comps.size(); k++) {
-        if(comps[k].second.m00 > PIXEL_THRESHOLD) {
-            comps[k].second.m01 *= PIXEL_SKIP;
-            comps[k].second.m10 *= PIXEL_SKIP;
+    //Calculate the locations on the original image
+    for(size_t k = 0; k < m_blobs.size(); k++) {
+        const Blob &blob = m_blobs[k];
 
-            object.id = k;
-            object.position.x = comps[k].second.m10/comps[k].second.m00 - nCols/2;
-            object.position.y = -(comps[k].second.m01/comps[k].second.m00 - nRows/2);
+        object.id = static_cast<int>(k);
+        object.position.x = window.x +
+            scale*static_cast<double>(blob.sum_x)/blob.area - src.cols/2;
+        object.position.y = -(window.y +
+            scale*static_cast<double>(blob.sum_y)/blob.area - src.rows/2);
 
-            object.bounds = cv::boundingRect(*(comps[k].first));
-            object.bounds.x *= PIXEL_SKIP;
-            object.bounds.y *= PIXEL_SKIP;
-            object.bounds.width *= PIXEL_SKIP;
-            object.bounds.height *= PIXEL_SKIP;
-            m_detected.push_back(object);
-        }
+        object.bounds.x = window.x + blob.min_x * scale;
+        object.bounds.y = window.y + blob.min_y * scale;
+        object.bounds.width = (blob.max_x - blob.min_x + 1) * scale;
+        object.bounds.height = (blob.max_y - blob.min_y + 1) * scale;
+        m_detected.push_back(object);
     }
+    UpdateTracking();
     return m_detected.size();
 }
 
 /**
- * An attempt at the Camshift algorithm.
+ * Tracks several objects with the CamShift algorithm. New targets are found
+ * with connected components (the colour thresholds) and each is followed by
+ * its own tracker, within a window around the target at the processing
+ * resolution. The trackers are updated in parallel. The colour model of a
+ * target is kept after the target is lost, and is used again when an object
+ * of the same colour is found.
  * @param [in] src The image to compute from.
- * @param [out] threshold The location to store the thresholded image.
+ * @param [out] threshold The location to store the back projection. This is
+ *                        only written if it is going to be displayed.
  * @return true iff an object was detected.
  */
 bool CameraStream::CamShift(cv::Mat& src, cv::Mat& threshold) {
-    static cv::Rect roi_bounds(0,0,0,0); //FIXME make non-static
-    static cv::Mat hist;
-    static int capcount = 0;
-    static int smin = 100, vmin = 130, vmax = 256;
-    // we compute the histogram from the 0-th and 1-st channels
-    int channels[] = {0, 1};
-    // hue varies from 0 to 179, see cvtColor
-    // saturation varies from 0 (black-gray-white) to
-    // 255 (pure spectrum color)
-    float hranges[] = {0,180}, sranges[] = {0,256};
-    const float *ranges[] = {hranges, sranges};
-    cv::TermCriteria tc(cv::TermCriteria::EPS|cv::TermCriteria::COUNT, 10, 1);
-
-    if (capcount < 10 || roi_bounds.width <= 1 || roi_bounds.height <= 1) {
-        if (ConnectedComponents(src, threshold)) {
-            roi_bounds = m_detected[0].bounds;
-            cv::Mat roi = src(roi_bounds), mask;
-            cv::cvtColor(roi, roi, CV_BGR2HSV);
-            cv::inRange(roi, cv::Scalar(0, smin, std::min(vmin, vmax)),
-                        cv::Scalar(180, 256, std::max(vmin, vmax)), mask);
-            // Quantize the hue to 30 levels and the saturation to 32 levels
-            int histSize[] = {10,30};
-            cv::calcHist(&roi, 1, channels, mask, hist, 1, histSize, ranges,
-                true, false);
-            if (m_demo_mode) {
-                cv::imshow("Histogram", hist);
+    //Only write out the back projection if someone is going to look at it.
+    bool keep_threshold = m_demo_mode || m_show_backend;
+    int active = 0;
+
+    if (PIXEL_SKIP > 1) {
+        cv::resize(src, m_camshift_bgr, cv::Size(PROCESS_WIDTH, PROCESS_HEIGHT));
+        cv::cvtColor(m_camshift_bgr, m_camshift_hsv, CV_BGR2HSV);
+    } else {
+        cv::cvtColor(src, m_camshift_hsv, CV_BGR2HSV);
+    }
+
+    //Follow the existing targets.
+    m_parallel.Run(static_cast<int>(m_trackers.size()), [&] (int i) {
+        m_trackers[i].Update(m_camshift_hsv, m_frame_time);
+    });
+    for (CamShiftTracker &tracker : m_trackers) {
+        if (tracker.IsActive()) {
+            active++;
+        } else if (!tracker.GetHistogram().empty()) {
+            //Lost; remember its colour.
+            m_hist_cache.Store(tracker.GetHistogram());
+            tracker = CamShiftTracker();
+        }
+    }
+
+    //Look for new targets every so often.
+    if (active < CAMSHIFT_TARGETS &&
+        (active == 0 || ++m_acquire_count >= CAMSHIFT_ACQUIRE)) {
+        m_acquire_count = 0;
+        //The targets are tracked individually; always search everywhere.
+        m_tracking.Reset();
+        ConnectedComponents(src, threshold);
+        for (const ObjectInfo &object : m_detected) {
+            cv::Rect bounds(object.bounds.x / PIXEL_SKIP, object.bounds.y / PIXEL_SKIP,
+                object.bounds.width / PIXEL_SKIP, object.bounds.height / PIXEL_SKIP);
+            CamShiftTracker *slot = NULL;
+            bool tracked = false;
+
+            for (CamShiftTracker &tracker : m_trackers) {
+                if (!tracker.IsActive()) {
+                    slot = slot ? slot : &tracker;
+                } else if ((tracker.GetBounds() & bounds).area() > 0) {
+                    tracked = true;
+                }
             }
-            //cv::normalize(hist, hist, 0, 255, cv::NORM_MINMAX);
-            capcount++;
-        } else {
-            capcount = 0;
+            if (tracked || !slot || bounds.width <= 1 || bounds.height <= 1) {
+                continue;
+            }
+
+            cv::Mat hist, cached;
+            CamShiftTracker::LearnHistogram(m_camshift_hsv, bounds, &hist);
+            if (m_hist_cache.Find(hist, &cached)) {
+                hist = cached;
+            }
+            slot->Start(m_next_target++, hist, bounds, m_frame_time, m_target_window);
         }
-    } else {
-        cv::Mat dst, mask;
-        cv::cvtColor(src, dst, CV_BGR2HSV);
-        cv::inRange(dst, cv::Scalar(0, smin, std::min(vmin, vmax)),
-                        cv::Scalar(180, 256, std::max(vmin, vmax)), mask);
-        cv::calcBackProject(&dst, 1, channels, hist, threshold, ranges);
-        threshold &= mask;
-        
-        if (m_demo_mode) {
-            cv::imshow("Thresholded image", threshold);
+    }
+
+    if (keep_threshold) {
+        threshold = cv::Mat::zeros(m_camshift_hsv.size(), CV_8UC1);
+    }
+    m_detected.clear();
+    for (const CamShiftTracker &tracker : m_trackers) {
+        if (!tracker.IsActive() || tracker.GetBox().size.area() <= 0) {
+            continue;
         }
-        cv::RotatedRect rr = cv::CamShift(threshold, roi_bounds, tc);
+
+        const cv::RotatedRect &rr = tracker.GetBox();
+        cv::Rect bounds = rr.boundingRect();
         ObjectInfo object = {0};
 
+        object.id = tracker.GetId();
         object.image_width = INPUT_WIDTH;
         object.image_height = INPUT_HEIGHT;
-        object.position.x = rr.center.x - src.cols/2;
-        object.position.y = -rr.center.y + src.rows/2;
-        object.bounds = rr.boundingRect();
-
-        //LogSimple(LOG_DEBUG, "X: %.1f, Y: %.1f, W: %d, H: %d", rr.center.x, rr.center.y, object.bounds.width, object.bounds.height);
-        m_detected.clear();
+        object.position.x = rr.center.x * PIXEL_SKIP - src.cols/2;
+        object.position.y = -rr.center.y * PIXEL_SKIP + src.rows/2;
+        object.bounds = cv::Rect(bounds.x * PIXEL_SKIP, bounds.y * PIXEL_SKIP,
+            bounds.width * PIXEL_SKIP, bounds.height * PIXEL_SKIP);
         m_detected.push_back(object);
-        return true;
+
+        if (keep_threshold) {
+            cv::Mat window = threshold(tracker.GetSearchWindow());
+            cv::max(window, tracker.GetBackProjection(), window);
+        }
     }
 
-    return false;
+    if (m_demo_mode) {
+        cv::imshow("Thresholded image", threshold);
+    }
+    return m_detected.size() > 0;
+}
 
+/**
+ * Stops all CamShift trackers, keeping their colour models.
+ */
+void CameraStream::StopTrackers() {
+    for (CamShiftTracker &tracker : m_trackers) {
+        if (tracker.IsActive()) {
+            m_hist_cache.Store(tracker.GetHistogram());
+        }
+        tracker = CamShiftTracker();
+    }
+    m_acquire_count = 0;
 }
 
 /**
- * Uses the HOG descriptor to detect people.
+ * Uses the HOG descriptor to detect people. Once someone has been found,
+ * only a window around them is searched, at scales near their size.
  * @param [in] src The image to compute from.
  * @param [in] process The process buffer.
  * @return true iff people were detected.
  */
 bool CameraStream::HOGPeople(cv::Mat &src, cv::Mat& process) {
-    std::vector<cv::Rect> found;
+    cv::Size win = m_hog.GetWindowSize();
+    double min_scale = 0, max_scale = 0;
+    cv::Rect window;
+
+    if (GetSearchWindow(src.size(), PIXEL_SKIP, win * PIXEL_SKIP, &window) &&
+        !m_detected.empty())
+    {
+        double step = m_hog.GetScaleStep();
+        double scale = m_detected[0].bounds.height /
+            static_cast<double>(win.height * PIXEL_SKIP);
+        min_scale = scale / (step * step);
+        max_scale = scale * step * step;
+    }
 
-    cv::resize(src, process, cv::Size(PROCESS_WIDTH, PROCESS_HEIGHT));
+    cv::resize(src(window), process, cv::Size(window.width / PIXEL_SKIP,
+        window.height / PIXEL_SKIP));
     cv::cvtColor(process, process, CV_BGR2GRAY);
-    m_hog.detectMultiScale(process, found);
+    m_hog.Detect(process, &m_hog_found, min_scale, max_scale);
     m_detected.clear();
 
     if (m_demo_mode) {
         cv::imshow("Thresholded image", process);
     }
 
-    for (size_t i = 0; i < found.size(); i++) {
+    for (size_t i = 0; i < m_hog_found.size(); i++) {
+        const cv::Rect &found = m_hog_found[i];
         ObjectInfo object{};
-        cv::Rect r(found[i].x*PIXEL_SKIP, found[i].y*PIXEL_SKIP,
-                   found[i].width*PIXEL_SKIP, found[i].height*PIXEL_SKIP);
+        cv::Rect r(window.x + found.x*PIXEL_SKIP, window.y + found.y*PIXEL_SKIP,
+                   found.width*PIXEL_SKIP, found.height*PIXEL_SKIP);
 
         object.image_width = INPUT_WIDTH;
         object.image_height = INPUT_HEIGHT;
@@ -983,5 +1891,6 @@ bool CameraStream::HOGPeople(cv::Mat &src, cv::Mat& process) {
         Log(LOG_DEBUG, "DETECTED HOG");
     }
 
+    UpdateTracking();
     return m_detected.size() > 0;
 }
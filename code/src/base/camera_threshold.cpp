@@ -0,0 +1,301 @@
+/**
+ * @file camera_threshold.cpp
+ * @brief Colour lookup tables and runtime kernel selection.
+ */
+
+#include "common.h"
+#include "camera_threshold.h"
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define THRESH_HAVE_X86
+#endif
+
+//This file is built for the baseline CPU; THRESH_NEON_KERNEL is set when
+//camera_threshold_simd.cpp alone is built with NEON enabled.
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(THRESH_NEON_KERNEL)
+#  define THRESH_HAVE_NEON
+#  if defined(__arm__) && defined(__linux__)
+#    include <sys/auxv.h>
+#    include <asm/hwcap.h>
+#  endif
+#endif
+
+using namespace picopter;
+
+/**
+ * Sets the range of values of one channel that pass the threshold.
+ * @param [out] pass The pass tables.
+ * @param [in] channel The channel (0-2).
+ * @param [in] min The minimum value (inclusive).
+ * @param [in] max The maximum value (inclusive).
+ * @param [in] hue true iff the channel is a hue in [0, 180], in which case a
+ *                 negative minimum wraps around to the top of the range.
+ */
+void picopter::SetPassRange(ColourPassTable pass, int channel, int min, int max, bool hue) {
+    for (int i = 0; i < 256; i++) {
+        if (hue && min < 0) {
+            pass[channel][i] = ((i >= min+180 && i <= 180) ||
+                (i >= 0 && i <= max)) ? 0xFF : 0;
+        } else {
+            pass[channel][i] = (i >= min && i <= max) ? 0xFF : 0;
+        }
+    }
+}
+
+/**
+ * Builds a threshold lookup table from a colour cube. The cube holds the
+ * colourspace converted value of every LUT cell as three planes of `entries`
+ * values each, so building a table is just a range test per cell.
+ * @param [in] cube The colour cube (3 * entries values).
+ * @param [in] entries The number of cells.
+ * @param [in] pass The pass tables.
+ * @param [out] lut The lookup table (entries values; 255 = pass, 0 = fail).
+ */
+void picopter::ThresholdColourCube(const uint8_t *cube, size_t entries,
+    const ColourPassTable pass, uint8_t *lut)
+{
+    const uint8_t *p1 = cube, *p2 = cube + entries, *p3 = cube + 2*entries;
+    for (size_t i = 0; i < entries; i++) {
+        lut[i] = pass[0][p1[i]] & pass[1][p2[i]] & pass[2][p3[i]];
+    }
+}
+
+/**
+ * Computes the orientation of the major axis from second order moments.
+ * @param [in] m The moments (with second order moments).
+ * @return The angle of the major axis from the x axis, in radians
+ *         (image coordinates; y down). Returns 0 for an empty mask.
+ */
+double picopter::MomentsOrientation(const MaskMoments &m) {
+    if (m.m00 == 0) {
+        return 0;
+    }
+    double cx = static_cast<double>(m.m10) / m.m00;
+    double cy = static_cast<double>(m.m01) / m.m00;
+    double mu20 = m.m20 / static_cast<double>(m.m00) - cx*cx;
+    double mu02 = m.m02 / static_cast<double>(m.m00) - cy*cy;
+    double mu11 = m.m11 / static_cast<double>(m.m00) - cx*cy;
+    return 0.5 * std::atan2(2*mu11, mu20 - mu02);
+}
+
+/**
+ * Determines if the given kernel can be run on this CPU.
+ * @param [in] kernel The kernel to check.
+ * @return true iff the kernel was compiled in and is supported by the CPU.
+ */
+bool picopter::ThresholdKernelSupported(ThresholdKernel kernel) {
+    switch (kernel) {
+        case THRESH_KERNEL_SCALAR:
+            return true;
+#ifdef THRESH_HAVE_X86
+        case THRESH_KERNEL_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case THRESH_KERNEL_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+#if defined(THRESH_HAVE_NEON) && defined(__aarch64__)
+        case THRESH_KERNEL_NEON:
+            return true;
+#elif defined(THRESH_HAVE_NEON) && defined(__linux__)
+        case THRESH_KERNEL_NEON:
+            return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+        default:
+            return false;
+    }
+}
+
+#ifndef THRESH_HAVE_X86
+//The x86 kernels are never selected elsewhere; fall back to the scalar kernel.
+template <int Bits>
+void picopter::ThresholdRowSSE2(const uint8_t *lut, const uint8_t *src,
+    uint8_t *dst, int width, int channels, int skip)
+{
+    ThresholdRowScalar<Bits>(lut, src, dst, width, channels, skip);
+}
+
+template <int Bits>
+void picopter::ThresholdRowAVX2(const uint8_t *lut, const uint8_t *src,
+    uint8_t *dst, int width, int channels, int skip)
+{
+    ThresholdRowScalar<Bits>(lut, src, dst, width, channels, skip);
+}
+
+template void picopter::ThresholdRowSSE2<4>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+template void picopter::ThresholdRowSSE2<5>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+template void picopter::ThresholdRowSSE2<6>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+template void picopter::ThresholdRowAVX2<4>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+template void picopter::ThresholdRowAVX2<5>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+template void picopter::ThresholdRowAVX2<6>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+#endif // THRESH_HAVE_X86
+
+#ifndef THRESH_HAVE_NEON
+//Likewise for the NEON kernel where it is not built.
+template <int Bits>
+void picopter::ThresholdRowNEON(const uint8_t *lut, const uint8_t *src,
+    uint8_t *dst, int width, int channels, int skip)
+{
+    ThresholdRowScalar<Bits>(lut, src, dst, width, channels, skip);
+}
+
+template void picopter::ThresholdRowNEON<4>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+template void picopter::ThresholdRowNEON<5>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+template void picopter::ThresholdRowNEON<6>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+#endif // THRESH_HAVE_NEON
+
+/**
+ * Determines the fastest thresholding kernel supported by this CPU.
+ * @return The kernel to use.
+ */
+ThresholdKernel picopter::DetectThresholdKernel() {
+    static const ThresholdKernel preference[] = {
+        THRESH_KERNEL_AVX2, THRESH_KERNEL_NEON, THRESH_KERNEL_SSE2
+    };
+    for (ThresholdKernel kernel : preference) {
+        if (ThresholdKernelSupported(kernel)) {
+            return kernel;
+        }
+    }
+    return THRESH_KERNEL_SCALAR;
+}
+
+/**
+ * Retrieves the row thresholding function of a kernel for one resolution.
+ * @tparam Bits The LUT resolution (bits per channel).
+ * @param [in] kernel The kernel to retrieve.
+ * @return The kernel function, or the scalar kernel if the requested kernel
+ *         is not supported on this CPU.
+ */
+template <int Bits>
+static ThresholdRowFn GetRowKernel(ThresholdKernel kernel) {
+    if (!ThresholdKernelSupported(kernel)) {
+        return ThresholdRowScalar<Bits>;
+    }
+    switch (kernel) {
+        case THRESH_KERNEL_SSE2:
+            return ThresholdRowSSE2<Bits>;
+        case THRESH_KERNEL_AVX2:
+            return ThresholdRowAVX2<Bits>;
+        case THRESH_KERNEL_NEON:
+            return ThresholdRowNEON<Bits>;
+        default:
+            return ThresholdRowScalar<Bits>;
+    }
+}
+
+/**
+ * Retrieves the row thresholding function for a given kernel.
+ * @param [in] kernel The kernel to retrieve.
+ * @param [in] bits The LUT resolution (bits per channel; 4, 5 or 6).
+ * @param [in] input The pixel layout of the rows. YUYV rows are always
+ *                   thresholded by the scalar kernel.
+ * @return The kernel function, or the scalar kernel if the requested kernel
+ *         is not supported on this CPU.
+ */
+ThresholdRowFn picopter::GetThresholdRowKernel(ThresholdKernel kernel, int bits,
+    ThresholdInput input)
+{
+    if (input == THRESH_INPUT_YUYV) {
+        switch (bits) {
+            case 5:
+                return ThresholdRowYUYV<5>;
+            case 6:
+                return ThresholdRowYUYV<6>;
+            default:
+                return ThresholdRowYUYV<4>;
+        }
+    }
+    switch (bits) {
+        case 5:
+            return GetRowKernel<5>(kernel);
+        case 6:
+            return GetRowKernel<6>(kernel);
+        default:
+            return GetRowKernel<4>(kernel);
+    }
+}
+
+/**
+ * Retrieves a human readable name for a kernel.
+ * @param [in] kernel The kernel.
+ * @return The kernel name.
+ */
+const char* picopter::GetThresholdKernelName(ThresholdKernel kernel) {
+    switch (kernel) {
+        case THRESH_KERNEL_SSE2: return "SSE2";
+        case THRESH_KERNEL_AVX2: return "AVX2";
+        case THRESH_KERNEL_NEON: return "NEON";
+        default: return "scalar";
+    }
+}
+
+/**
+ * Constructor. Creates an empty (all black) lookup table.
+ * @param [in] bits The number of bits per channel (clamped to 4-6).
+ * @param [in] kernel The kernel to use for thresholding with this table.
+ * @param [in] input The pixel layout the table is indexed with.
+ */
+ThresholdLUT::ThresholdLUT(int bits, ThresholdKernel kernel, ThresholdInput input)
+: m_bits(picopter::clamp(bits, 4, 6))
+, m_input(input)
+, m_table(static_cast<size_t>(1) << (3*m_bits), 0)
+, m_row(GetThresholdRowKernel(kernel, m_bits, input))
+{
+}
+
+/**
+ * Retrieves the number of bits per channel.
+ * @return The LUT resolution.
+ */
+int ThresholdLUT::GetBits() const {
+    return m_bits;
+}
+
+/**
+ * Retrieves the pixel layout that the table is indexed with.
+ * @return The input layout.
+ */
+ThresholdInput ThresholdLUT::GetInput() const {
+    return m_input;
+}
+
+/**
+ * Retrieves the number of colour bins per channel.
+ * @return The number of bins per channel.
+ */
+int ThresholdLUT::GetSize() const {
+    return 1 << m_bits;
+}
+
+/**
+ * Retrieves the number of entries in the table.
+ * @return The number of entries.
+ */
+size_t ThresholdLUT::GetEntries() const {
+    return m_table.size();
+}
+
+/**
+ * Retrieves the table entries.
+ * @return The table.
+ */
+uint8_t* ThresholdLUT::GetTable() {
+    return m_table.data();
+}
+
+/**
+ * Retrieves the table entries.
+ * @return The table.
+ */
+const uint8_t* ThresholdLUT::GetTable() const {
+    return m_table.data();
+}
+
+/**
+ * Retrieves the row kernel for this table.
+ * @return The row kernel.
+ */
+ThresholdRowFn ThresholdLUT::GetRowKernel() const {
+    return m_row;
+}
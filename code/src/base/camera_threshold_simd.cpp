@@ -0,0 +1,315 @@
+/**
+ * @file camera_threshold_simd.cpp
+ * @brief Vectorised colour thresholding kernels.
+ *
+ * The kernels in this file are compiled for instruction sets that may not be
+ * available on the CPU we end up running on; the caller must check
+ * ThresholdKernelSupported before using any of them. On the Pi, this file
+ * (and only this file) is built with NEON enabled, so it holds nothing but
+ * the kernels: the support checks and the scalar fallbacks for kernels that
+ * are not available on the target architecture are in camera_threshold.cpp.
+ *
+ * All kernels compute the same LUT index as the scalar kernel (see
+ * ColourLUT::Index). With B bits per channel and a pixel loaded as a
+ * little-endian 32-bit word w = b|g<<8|r<<16, that index is
+ *     ((w >> (24-3B)) & (M << 2B)) | ((w >> (16-2B)) & (M << B)) | ((w >> (8-B)) & M)
+ * where M = 2^B - 1; e.g. for B = 4,
+ *     ((w >> 12) & 0xF00) | ((w >> 8) & 0xF0) | ((w >> 4) & 0xF).
+ * The table lookup itself is done with scalar loads, since a byte gather
+ * (or an overreading 32-bit gather) from the LUT is no faster.
+ */
+
+#include "common.h"
+#include "camera_threshold.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define THRESH_HAVE_X86
+#  include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define THRESH_HAVE_NEON
+#  include <arm_neon.h>
+#endif
+
+using namespace picopter;
+
+/**
+ * Shifts and masks that turn a pixel word into a LUT index.
+ * @tparam Bits The LUT resolution (bits per channel).
+ */
+template <int Bits>
+struct PixelWordIndex {
+    enum {
+        SHIFT_R = 24 - 3*Bits,
+        SHIFT_G = 16 - 2*Bits,
+        SHIFT_B = 8 - Bits,
+        MASK_B = (1 << Bits) - 1,
+        MASK_G = MASK_B << Bits,
+        MASK_R = MASK_B << (2*Bits)
+    };
+};
+
+/**
+ * Loads a (possibly unaligned) pixel as a 32-bit word.
+ * @param [in] p Pointer to the pixel.
+ * @return The pixel word (b | g << 8 | r << 16 | x << 24).
+ */
+static inline uint32_t LoadPixel(const uint8_t *p) {
+    uint32_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+#ifdef THRESH_HAVE_X86
+/**
+ * Loads four pixel words that are Stride bytes apart with two vector loads,
+ * and gathers them into one vector with byte shifts and unpacks.
+ * @tparam Stride The distance between pixels (bytes; at most 12).
+ * @param [in] p Pointer to the first pixel. 2*Stride + 16 bytes are read.
+ * @return The pixel words.
+ */
+template <int Stride>
+__attribute__((target("sse2")))
+static inline __m128i LoadWordsSSE2(const uint8_t *p) {
+    static_assert(Stride + 4 <= 16, "Pixels too far apart");
+    __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2*Stride));
+    return _mm_unpacklo_epi64(
+        _mm_unpacklo_epi32(v0, _mm_srli_si128(v0, Stride)),
+        _mm_unpacklo_epi32(v1, _mm_srli_si128(v1, Stride)));
+}
+
+/**
+ * Turns four pixel words into their LUT indices.
+ * @tparam Bits The LUT resolution (bits per channel).
+ * @param [in] w The pixel words.
+ * @return The indices.
+ */
+template <int Bits>
+__attribute__((target("sse2")))
+static inline __m128i IndexWordsSSE2(__m128i w) {
+    typedef PixelWordIndex<Bits> W;
+    return _mm_or_si128(_mm_or_si128(
+        _mm_and_si128(_mm_srli_epi32(w, W::SHIFT_R), _mm_set1_epi32(W::MASK_R)),
+        _mm_and_si128(_mm_srli_epi32(w, W::SHIFT_G), _mm_set1_epi32(W::MASK_G))),
+        _mm_and_si128(_mm_srli_epi32(w, W::SHIFT_B), _mm_set1_epi32(W::MASK_B)));
+}
+
+/**
+ * Looks up four LUT indices, moving them out of the vector through general
+ * purpose registers (rather than through memory, which stalls).
+ * @param [in] lut The colour lookup table.
+ * @param [in] q The indices.
+ * @param [out] dst The four destination pixels.
+ */
+__attribute__((target("sse2")))
+static inline void LookupSSE2(const uint8_t *lut, __m128i q, uint8_t *dst) {
+    uint32_t a = static_cast<uint32_t>(_mm_cvtsi128_si32(q));
+    uint32_t b = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(q, 4)));
+    uint32_t c = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(q, 8)));
+    uint32_t d = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(q, 12)));
+    dst[0] = lut[a];
+    dst[1] = lut[b];
+    dst[2] = lut[c];
+    dst[3] = lut[d];
+}
+
+/**
+ * SSE2 row thresholding kernel for a fixed pixel stride. Sixteen pixels are
+ * deinterleaved per iteration with unaligned vector loads (see
+ * LoadWordsSSE2), then groups of four, then the rest with the scalar kernel.
+ * The vector loads read past the last pixel they use, so a loop only runs
+ * while its loads end within the row's last pixel; the tail is byte-exact.
+ * The target attribute must be on the first declaration of a template, so the
+ * kernels are file-local templates that the public kernels forward to.
+ * @see ThresholdRowFn
+ */
+template <int Bits, int Stride>
+__attribute__((target("sse2")))
+static void RowSSE2(const uint8_t *lut, const uint8_t *src,
+    uint8_t *dst, int width, int channels, int skip)
+{
+    //Bytes that may be read, counted from the first pixel.
+    const int end = (width - 1)*Stride + channels;
+    int i = 0, j;
+
+    for (; i*Stride + 14*Stride + 16 <= end; i += 16) {
+        const uint8_t *p = src + i*Stride;
+        for (j = 0; j < 16; j += 4) {
+            LookupSSE2(lut, IndexWordsSSE2<Bits>(
+                LoadWordsSSE2<Stride>(p + j*Stride)), dst + i + j);
+        }
+    }
+    for (; i*Stride + 2*Stride + 16 <= end; i += 4) {
+        LookupSSE2(lut, IndexWordsSSE2<Bits>(
+            LoadWordsSSE2<Stride>(src + i*Stride)), dst + i);
+    }
+    ThresholdRowScalar<Bits>(lut, src + i*Stride, dst + i, width - i, channels, skip);
+}
+
+/**
+ * AVX2 row thresholding kernel. Fetches eight pixels per vector with a
+ * hardware gather, then quantises and indexes them.
+ * @see ThresholdRowFn
+ */
+template <int Bits>
+__attribute__((target("avx2")))
+static void RowAVX2(const uint8_t *lut, const uint8_t *src,
+    uint8_t *dst, int width, int channels, int skip)
+{
+    typedef PixelWordIndex<Bits> W;
+    const __m256i mask_r = _mm256_set1_epi32(W::MASK_R);
+    const __m256i mask_g = _mm256_set1_epi32(W::MASK_G);
+    const __m256i mask_b = _mm256_set1_epi32(W::MASK_B);
+    const int stride = channels*skip;
+    const __m256i offsets = _mm256_mullo_epi32(
+        _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+    //The last pixel is left to the scalar tail, as its 32-bit load could
+    //read one byte past the end of a packed BGR image.
+    const int vec_width = (width - 1) & ~7;
+    alignas(32) uint32_t idx[8];
+    int i = 0, j;
+
+    for (; i < vec_width; i += 8) {
+        __m256i w = _mm256_i32gather_epi32(
+            reinterpret_cast<const int*>(src + i*stride), offsets, 1);
+        __m256i q = _mm256_or_si256(_mm256_or_si256(
+            _mm256_and_si256(_mm256_srli_epi32(w, W::SHIFT_R), mask_r),
+            _mm256_and_si256(_mm256_srli_epi32(w, W::SHIFT_G), mask_g)),
+            _mm256_and_si256(_mm256_srli_epi32(w, W::SHIFT_B), mask_b));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(idx), q);
+
+        for (j = 0; j < 8; j++) {
+            dst[i+j] = lut[idx[j]];
+        }
+    }
+    ThresholdRowScalar<Bits>(lut, src + i*stride, dst + i, width - i, channels, skip);
+}
+
+template <int Bits>
+void picopter::ThresholdRowSSE2(const uint8_t *lut, const uint8_t *src,
+    uint8_t *dst, int width, int channels, int skip)
+{
+    switch (channels*skip) {
+        case 3:
+            RowSSE2<Bits, 3>(lut, src, dst, width, channels, skip);
+            break;
+        case 4:
+            RowSSE2<Bits, 4>(lut, src, dst, width, channels, skip);
+            break;
+        case 6:
+            RowSSE2<Bits, 6>(lut, src, dst, width, channels, skip);
+            break;
+        case 8:
+            RowSSE2<Bits, 8>(lut, src, dst, width, channels, skip);
+            break;
+        case 9:
+            RowSSE2<Bits, 9>(lut, src, dst, width, channels, skip);
+            break;
+        case 12:
+            RowSSE2<Bits, 12>(lut, src, dst, width, channels, skip);
+            break;
+        default:
+            //Pixels too far apart to share a load.
+            ThresholdRowScalar<Bits>(lut, src, dst, width, channels, skip);
+            break;
+    }
+}
+
+template <int Bits>
+void picopter::ThresholdRowAVX2(const uint8_t *lut, const uint8_t *src,
+    uint8_t *dst, int width, int channels, int skip)
+{
+    RowAVX2<Bits>(lut, src, dst, width, channels, skip);
+}
+
+template void picopter::ThresholdRowSSE2<4>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+template void picopter::ThresholdRowSSE2<5>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+template void picopter::ThresholdRowSSE2<6>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+template void picopter::ThresholdRowAVX2<4>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+template void picopter::ThresholdRowAVX2<5>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+template void picopter::ThresholdRowAVX2<6>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+#endif // THRESH_HAVE_X86
+
+#ifdef THRESH_HAVE_NEON
+/**
+ * NEON row thresholding kernel. For packed BGR input at full or half
+ * resolution, 16 pixels are deinterleaved per iteration with VLD3 and
+ * indexed in 16-bit lanes (which only fit indices of up to 5 bits per
+ * channel); other layouts quantise four pixel words per vector.
+ * @see ThresholdRowFn
+ */
+template <int Bits>
+void picopter::ThresholdRowNEON(const uint8_t *lut, const uint8_t *src,
+    uint8_t *dst, int width, int channels, int skip)
+{
+    typedef PixelWordIndex<Bits> W;
+    const int stride = channels*skip;
+    int i = 0, j;
+
+    if (Bits <= 5 && channels == 3 && (skip == 1 || skip == 2)) {
+        alignas(16) uint16_t idx[16];
+        for (; i + 16 <= width; i += 16) {
+            const uint8_t *p = src + i*stride;
+            uint8x16x3_t px;
+            if (skip == 1) {
+                px = vld3q_u8(p);
+            } else {
+                //Load 32 pixels and keep the even ones.
+                uint8x16x3_t a = vld3q_u8(p), b = vld3q_u8(p + 48);
+                px.val[0] = vuzpq_u8(a.val[0], b.val[0]).val[0];
+                px.val[1] = vuzpq_u8(a.val[1], b.val[1]).val[0];
+                px.val[2] = vuzpq_u8(a.val[2], b.val[2]).val[0];
+            }
+            uint8x16_t b = vshrq_n_u8(px.val[0], 8 - Bits);
+            uint8x16_t g = vshrq_n_u8(px.val[1], 8 - Bits);
+            uint8x16_t r = vshrq_n_u8(px.val[2], 8 - Bits);
+            uint16x8_t lo = vorrq_u16(vorrq_u16(
+                vshlq_n_u16(vmovl_u8(vget_low_u8(r)), 2*Bits),
+                vshlq_n_u16(vmovl_u8(vget_low_u8(g)), Bits)),
+                vmovl_u8(vget_low_u8(b)));
+            uint16x8_t hi = vorrq_u16(vorrq_u16(
+                vshlq_n_u16(vmovl_u8(vget_high_u8(r)), 2*Bits),
+                vshlq_n_u16(vmovl_u8(vget_high_u8(g)), Bits)),
+                vmovl_u8(vget_high_u8(b)));
+            vst1q_u16(idx, lo);
+            vst1q_u16(idx + 8, hi);
+
+            for (j = 0; j < 16; j++) {
+                dst[i+j] = lut[idx[j]];
+            }
+        }
+    } else {
+        const uint32x4_t mask_r = vdupq_n_u32(W::MASK_R);
+        const uint32x4_t mask_g = vdupq_n_u32(W::MASK_G);
+        const uint32x4_t mask_b = vdupq_n_u32(W::MASK_B);
+        //See RowAVX2 for why the last pixel is excluded.
+        const int vec_width = (width - 1) & ~3;
+        alignas(16) uint32_t idx[4];
+        for (; i < vec_width; i += 4) {
+            const uint8_t *p = src + i*stride;
+            idx[0] = LoadPixel(p);
+            idx[1] = LoadPixel(p + stride);
+            idx[2] = LoadPixel(p + 2*stride);
+            idx[3] = LoadPixel(p + 3*stride);
+            uint32x4_t w = vld1q_u32(idx);
+            uint32x4_t q = vorrq_u32(vorrq_u32(
+                vandq_u32(vshrq_n_u32(w, W::SHIFT_R), mask_r),
+                vandq_u32(vshrq_n_u32(w, W::SHIFT_G), mask_g)),
+                vandq_u32(vshrq_n_u32(w, W::SHIFT_B), mask_b));
+            vst1q_u32(idx, q);
+
+            dst[i]   = lut[idx[0]];
+            dst[i+1] = lut[idx[1]];
+            dst[i+2] = lut[idx[2]];
+            dst[i+3] = lut[idx[3]];
+        }
+    }
+    ThresholdRowScalar<Bits>(lut, src + i*stride, dst + i, width - i, channels, skip);
+}
+
+template void picopter::ThresholdRowNEON<4>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+template void picopter::ThresholdRowNEON<5>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+template void picopter::ThresholdRowNEON<6>(const uint8_t*, const uint8_t*, uint8_t*, int, int, int);
+#endif // THRESH_HAVE_NEON
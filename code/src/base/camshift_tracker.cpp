@@ -0,0 +1,270 @@
+/**
+ * @file camshift_tracker.cpp
+ * @brief CamShift (colour histogram) object tracking.
+ */
+
+#include "common.h"
+#include "camshift_tracker.h"
+#include <algorithm>
+
+using namespace picopter;
+using std::chrono::steady_clock;
+
+/** Pixels darker or less saturated than this are ignored **/
+#define TRACK_MIN_SAT 100
+#define TRACK_MIN_VAL 130
+/** Mean back projection (0-255) over the object below which it is lost **/
+#define TRACK_MIN_SCORE 16
+
+/** Histogram of hue (0-179) and saturation (0-255) **/
+static const int hist_channels[] = {0, 1};
+static const int hist_size[] = {10, 30};
+static const float hue_range[] = {0, 180}, sat_range[] = {0, 256};
+static const float *hist_ranges[] = {hue_range, sat_range};
+
+/**
+ * Masks out the pixels whose hue is unreliable.
+ * @param [in] hsv The HSV image.
+ * @param [out] mask The mask of usable pixels.
+ */
+static void ColourMask(const cv::Mat &hsv, cv::Mat &mask) {
+    cv::inRange(hsv, cv::Scalar(0, TRACK_MIN_SAT, TRACK_MIN_VAL),
+        cv::Scalar(180, 256, 256), mask);
+}
+
+/**
+ * Constructor. Creates an inactive tracker.
+ */
+CamShiftTracker::CamShiftTracker()
+: m_active(false)
+, m_id(-1)
+{
+}
+
+/**
+ * Computes the colour model of an object.
+ * @param [in] hsv The HSV image.
+ * @param [in] bounds The bounds of the object within the image.
+ * @param [out] hist The colour model (normalised to 0-255).
+ */
+void CamShiftTracker::LearnHistogram(const cv::Mat &hsv, const cv::Rect &bounds, cv::Mat *hist) {
+    cv::Mat roi = hsv(bounds & cv::Rect(0, 0, hsv.cols, hsv.rows)), mask;
+
+    ColourMask(roi, mask);
+    cv::calcHist(&roi, 1, hist_channels, mask, *hist, 2, hist_size,
+        hist_ranges, true, false);
+    cv::normalize(*hist, *hist, 0, 255, cv::NORM_MINMAX);
+}
+
+/**
+ * Starts tracking an object.
+ * @param [in] id The target ID.
+ * @param [in] hist The colour model of the object (see LearnHistogram).
+ * @param [in] bounds The bounds of the object.
+ * @param [in] time The capture time of the frame the object was found in.
+ * @param [in] window The search window parameters.
+ */
+void CamShiftTracker::Start(int id, const cv::Mat &hist, const cv::Rect &bounds,
+    steady_clock::time_point time, const TrackingWindow &window)
+{
+    m_active = true;
+    m_id = id;
+    hist.copyTo(m_hist);
+    m_bounds = bounds;
+    m_box = cv::RotatedRect(cv::Point2f(bounds.x + bounds.width / 2.0f,
+        bounds.y + bounds.height / 2.0f),
+        cv::Size2f(bounds.width, bounds.height), 0);
+    m_window = window;
+    m_window.Reset();
+    m_window.Update(time, &bounds);
+}
+
+/**
+ * Stops tracking.
+ */
+void CamShiftTracker::Stop() {
+    m_active = false;
+}
+
+/**
+ * Follows the object into the next frame.
+ * @param [in] hsv The HSV image.
+ * @param [in] time The capture time of the image.
+ * @return true iff the object was found. The tracker stops once the object
+ *         has been missed too many times in a row.
+ */
+bool CamShiftTracker::Update(const cv::Mat &hsv, steady_clock::time_point time) {
+    cv::TermCriteria tc(cv::TermCriteria::EPS|cv::TermCriteria::COUNT, 10, 1);
+    bool found = false;
+
+    if (!m_active) {
+        return false;
+    }
+
+    if (!m_window.GetWindow(hsv.size(), time, &m_search)) {
+        m_search = cv::Rect(0, 0, hsv.cols, hsv.rows);
+    }
+
+    cv::Rect local = (m_bounds - m_search.tl()) &
+        cv::Rect(0, 0, m_search.width, m_search.height);
+    if (local.width <= 1 || local.height <= 1) {
+        local = cv::Rect(0, 0, m_search.width, m_search.height);
+    }
+
+    cv::Mat roi = hsv(m_search);
+    ColourMask(roi, m_mask);
+    cv::calcBackProject(&roi, 1, hist_channels, m_hist, m_backproj, hist_ranges);
+    m_backproj &= m_mask;
+
+    cv::RotatedRect box = cv::CamShift(m_backproj, local, tc);
+    if (local.area() > 1 && cv::mean(m_backproj(local))[0] >= TRACK_MIN_SCORE) {
+        box.center.x += m_search.x;
+        box.center.y += m_search.y;
+        m_box = box;
+        m_bounds = local + m_search.tl();
+        found = true;
+    }
+
+    m_window.Update(time, found ? &m_bounds : NULL);
+    m_active = m_window.IsLocked();
+    return found;
+}
+
+/**
+ * Determines if the tracker is following an object.
+ * @return true iff the tracker is active.
+ */
+bool CamShiftTracker::IsActive() const {
+    return m_active;
+}
+
+/**
+ * Retrieves the target ID.
+ * @return The ID given when tracking was started.
+ */
+int CamShiftTracker::GetId() const {
+    return m_id;
+}
+
+/**
+ * Retrieves the colour model.
+ * @return The colour model.
+ */
+const cv::Mat& CamShiftTracker::GetHistogram() const {
+    return m_hist;
+}
+
+/**
+ * Retrieves the last position of the object.
+ * @return The rotated bounding box of the object (image coordinates).
+ */
+const cv::RotatedRect& CamShiftTracker::GetBox() const {
+    return m_box;
+}
+
+/**
+ * Retrieves the CamShift window.
+ * @return The upright bounds of the object (image coordinates).
+ */
+const cv::Rect& CamShiftTracker::GetBounds() const {
+    return m_bounds;
+}
+
+/**
+ * Retrieves the region that was last searched.
+ * @return The search window (image coordinates).
+ */
+const cv::Rect& CamShiftTracker::GetSearchWindow() const {
+    return m_search;
+}
+
+/**
+ * Retrieves the back projection of the search window.
+ * @return The back projection (the size of the search window).
+ */
+const cv::Mat& CamShiftTracker::GetBackProjection() const {
+    return m_backproj;
+}
+
+/**
+ * Constructor.
+ * @param [in] capacity The maximum number of models to keep.
+ * @param [in] max_distance The largest Bhattacharyya distance (0-1) at which
+ *                          two models are considered to be the same colour.
+ */
+HistogramCache::HistogramCache(size_t capacity, double max_distance)
+: m_capacity(capacity)
+, m_max_distance(max_distance)
+{
+}
+
+/**
+ * Finds the cached model most similar to the given one.
+ * @param [in] hist The model.
+ * @return The index of the closest model within range, or -1 if none.
+ */
+int HistogramCache::Closest(const cv::Mat &hist) {
+    int best = -1;
+    double best_distance = m_max_distance;
+
+    for (size_t i = 0; i < m_entries.size(); i++) {
+        double distance = cv::compareHist(hist, m_entries[i], CV_COMP_BHATTACHARYYA);
+        if (distance <= best_distance) {
+            best = static_cast<int>(i);
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+/**
+ * Looks up a previously learned model of the same colour.
+ * @param [in] hist The newly learned model.
+ * @param [out] cached The cached model, if found.
+ * @return true iff a model of the same colour was cached.
+ */
+bool HistogramCache::Find(const cv::Mat &hist, cv::Mat *cached) {
+    int i = Closest(hist);
+    if (i < 0) {
+        return false;
+    }
+    std::rotate(m_entries.begin(), m_entries.begin() + i, m_entries.begin() + i + 1);
+    *cached = m_entries.front();
+    return true;
+}
+
+/**
+ * Stores a model, replacing any cached model of the same colour. The least
+ * recently used model is evicted when the cache is full.
+ * @param [in] hist The model.
+ */
+void HistogramCache::Store(const cv::Mat &hist) {
+    if (m_capacity == 0) {
+        return;
+    }
+
+    int i = Closest(hist);
+    if (i < 0) {
+        if (m_entries.size() < m_capacity) {
+            m_entries.push_back(cv::Mat());
+        }
+        i = static_cast<int>(m_entries.size()) - 1;
+    }
+    std::rotate(m_entries.begin(), m_entries.begin() + i, m_entries.begin() + i + 1);
+    m_entries.front() = hist.clone();
+}
+
+/**
+ * Removes all cached models.
+ */
+void HistogramCache::Clear() {
+    m_entries.clear();
+}
+
+/**
+ * Retrieves the number of cached models.
+ * @return The number of models.
+ */
+size_t HistogramCache::Size() const {
+    return m_entries.size();
+}
@@ -0,0 +1,248 @@
+/**
+ * @file colour_learner.cpp
+ * @brief Learns colour thresholds from the pixels in a region of the frame.
+ */
+
+#include "common.h"
+#include "colour_learner.h"
+#include "camera_threshold.h"
+#include <cmath>
+
+using namespace picopter;
+
+/** The hue period (OpenCV's 8 bit hue is halved degrees) **/
+#define LEARN_HUE_RANGE 180
+/** Cells less saturated than this have no meaningful hue **/
+#define LEARN_MIN_SATURATION 32
+
+/**
+ * Counts the colour cells of a region's sampled pixels.
+ * @tparam Bits The LUT resolution (bits per channel).
+ * @param [in] image The frame (BGR or BGRA).
+ * @param [in] roi The region to sample (within the frame).
+ * @param [in] skip The sampling stride, in both directions.
+ * @param [in,out] cells The counts to add to.
+ */
+template <int Bits>
+static void CountCells(const cv::Mat &image, const cv::Rect &roi, int skip,
+    uint32_t *cells)
+{
+    int channels = image.channels();
+    for (int y = roi.y; y < roi.y + roi.height; y += skip) {
+        const uint8_t *row = image.ptr<uint8_t>(y) + roi.x * channels;
+        for (int x = 0; x < roi.width; x += skip, row += skip * channels) {
+            cells[ColourLUT<Bits>::Index(row[2], row[1], row[0])]++;
+        }
+    }
+}
+
+/**
+ * Constructor.
+ * @param [in] frames The number of frames in each block of counts; the
+ *                    ranges cover between one and two blocks.
+ * @param [in] percentile The fraction (%) of the samples left out at each
+ *                        end of a range, so outliers do not widen it.
+ * @param [in] margin The amount (in channel values) each range is widened by.
+ */
+ColourLearner::ColourLearner(int frames, int percentile, int margin)
+: m_frames(std::max(frames, 1))
+, m_percentile(picopter::clamp(percentile, 0, 45))
+, m_margin(std::max(margin, 0))
+{
+    Reset(4);
+}
+
+/**
+ * Forgets everything accumulated so far.
+ * @param [in] bits The LUT resolution (bits per channel) to accumulate at.
+ */
+void ColourLearner::Reset(int bits) {
+    m_bits = picopter::clamp(bits, 4, 6);
+    for (int i = 0; i < 2; i++) {
+        m_cells[i].assign(static_cast<size_t>(1) << (3 * m_bits), 0);
+        m_samples[i] = 0;
+    }
+    m_count = 0;
+    m_total_frames = 0;
+}
+
+/**
+ * Adds the colours of a frame's region.
+ * @param [in] image The frame (BGR or BGRA).
+ * @param [in] roi The region to learn from.
+ * @param [in] skip The sampling stride, in both directions.
+ */
+void ColourLearner::Accumulate(const cv::Mat &image, const cv::Rect &roi, int skip) {
+    cv::Rect region = roi & cv::Rect(0, 0, image.cols, image.rows);
+    skip = std::max(skip, 1);
+
+    if (m_count >= m_frames) {
+        m_cells[1].swap(m_cells[0]);
+        std::fill(m_cells[0].begin(), m_cells[0].end(), 0);
+        m_samples[1] = m_samples[0];
+        m_samples[0] = 0;
+        m_count = 0;
+    }
+
+    switch (m_bits) {
+        case 5:
+            CountCells<5>(image, region, skip, m_cells[0].data());
+            break;
+        case 6:
+            CountCells<6>(image, region, skip, m_cells[0].data());
+            break;
+        default:
+            CountCells<4>(image, region, skip, m_cells[0].data());
+            break;
+    }
+    m_samples[0] += static_cast<uint64_t>((region.width + skip - 1) / skip) *
+        ((region.height + skip - 1) / skip);
+    m_count++;
+    m_total_frames++;
+}
+
+/**
+ * Retrieves the LUT resolution being accumulated at.
+ * @return The bits per channel.
+ */
+int ColourLearner::GetBits() const {
+    return m_bits;
+}
+
+/**
+ * Retrieves the number of frames accumulated since the last reset.
+ * @return The number of frames.
+ */
+uint64_t ColourLearner::GetFrames() const {
+    return m_total_frames;
+}
+
+/**
+ * Retrieves the number of cells; the colour cube planes passed in must have
+ * this many entries.
+ * @return The number of cells.
+ */
+size_t ColourLearner::GetEntries() const {
+    return m_cells[0].size();
+}
+
+/**
+ * Retrieves the number of samples the ranges are taken from.
+ * @return The number of samples.
+ */
+uint64_t ColourLearner::GetSamples() const {
+    return m_samples[0] + m_samples[1];
+}
+
+/**
+ * Finds the percentiles at either end of a histogram.
+ * @param [in] hist The histogram (not empty).
+ * @param [out] lo The lower percentile bin.
+ * @param [out] hi The upper percentile bin.
+ */
+void ColourLearner::Percentiles(const std::vector<uint64_t> &hist, int *lo, int *hi) const {
+    uint64_t total = 0, sum = 0, cut;
+
+    for (uint64_t count : hist) {
+        total += count;
+    }
+    cut = (total * m_percentile) / 100;
+
+    *lo = -1;
+    *hi = static_cast<int>(hist.size()) - 1;
+    for (size_t i = 0; i < hist.size(); i++) {
+        sum += hist[i];
+        if (*lo < 0 && sum > cut) {
+            *lo = static_cast<int>(i);
+        }
+        if (sum >= total - cut) {
+            *hi = static_cast<int>(i);
+            break;
+        }
+    }
+}
+
+/**
+ * Finds the range of a linear channel (e.g. Cb or Cr).
+ * @param [in] plane The channel's value in each cell (a colour cube plane of
+ *                   GetEntries() values).
+ * @param [out] min The lower bound (0-255).
+ * @param [out] max The upper bound (0-255).
+ * @return true iff there were any samples.
+ */
+bool ColourLearner::GetRange(const uint8_t *plane, int *min, int *max) const {
+    std::vector<uint64_t> hist(256, 0);
+    int lo, hi;
+
+    if (GetSamples() == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < GetEntries(); i++) {
+        hist[plane[i]] += m_cells[0][i] + m_cells[1][i];
+    }
+
+    Percentiles(hist, &lo, &hi);
+    *min = std::max(lo - m_margin, 0);
+    *max = std::min(hi + m_margin, 255);
+    return true;
+}
+
+/**
+ * Finds the range of hue. Hue wraps around, so the range is centred on the
+ * circular mean, and a range that wraps has a negative lower bound (as the
+ * thresholds expect). Cells that are nearly grey are left out.
+ * @param [in] hue The hue of each cell (a colour cube plane, 0-180).
+ * @param [in] sat The saturation of each cell (a colour cube plane).
+ * @param [out] min The lower bound (-180 to 180).
+ * @param [out] max The upper bound (0-180).
+ * @return true iff there were any coloured samples.
+ */
+bool ColourLearner::GetHueRange(const uint8_t *hue, const uint8_t *sat,
+    int *min, int *max) const
+{
+    std::vector<uint64_t> hues(256, 0), hist(LEARN_HUE_RANGE, 0);
+    double sum_cos = 0, sum_sin = 0, total = 0;
+    int mean, lo, hi;
+
+    //One pass over the cells; the rest only looks at the hue histogram.
+    for (size_t i = 0; i < GetEntries(); i++) {
+        if (sat[i] >= LEARN_MIN_SATURATION) {
+            hues[hue[i]] += m_cells[0][i] + m_cells[1][i];
+        }
+    }
+    for (int h = 0; h < 256; h++) {
+        if (hues[h] > 0) {
+            double angle = (2 * M_PI * h) / LEARN_HUE_RANGE;
+            sum_cos += hues[h] * std::cos(angle);
+            sum_sin += hues[h] * std::sin(angle);
+            total += hues[h];
+        }
+    }
+    if (total == 0) {
+        return false;
+    }
+    mean = static_cast<int>(std::lround(
+        (std::atan2(sum_sin, sum_cos) * LEARN_HUE_RANGE) / (2 * M_PI)));
+
+    //Histogram of the offsets from the mean, in [-range/2, range/2).
+    for (int h = 0; h < 256; h++) {
+        int offset = h - mean + LEARN_HUE_RANGE/2;
+        offset = ((offset % LEARN_HUE_RANGE) + LEARN_HUE_RANGE) % LEARN_HUE_RANGE;
+        hist[offset] += hues[h];
+    }
+
+    Percentiles(hist, &lo, &hi);
+    *min = mean + lo - LEARN_HUE_RANGE/2 - m_margin;
+    *max = mean + hi - LEARN_HUE_RANGE/2 + m_margin;
+    if (*max - *min >= LEARN_HUE_RANGE) {
+        *min = 0;
+        *max = LEARN_HUE_RANGE;
+    } else {
+        //Bring the upper bound into range; the lower bound follows it.
+        int wraps = static_cast<int>(std::floor(
+            static_cast<double>(*max) / LEARN_HUE_RANGE));
+        *min -= wraps * LEARN_HUE_RANGE;
+        *max -= wraps * LEARN_HUE_RANGE;
+    }
+    return true;
+}
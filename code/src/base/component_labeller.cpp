@@ -0,0 +1,190 @@
+/**
+ * @file component_labeller.cpp
+ * @brief Run-length connected component labelling.
+ */
+
+#include "common.h"
+#include "component_labeller.h"
+#include <algorithm>
+
+using namespace picopter;
+
+/**
+ * Run-length encodes a thresholded row, appending its runs.
+ * @param [in] row The thresholded row (non-zero = set).
+ * @param [in] width The number of pixels in the row.
+ * @param [in] y The row index.
+ * @param [in] gap Runs separated by at most this many clear pixels are merged
+ *                 into one run. This closes small holes and breaks in the
+ *                 same way as a morphological closing, at no extra cost.
+ * @param [in,out] runs The runs to append to.
+ */
+void picopter::EncodeRuns(const uint8_t *row, int width, int y, int gap,
+    std::vector<PixelRun> *runs)
+{
+    size_t row_start = runs->size();
+    int x = 0;
+
+    while (x < width) {
+        while (x < width && !row[x]) {
+            x++;
+        }
+        if (x == width) {
+            break;
+        }
+
+        int start = x;
+        while (x < width && row[x]) {
+            x++;
+        }
+
+        if (runs->size() > row_start && start - runs->back().end <= gap) {
+            runs->back().end = x;
+        } else {
+            runs->push_back(PixelRun{y, start, x});
+        }
+    }
+}
+
+/**
+ * Constructor.
+ */
+ComponentLabeller::ComponentLabeller() {
+}
+
+/**
+ * Finds the root of a run, halving the path as it goes.
+ * @param [in] i The run index.
+ * @return The root run index.
+ */
+int ComponentLabeller::Find(int i) {
+    while (m_parent[i] != i) {
+        m_parent[i] = m_parent[m_parent[i]];
+        i = m_parent[i];
+    }
+    return i;
+}
+
+/**
+ * Merges the components of two runs. The lower root index becomes the root,
+ * so that roots are always the first run of their component.
+ * @param [in] a The first run index.
+ * @param [in] b The second run index.
+ */
+void ComponentLabeller::Union(int a, int b) {
+    a = Find(a);
+    b = Find(b);
+    if (a < b) {
+        m_parent[b] = a;
+    } else if (b < a) {
+        m_parent[a] = b;
+    }
+}
+
+/**
+ * Labels the connected components of a run-length encoded binary image.
+ * @param [in] runs The runs, ordered by row and then by start (as produced by
+ *                  EncodeRuns). Runs within a row must not touch.
+ * @param [in] count The number of runs.
+ * @return The number of components.
+ */
+int ComponentLabeller::Label(const PixelRun *runs, size_t count) {
+    int n = static_cast<int>(count);
+    int prev_begin = 0, prev_end = 0;
+
+    m_parent.resize(n);
+    m_blob_index.assign(n, -1);
+    m_blobs.clear();
+    for (int i = 0; i < n; i++) {
+        m_parent[i] = i;
+    }
+
+    //Join each row to the row above.
+    for (int cur_begin = 0; cur_begin < n;) {
+        int y = runs[cur_begin].y;
+        int cur_end = cur_begin;
+        while (cur_end < n && runs[cur_end].y == y) {
+            cur_end++;
+        }
+
+        if (prev_end > prev_begin && runs[prev_begin].y == y - 1) {
+            int p = prev_begin;
+            for (int c = cur_begin; c < cur_end; c++) {
+                //Runs touch (8-connected) iff they overlap when extended
+                //by one pixel on either side.
+                while (p < prev_end && runs[p].end < runs[c].start) {
+                    p++;
+                }
+                for (int q = p; q < prev_end && runs[q].start <= runs[c].end; q++) {
+                    Union(q, c);
+                }
+            }
+        }
+
+        prev_begin = cur_begin;
+        prev_end = cur_end;
+        cur_begin = cur_end;
+    }
+
+    //Accumulate the statistics of each component.
+    for (int i = 0; i < n; i++) {
+        const PixelRun &run = runs[i];
+        int root = Find(i);
+        int64_t len = run.end - run.start;
+
+        if (m_blob_index[root] < 0) {
+            m_blob_index[root] = static_cast<int>(m_blobs.size());
+            m_blobs.push_back(Blob{0, 0, 0, run.start, run.y, run.end - 1, run.y});
+        }
+
+        Blob &blob = m_blobs[m_blob_index[root]];
+        blob.area += len;
+        blob.sum_x += (len * (run.start + run.end - 1)) / 2;
+        blob.sum_y += len * run.y;
+        blob.min_x = std::min(blob.min_x, run.start);
+        blob.max_x = std::max(blob.max_x, run.end - 1);
+        blob.max_y = std::max(blob.max_y, run.y);
+    }
+
+    return static_cast<int>(m_blobs.size());
+}
+
+/**
+ * Labels the connected components of a run-length encoded binary image.
+ * @param [in] runs The runs (see above).
+ * @return The number of components.
+ */
+int ComponentLabeller::Label(const std::vector<PixelRun> &runs) {
+    return Label(runs.data(), runs.size());
+}
+
+/**
+ * Retrieves the components found by the last call to Label.
+ * @return The components, in no particular order.
+ */
+const std::vector<Blob>& ComponentLabeller::GetBlobs() const {
+    return m_blobs;
+}
+
+/**
+ * Selects the largest components found by the last call to Label. Only the
+ * k largest are ordered, rather than sorting every component.
+ * @param [in] k The maximum number of components to select.
+ * @param [in] min_area Components smaller than this are not selected.
+ * @param [out] out The selected components, largest first.
+ * @return The number of components selected.
+ */
+int ComponentLabeller::SelectLargest(int k, int64_t min_area, std::vector<Blob> *out) {
+    size_t top = std::min(static_cast<size_t>(std::max(k, 0)), m_blobs.size());
+
+    std::partial_sort(m_blobs.begin(), m_blobs.begin() + top, m_blobs.end(),
+        [] (const Blob &a, const Blob &b) {
+            return a.area > b.area;
+        });
+
+    out->clear();
+    for (size_t i = 0; i < top && m_blobs[i].area >= min_area; i++) {
+        out->push_back(m_blobs[i]);
+    }
+    return static_cast<int>(out->size());
+}
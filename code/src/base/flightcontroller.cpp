@@ -158,6 +158,9 @@ void FlightController::HUDParser(const mavlink_message_t *msg) {
                 m_hud.status2.clear();
             }
             m_fb->GetGimbalPose(&m_hud.gimbal);
+            if (m_imu) {
+                m_imu->GetLatest(&m_hud.attitude);
+            }
             m_camera->SetHUDInfo(&m_hud);
         }
     } else if (msg->msgid == MAVLINK_MSG_ID_SYSTEM_TIME) {
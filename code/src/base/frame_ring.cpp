@@ -0,0 +1,262 @@
+/**
+ * @file frame_ring.cpp
+ * @brief Shared memory ring of camera frames for external processes.
+ */
+
+#include "common.h"
+#include "frame_ring.h"
+
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace picopter;
+
+/** Alignment of the slots and image data (bytes) **/
+#define FRAME_RING_ALIGN 64
+/** Number of attempts to read a slot that is being written **/
+#define FRAME_RING_READ_TRIES 4
+
+/**
+ * Rounds a size up to the slot alignment.
+ * @param [in] size The size.
+ * @return The aligned size.
+ */
+static inline size_t Align(size_t size) {
+    return (size + FRAME_RING_ALIGN - 1) & ~static_cast<size_t>(FRAME_RING_ALIGN - 1);
+}
+
+/**
+ * Retrieves a slot of the ring.
+ * @param [in] header The ring header.
+ * @param [in] index The frame index (the slot is index % slots).
+ * @return The slot.
+ */
+static inline FrameRingSlot* GetSlot(const FrameRingHeader *header, uint64_t index) {
+    uint8_t *base = reinterpret_cast<uint8_t*>(const_cast<FrameRingHeader*>(header));
+    return reinterpret_cast<FrameRingSlot*>(base + header->slot_offset +
+        (index % header->slots) * header->slot_stride);
+}
+
+/**
+ * Retrieves the image data of a slot.
+ * @param [in] slot The slot.
+ * @return The image data.
+ */
+static inline uint8_t* GetSlotData(FrameRingSlot *slot) {
+    return reinterpret_cast<uint8_t*>(slot) + Align(sizeof(FrameRingSlot));
+}
+
+/**
+ * Constructor. Creates (or replaces) the shared memory ring.
+ * @param [in] name The shared memory object name (e.g. FRAME_RING_NAME).
+ * @param [in] slots The number of frames kept.
+ * @param [in] capacity The largest image (in bytes) that can be written.
+ * @throws std::invalid_argument if the ring cannot be created.
+ */
+FrameRingWriter::FrameRingWriter(const char *name, int slots, size_t capacity)
+: m_name(name)
+, m_map(MAP_FAILED)
+, m_size(0)
+, m_header(NULL)
+{
+    size_t slot_offset = Align(sizeof(FrameRingHeader));
+    size_t slot_stride = Align(sizeof(FrameRingSlot)) + Align(capacity);
+
+    if (slots < 1 || capacity > UINT32_MAX) {
+        throw std::invalid_argument("Invalid frame ring size.");
+    }
+    m_size = slot_offset + slot_stride * slots;
+
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd == -1) {
+        throw std::invalid_argument("Could not create the frame ring.");
+    } else if (ftruncate(fd, m_size) == -1) {
+        close(fd);
+        shm_unlink(name);
+        throw std::invalid_argument("Could not size the frame ring.");
+    }
+    m_map = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m_map == MAP_FAILED) {
+        shm_unlink(name);
+        throw std::invalid_argument("Could not map the frame ring.");
+    }
+
+    //Readers only trust the ring once the magic has been published.
+    memset(m_map, 0, m_size);
+    m_header = static_cast<FrameRingHeader*>(m_map);
+    m_header->version = FRAME_RING_VERSION;
+    m_header->slots = slots;
+    m_header->capacity = static_cast<uint32_t>(capacity);
+    m_header->slot_offset = slot_offset;
+    m_header->slot_stride = slot_stride;
+    m_header->written.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_header->magic = FRAME_RING_MAGIC;
+}
+
+/**
+ * Destructor. Removes the shared memory ring. Readers that have it mapped
+ * keep their (stale) mapping.
+ */
+FrameRingWriter::~FrameRingWriter() {
+    munmap(m_map, m_size);
+    shm_unlink(m_name.c_str());
+}
+
+/**
+ * Writes a frame into the next slot, overwriting the oldest frame.
+ * @param [in] image The frame.
+ * @param [in] info The frame description. The dimensions, stride and type
+ *                  are filled in from the image.
+ * @return true iff the frame was written (false if it is too large).
+ */
+bool FrameRingWriter::Write(const cv::Mat &image, const FrameInfo &info) {
+    size_t row = image.cols * image.elemSize();
+    if (row * image.rows > m_header->capacity) {
+        return false;
+    }
+
+    uint64_t index = m_header->written.load(std::memory_order_relaxed);
+    FrameRingSlot *slot = GetSlot(m_header, index);
+    uint8_t *data = GetSlotData(slot);
+    uint32_t sequence = slot->sequence.load(std::memory_order_relaxed);
+
+    //Mark the slot as being written before touching it.
+    slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->index = index;
+    slot->info = info;
+    slot->info.width = image.cols;
+    slot->info.height = image.rows;
+    slot->info.stride = static_cast<int32_t>(row);
+    slot->info.type = image.type();
+    if (image.isContinuous()) {
+        memcpy(data, image.ptr(0), row * image.rows);
+    } else {
+        for (int y = 0; y < image.rows; y++) {
+            memcpy(data + y * row, image.ptr(y), row);
+        }
+    }
+
+    slot->sequence.store(sequence + 2, std::memory_order_release);
+    m_header->written.store(index + 1, std::memory_order_release);
+    return true;
+}
+
+/**
+ * Constructor. Attaches to a shared memory ring.
+ * @param [in] name The shared memory object name.
+ * @throws std::invalid_argument if there is no (valid) ring of that name.
+ */
+FrameRingReader::FrameRingReader(const char *name)
+: m_map(MAP_FAILED)
+, m_size(0)
+, m_header(NULL)
+{
+    struct stat st;
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        throw std::invalid_argument("Could not open the frame ring.");
+    } else if (fstat(fd, &st) == -1 ||
+        static_cast<size_t>(st.st_size) < sizeof(FrameRingHeader)) {
+        close(fd);
+        throw std::invalid_argument("Invalid frame ring.");
+    }
+    m_size = st.st_size;
+    m_map = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m_map == MAP_FAILED) {
+        throw std::invalid_argument("Could not map the frame ring.");
+    }
+
+    m_header = static_cast<const FrameRingHeader*>(m_map);
+    uint32_t magic = m_header->magic;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (magic != FRAME_RING_MAGIC ||
+        m_header->version != FRAME_RING_VERSION || m_header->slots == 0 ||
+        m_header->slot_offset + m_header->slot_stride * m_header->slots > m_size) {
+        munmap(m_map, m_size);
+        throw std::invalid_argument("Invalid frame ring.");
+    }
+}
+
+/**
+ * Destructor. Detaches from the ring.
+ */
+FrameRingReader::~FrameRingReader() {
+    munmap(m_map, m_size);
+}
+
+/**
+ * Retrieves the number of frames written so far.
+ * @return The number of frames written.
+ */
+uint64_t FrameRingReader::GetWritten() {
+    return m_header->written.load(std::memory_order_acquire);
+}
+
+/**
+ * Reads the latest frame.
+ * @param [out] image The frame.
+ * @param [out] info The frame description.
+ * @return true iff a frame was read.
+ */
+bool FrameRingReader::ReadLatest(cv::Mat *image, FrameInfo *info) {
+    uint64_t written = GetWritten();
+    return written > 0 && Read(written - 1, image, info);
+}
+
+/**
+ * Reads a frame.
+ * @param [in] index The frame index (0 is the first frame written).
+ * @param [out] image The frame.
+ * @param [out] info The frame description.
+ * @return true iff the frame was read; false if it has not been written yet
+ *         or has already been overwritten.
+ */
+bool FrameRingReader::Read(uint64_t index, cv::Mat *image, FrameInfo *info) {
+    uint64_t written = GetWritten();
+    if (index >= written || index + m_header->slots < written) {
+        return false;
+    }
+
+    FrameRingSlot *slot = GetSlot(m_header, index);
+    const uint8_t *data = GetSlotData(slot);
+    for (int tries = 0; tries < FRAME_RING_READ_TRIES; tries++) {
+        uint32_t sequence = slot->sequence.load(std::memory_order_acquire);
+        if (sequence & 1) {
+            //Being written; give the writer a moment.
+            std::this_thread::yield();
+            continue;
+        }
+
+        uint64_t slot_index = slot->index;
+        *info = slot->info;
+        size_t size = static_cast<size_t>(info->stride) * info->height;
+        bool valid = slot_index == index && info->width > 0 &&
+            info->height > 0 && size <= m_header->capacity;
+        if (valid) {
+            image->create(info->height, info->width, info->type);
+            if (image->cols * image->elemSize() != static_cast<size_t>(info->stride)) {
+                valid = false;
+            } else {
+                for (int y = 0; y < info->height; y++) {
+                    memcpy(image->ptr(y), data + y * info->stride, info->stride);
+                }
+            }
+        }
+
+        //Only keep the copy if the slot did not change while reading it.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->sequence.load(std::memory_order_relaxed) == sequence) {
+            return valid;
+        }
+    }
+    return false;
+}
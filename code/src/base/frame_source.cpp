@@ -0,0 +1,644 @@
+/**
+ * @file frame_source.cpp
+ * @brief Sources of camera frames (camera, video file or image directory).
+ */
+
+#include "common.h"
+#include "frame_source.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/videodev2.h>
+
+using namespace picopter;
+using std::chrono::steady_clock;
+using std::chrono::duration_cast;
+
+/** Frame rate of replayed images, if not given **/
+#define REPLAY_DEFAULT_FPS 30
+/** Longest wait for a V4L2 frame (ms) **/
+#define V4L2_GRAB_TIMEOUT 1000
+/** Buffers kept queued to the driver; frames are copied rather than lent
+    if lending one would leave fewer **/
+#define V4L2_MIN_QUEUED 2
+
+/**
+ * Creates the frame source given by the options (CAMERA_STREAM family):
+ *   SOURCE         A video file or image directory to replay, or a V4L2
+ *                  device (e.g. /dev/video0) to capture from directly; the
+ *                  camera (through OpenCV) if empty (the default).
+ *   SOURCE_DEVICE  The camera device number (default: -1, any camera).
+ *   SOURCE_FPS     The replay frame rate. -1 (the default) replays in real
+ *                  time (at the video's own frame rate, or 30fps for
+ *                  images); 0 replays as fast as frames are processed.
+ *   SOURCE_LOOP    Replay the source repeatedly (default: false).
+ *   SOURCE_FORMAT  The layout frames are processed in: "bgr" (the default),
+ *                  or "yuyv" to keep the camera's native YUV 4:2:2 frames
+ *                  and only convert them to BGR where a stage needs it.
+ *   SOURCE_BUFFERS The number of V4L2 capture buffers (default: 6).
+ * @param [in] opts The options.
+ * @param [in] width The requested frame width.
+ * @param [in] height The requested frame height.
+ * @return The frame source (to be deleted by the caller).
+ * @throws std::invalid_argument if the source cannot be opened.
+ */
+FrameSource* FrameSource::Create(Options *opts, int width, int height) {
+    std::string path = opts->GetString("SOURCE");
+    std::string format_name = opts->GetString("SOURCE_FORMAT", "bgr");
+    FrameFormat format = format_name == "yuyv" ? FRAME_YUYV : FRAME_BGR;
+    struct stat st;
+
+    if (path.empty()) {
+        return new DeviceSource(opts->GetInt("SOURCE_DEVICE", -1),
+            width, height, 30, format);
+    } else if (stat(path.c_str(), &st) == 0 && S_ISCHR(st.st_mode)) {
+        Log(LOG_INFO, "Capturing frames from %s (V4L2)", path.c_str());
+        return new V4L2Source(path, width, height, 30, format,
+            picopter::clamp(opts->GetInt("SOURCE_BUFFERS", 6), 2, 32));
+    }
+    Log(LOG_INFO, "Replaying frames from %s", path.c_str());
+    return new ReplaySource(path, width, height,
+        opts->GetReal("SOURCE_FPS", -1), opts->GetBool("SOURCE_LOOP", false),
+        format);
+}
+
+/**
+ * Retrieves the grabbed frame, lending it in place if the source can (the
+ * image then refers to the source's buffer). The buffer is not reused until
+ * the lease, and every copy of it, is released; the image must not be used
+ * after that. Sources that cannot lend frames decode them as Retrieve does.
+ * @param [out] image The frame, in the source's format.
+ * @param [out] lease Keeps a lent buffer from being reused (empty if the
+ *                    frame was not lent).
+ * @return true iff the frame was retrieved.
+ */
+bool FrameSource::Borrow(cv::Mat *image, FrameLease *lease) {
+    lease->reset();
+    return Retrieve(image);
+}
+
+/**
+ * Retrieves the time at which the grabbed frame was captured, if the source
+ * knows it more accurately than when Grab returned.
+ * @param [out] time The capture time.
+ * @return true iff the capture time is known.
+ */
+bool FrameSource::GetCaptureTime(std::chrono::steady_clock::time_point *time) {
+    return false;
+}
+
+/**
+ * Retrieves the buffer statistics of the source.
+ * @param [out] stats The statistics.
+ * @return true iff the source keeps buffer statistics.
+ */
+bool FrameSource::GetStats(SourceStats *stats) {
+    return false;
+}
+
+/**
+ * Converts a BGR image to packed YUV 4:2:2 (BT.601 video range), as a camera
+ * would deliver it. Each pair of pixels shares their average chroma.
+ * @param [in] bgr The image (CV_8UC3, of an even width).
+ * @param [out] yuyv The converted image (CV_8UC2).
+ */
+void picopter::ConvertToYUYV(const cv::Mat &bgr, cv::Mat *yuyv) {
+    yuyv->create(bgr.rows, bgr.cols, CV_8UC2);
+    for (int y = 0; y < bgr.rows; y++) {
+        const uint8_t *s = bgr.ptr<uint8_t>(y);
+        uint8_t *d = yuyv->ptr<uint8_t>(y);
+        for (int x = 0; x + 1 < bgr.cols; x += 2, s += 6, d += 4) {
+            int b = s[0] + s[3], g = s[1] + s[4], r = s[2] + s[5];
+            d[0] = ((66*s[2] + 129*s[1] + 25*s[0] + 128) >> 8) + 16;
+            d[2] = ((66*s[5] + 129*s[4] + 25*s[3] + 128) >> 8) + 16;
+            d[1] = (-38*r - 74*g + 112*b + (128 << 9) + 256) >> 9;
+            d[3] = (112*r - 94*g - 18*b + (128 << 9) + 256) >> 9;
+        }
+    }
+}
+
+/**
+ * Constructor. Opens a camera.
+ * @param [in] device The device number (-1 for any camera).
+ * @param [in] width The requested frame width.
+ * @param [in] height The requested frame height.
+ * @param [in] fps The requested frame rate.
+ * @param [in] format The requested frame format.
+ * @throws std::invalid_argument if the camera cannot be opened.
+ */
+DeviceSource::DeviceSource(int device, int width, int height, int fps,
+    FrameFormat format)
+: m_capture(device)
+, m_format(FRAME_BGR)
+{
+    if (!m_capture.isOpened()) {
+        Log(LOG_WARNING, "cv::VideoCapture failed.");
+        throw std::invalid_argument("Could not open camera stream.");
+    }
+    m_capture.set(CV_CAP_PROP_FRAME_WIDTH, width);
+    m_capture.set(CV_CAP_PROP_FRAME_HEIGHT, height);
+    m_capture.set(CV_CAP_PROP_FPS, fps);
+
+    if (format == FRAME_YUYV) {
+        //Not every capture backend can skip the conversion; check.
+        cv::Mat probe;
+        m_capture.set(CV_CAP_PROP_CONVERT_RGB, 0);
+        m_format = FRAME_YUYV;
+        if (!Grab() || !Retrieve(&probe)) {
+            Log(LOG_WARNING, "Camera does not provide YUYV frames; using BGR.");
+            m_capture.set(CV_CAP_PROP_CONVERT_RGB, 1);
+            m_format = FRAME_BGR;
+        }
+    }
+}
+
+bool DeviceSource::Grab() {
+    return m_capture.grab();
+}
+
+bool DeviceSource::Retrieve(cv::Mat *image) {
+    if (!m_capture.retrieve(*image) || image->empty()) {
+        return false;
+    } else if (m_format == FRAME_YUYV) {
+        //Raw frames may be returned as a single channel of bytes.
+        cv::Size size = GetSize();
+        if (image->type() == CV_8UC1 && image->isContinuous() &&
+            image->total() == 2 * static_cast<size_t>(size.area()))
+        {
+            *image = image->reshape(2, size.height);
+        }
+        return image->type() == CV_8UC2;
+    }
+    return true;
+}
+
+FrameFormat DeviceSource::GetFormat() {
+    return m_format;
+}
+
+cv::Size DeviceSource::GetSize() {
+    return cv::Size(m_capture.get(CV_CAP_PROP_FRAME_WIDTH),
+        m_capture.get(CV_CAP_PROP_FRAME_HEIGHT));
+}
+
+bool DeviceSource::IsRealTime() {
+    return true;
+}
+
+/**
+ * Constructor. Opens a recording to replay.
+ * @param [in] path A video file, or a directory of images (replayed in name
+ *                  order).
+ * @param [in] width The frame width to replay at (0 for the recorded width).
+ *                   The aspect ratio of the recording is kept.
+ * @param [in] height Unused; the height follows from the width.
+ * @param [in] fps The rate to replay at; 0 for as fast as possible, or
+ *                 negative for the recorded rate.
+ * @param [in] loop Replay the recording repeatedly.
+ * @param [in] format The format to deliver frames in.
+ * @throws std::invalid_argument if the recording cannot be opened or is empty.
+ */
+ReplaySource::ReplaySource(const std::string &path, int width, int height,
+    double fps, bool loop, FrameFormat format)
+: m_next(0)
+, m_format(format)
+, m_interval(steady_clock::duration::zero())
+, m_loop(loop)
+{
+    struct stat st;
+    cv::Mat first;
+
+    if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        static const char *extensions[] = {".jpg", ".jpeg", ".png", ".bmp"};
+        DIR *dir = opendir(path.c_str());
+        struct dirent *entry;
+
+        while (dir && (entry = readdir(dir)) != NULL) {
+            std::string name(entry->d_name);
+            std::string lower(name);
+            std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+            for (const char *ext : extensions) {
+                size_t len = strlen(ext);
+                if (lower.size() > len &&
+                    lower.compare(lower.size() - len, len, ext) == 0) {
+                    m_files.push_back(path + "/" + name);
+                    break;
+                }
+            }
+        }
+        if (dir) {
+            closedir(dir);
+        }
+        std::sort(m_files.begin(), m_files.end());
+        if (m_files.empty() || (first = cv::imread(m_files[0], 1)).empty()) {
+            throw std::invalid_argument("No images to replay.");
+        }
+        if (fps < 0) {
+            fps = REPLAY_DEFAULT_FPS;
+        }
+    } else {
+        if (!m_video.open(path)) {
+            throw std::invalid_argument("Could not open the video to replay.");
+        }
+        first = cv::Mat(m_video.get(CV_CAP_PROP_FRAME_HEIGHT),
+            m_video.get(CV_CAP_PROP_FRAME_WIDTH), CV_8UC3);
+        if (fps < 0) {
+            fps = m_video.get(CV_CAP_PROP_FPS);
+            if (!(fps > 0)) {
+                fps = REPLAY_DEFAULT_FPS;
+            }
+        }
+    }
+
+    if (first.cols <= 0 || first.rows <= 0) {
+        throw std::invalid_argument("Invalid replay frame size.");
+    } else if (width > 0) {
+        m_size = cv::Size(width, (first.rows * width) / first.cols);
+    } else {
+        m_size = first.size();
+    }
+    if (m_format == FRAME_YUYV) {
+        //Pixels are converted in pairs.
+        m_size.width &= ~1;
+    }
+    if (fps > 0) {
+        m_interval = duration_cast<steady_clock::duration>(
+            std::chrono::duration<double>(1.0 / fps));
+    }
+    m_due = steady_clock::now();
+}
+
+/**
+ * Moves on to the next frame of the recording.
+ * @return true iff there is a next frame.
+ */
+bool ReplaySource::ReadNext() {
+    if (m_files.size() > 0) {
+        if (m_next >= m_files.size()) {
+            if (!m_loop) {
+                return false;
+            }
+            m_next = 0;
+        }
+        m_next++;
+        return true;
+    } else if (m_video.grab()) {
+        return true;
+    } else if (m_loop) {
+        m_video.set(CV_CAP_PROP_POS_FRAMES, 0);
+        return m_video.grab();
+    }
+    return false;
+}
+
+bool ReplaySource::Grab() {
+    if (m_interval > steady_clock::duration::zero()) {
+        auto now = steady_clock::now();
+        if (m_due > now) {
+            std::this_thread::sleep_until(m_due);
+            m_due += m_interval;
+        } else {
+            //Fell behind (or just started); don't try to catch up.
+            m_due = now + m_interval;
+        }
+    }
+    return ReadNext();
+}
+
+bool ReplaySource::Retrieve(cv::Mat *image) {
+    if (m_files.size() > 0) {
+        m_frame = cv::imread(m_files[m_next - 1], 1);
+    } else {
+        m_video.retrieve(m_frame);
+    }
+
+    if (m_frame.empty()) {
+        return false;
+    } else if (m_format == FRAME_YUYV) {
+        if (m_frame.size() != m_size) {
+            cv::resize(m_frame, m_resized, m_size);
+            ConvertToYUYV(m_resized, image);
+        } else {
+            ConvertToYUYV(m_frame, image);
+        }
+    } else if (m_frame.size() != m_size) {
+        cv::resize(m_frame, *image, m_size);
+    } else {
+        //The caller's old frame becomes the next decode buffer.
+        std::swap(*image, m_frame);
+    }
+    return true;
+}
+
+FrameFormat ReplaySource::GetFormat() {
+    return m_format;
+}
+
+cv::Size ReplaySource::GetSize() {
+    return m_size;
+}
+
+bool ReplaySource::IsRealTime() {
+    return m_interval > steady_clock::duration::zero();
+}
+
+/**
+ * Performs an ioctl, retrying if it is interrupted.
+ * @param [in] fd The device.
+ * @param [in] request The request.
+ * @param [in,out] arg The request argument.
+ * @return The ioctl result.
+ */
+static int xioctl(int fd, unsigned long request, void *arg) {
+    int ret;
+    do {
+        ret = ioctl(fd, request, arg);
+    } while (ret == -1 && errno == EINTR);
+    return ret;
+}
+
+/**
+ * A V4L2 device and its mapped buffers. It is shared by the source and the
+ * leases of the buffers it has lent, so it stays open (and streaming) until
+ * the last lent buffer has been returned.
+ */
+struct V4L2Source::Device {
+    /** A mapped capture buffer **/
+    typedef struct Buffer {
+        void *start;
+        size_t length;
+    } Buffer;
+
+    /** The device file descriptor **/
+    int fd;
+    /** The mapped buffers **/
+    std::vector<Buffer> buffers;
+    /** The number of buffers lent to the pipeline **/
+    std::atomic<int> lent;
+    /** Streaming has been started **/
+    bool streaming;
+
+    Device() : fd(-1), lent{0}, streaming(false) {}
+
+    ~Device() {
+        if (streaming) {
+            int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            xioctl(fd, VIDIOC_STREAMOFF, &type);
+        }
+        for (Buffer &buffer : buffers) {
+            munmap(buffer.start, buffer.length);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    /**
+     * Queues a buffer to the driver, to be captured into.
+     * @param [in] index The buffer.
+     * @return true iff the buffer was queued.
+     */
+    bool Queue(int index) {
+        struct v4l2_buffer buf = {0};
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = index;
+        return xioctl(fd, VIDIOC_QBUF, &buf) == 0;
+    }
+};
+
+/**
+ * Constructor. Opens a V4L2 device and starts capturing. The device always
+ * captures YUYV, which is converted if BGR frames are requested.
+ * @param [in] device The device (e.g. /dev/video0).
+ * @param [in] width The requested frame width.
+ * @param [in] height The requested frame height.
+ * @param [in] fps The requested frame rate.
+ * @param [in] format The format to deliver frames in.
+ * @param [in] buffers The number of capture buffers to request.
+ * @throws std::invalid_argument if the device cannot capture YUYV frames by
+ *         streaming I/O.
+ */
+V4L2Source::V4L2Source(const std::string &device, int width, int height,
+    int fps, FrameFormat format, int buffers)
+: m_device(std::make_shared<Device>())
+, m_format(format)
+, m_stride(0)
+, m_current{-1}
+, m_has_time(false)
+, m_sequence(0)
+, m_frames{0}
+, m_dropped{0}
+, m_copied{0}
+{
+    struct v4l2_capability cap = {0};
+    struct v4l2_format fmt = {0};
+    struct v4l2_streamparm parm = {0};
+    struct v4l2_requestbuffers req = {0};
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int fd;
+
+    fd = m_device->fd = open(device.c_str(), O_RDWR | O_NONBLOCK);
+    if (fd == -1) {
+        throw std::invalid_argument("Could not open the V4L2 device.");
+    } else if (xioctl(fd, VIDIOC_QUERYCAP, &cap) == -1) {
+        throw std::invalid_argument("Not a V4L2 device.");
+    }
+    uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ?
+        cap.device_caps : cap.capabilities;
+    if (!(caps & V4L2_CAP_VIDEO_CAPTURE) || !(caps & V4L2_CAP_STREAMING)) {
+        throw std::invalid_argument("The V4L2 device cannot stream frames.");
+    }
+
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (xioctl(fd, VIDIOC_S_FMT, &fmt) == -1 ||
+        fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV)
+    {
+        throw std::invalid_argument("The V4L2 device cannot capture YUYV.");
+    }
+    //The driver picks the closest size it supports.
+    m_size = cv::Size(fmt.fmt.pix.width, fmt.fmt.pix.height);
+    m_stride = std::max(static_cast<size_t>(fmt.fmt.pix.bytesperline),
+        static_cast<size_t>(m_size.width) * 2);
+
+    //Not every driver can set the frame rate.
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe.numerator = 1;
+    parm.parm.capture.timeperframe.denominator = fps;
+    if (fps > 0) {
+        xioctl(fd, VIDIOC_S_PARM, &parm);
+    }
+
+    req.count = buffers;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(fd, VIDIOC_REQBUFS, &req) == -1 || req.count < 2) {
+        throw std::invalid_argument("Could not allocate V4L2 buffers.");
+    }
+    for (uint32_t i = 0; i < req.count; i++) {
+        struct v4l2_buffer buf = {0};
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (xioctl(fd, VIDIOC_QUERYBUF, &buf) == -1) {
+            throw std::invalid_argument("Could not query a V4L2 buffer.");
+        }
+        void *start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, buf.m.offset);
+        if (start == MAP_FAILED) {
+            throw std::invalid_argument("Could not map a V4L2 buffer.");
+        } else if (buf.length < m_stride * m_size.height) {
+            munmap(start, buf.length);
+            throw std::invalid_argument("V4L2 buffer too small.");
+        }
+        m_device->buffers.push_back({start, buf.length});
+    }
+    for (size_t i = 0; i < m_device->buffers.size(); i++) {
+        if (!m_device->Queue(i)) {
+            throw std::invalid_argument("Could not queue a V4L2 buffer.");
+        }
+    }
+    if (xioctl(fd, VIDIOC_STREAMON, &type) == -1) {
+        throw std::invalid_argument("Could not start V4L2 streaming.");
+    }
+    m_device->streaming = true;
+    Log(LOG_INFO, "V4L2: %dx%d YUYV, %zu buffers", m_size.width,
+        m_size.height, m_device->buffers.size());
+}
+
+/**
+ * Destructor. The device is closed once every lent buffer is returned.
+ */
+V4L2Source::~V4L2Source() {
+    Requeue();
+}
+
+/**
+ * Queues the grabbed buffer back to the driver, if it was not retrieved.
+ */
+void V4L2Source::Requeue() {
+    int current = m_current.exchange(-1);
+    if (current >= 0) {
+        m_device->Queue(current);
+    }
+}
+
+bool V4L2Source::Grab() {
+    struct pollfd pfd = {m_device->fd, POLLIN, 0};
+    struct v4l2_buffer buf = {0};
+
+    Requeue();
+    if (poll(&pfd, 1, V4L2_GRAB_TIMEOUT) <= 0) {
+        return false;
+    }
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(m_device->fd, VIDIOC_DQBUF, &buf) == -1) {
+        return false;
+    } else if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+        m_device->Queue(buf.index);
+        return false;
+    }
+
+    //Gaps in the sequence are frames the driver had no buffer for.
+    if (m_frames > 0 && buf.sequence > m_sequence + 1) {
+        m_dropped += buf.sequence - m_sequence - 1;
+    }
+    m_sequence = buf.sequence;
+    m_frames++;
+    m_current = buf.index;
+
+    m_has_time = (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+        V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    if (m_has_time) {
+        //The steady clock is the monotonic clock.
+        m_capture_time = steady_clock::time_point(
+            duration_cast<steady_clock::duration>(
+                std::chrono::seconds(buf.timestamp.tv_sec) +
+                std::chrono::microseconds(buf.timestamp.tv_usec)));
+    }
+    return true;
+}
+
+bool V4L2Source::Retrieve(cv::Mat *image) {
+    int current = m_current;
+    if (current < 0) {
+        return false;
+    }
+
+    cv::Mat frame(m_size.height, m_size.width, CV_8UC2,
+        m_device->buffers[current].start, m_stride);
+    if (m_format == FRAME_YUYV) {
+        frame.copyTo(*image);
+        m_copied++;
+    } else {
+        cv::cvtColor(frame, *image, CV_YUV2BGR_YUYV);
+    }
+    Requeue();
+    return true;
+}
+
+bool V4L2Source::Borrow(cv::Mat *image, FrameLease *lease) {
+    int current = m_current;
+    int buffers = static_cast<int>(m_device->buffers.size());
+
+    //Keep enough buffers queued for the driver to keep capturing.
+    if (current < 0 || m_format != FRAME_YUYV ||
+        buffers - m_device->lent - 1 < V4L2_MIN_QUEUED)
+    {
+        lease->reset();
+        return Retrieve(image);
+    }
+
+    std::shared_ptr<Device> device = m_device;
+    void *start = device->buffers[current].start;
+    *image = cv::Mat(m_size.height, m_size.width, CV_8UC2, start, m_stride);
+    device->lent++;
+    *lease = FrameLease(start, [device, current] (const void*) {
+        device->lent--;
+        device->Queue(current);
+    });
+    m_current = -1;
+    return true;
+}
+
+bool V4L2Source::GetCaptureTime(steady_clock::time_point *time) {
+    if (m_has_time) {
+        *time = m_capture_time;
+    }
+    return m_has_time;
+}
+
+bool V4L2Source::GetStats(SourceStats *stats) {
+    int lent = m_device->lent;
+    stats->frames = m_frames;
+    stats->dropped = m_dropped;
+    stats->copied = m_copied;
+    stats->lent = lent;
+    stats->queued = static_cast<int>(m_device->buffers.size()) - lent -
+        (m_current >= 0 ? 1 : 0);
+    return true;
+}
+
+FrameFormat V4L2Source::GetFormat() {
+    return m_format;
+}
+
+cv::Size V4L2Source::GetSize() {
+    return m_size;
+}
+
+bool V4L2Source::IsRealTime() {
+    return true;
+}
@@ -0,0 +1,248 @@
+/**
+ * @file glyph_library.cpp
+ * @brief Bit-packed glyph matching.
+ */
+
+#include "common.h"
+#include "glyph_library.h"
+#include <algorithm>
+
+using namespace picopter;
+
+/**
+ * Determines if a cell of a glyph is set.
+ * @param [in] bits The glyph.
+ * @param [in] x The column.
+ * @param [in] y The row.
+ * @return true iff the cell is set.
+ */
+static inline bool GetCell(const GlyphBits &bits, int x, int y) {
+    int i = y * GlyphBits::GRID + x;
+    return (bits.words[i / 64] >> (i % 64)) & 1;
+}
+
+/**
+ * Sets a cell of a glyph.
+ * @param [in,out] bits The glyph.
+ * @param [in] x The column.
+ * @param [in] y The row.
+ */
+static inline void SetCell(GlyphBits *bits, int x, int y) {
+    int i = y * GlyphBits::GRID + x;
+    bits->words[i / 64] |= UINT64_C(1) << (i % 64);
+}
+
+/**
+ * Constructor. Creates an empty library.
+ */
+GlyphLibrary::GlyphLibrary()
+: m_glyphs(0)
+{
+}
+
+/**
+ * Reduces a binary image to a packed grid.
+ * @param [in] mask The image (CV_8UC1; non-zero = set). It is resized to
+ *                  the grid size if it is not already that size.
+ * @param [out] bits The packed grid. A cell is set if at least half of the
+ *                   pixels it covers are set.
+ */
+void GlyphLibrary::Pack(const cv::Mat &mask, GlyphBits *bits) {
+    cv::Mat grid;
+
+    if (mask.cols == GlyphBits::GRID && mask.rows == GlyphBits::GRID) {
+        grid = mask;
+    } else {
+        cv::resize(mask, grid, cv::Size(GlyphBits::GRID, GlyphBits::GRID),
+            0, 0, cv::INTER_AREA);
+    }
+
+    memset(bits, 0, sizeof(GlyphBits));
+    for (int y = 0; y < GlyphBits::GRID; y++) {
+        const uint8_t *row = grid.ptr<uint8_t>(y);
+        for (int x = 0; x < GlyphBits::GRID; x++) {
+            if (row[x] >= 128) {
+                SetCell(bits, x, y);
+            }
+        }
+    }
+}
+
+/**
+ * Rotates a glyph by 90 degrees clockwise.
+ * @param [in] bits The glyph.
+ * @param [out] rotated The rotated glyph.
+ */
+void GlyphLibrary::Rotate(const GlyphBits &bits, GlyphBits *rotated) {
+    memset(rotated, 0, sizeof(GlyphBits));
+    for (int y = 0; y < GlyphBits::GRID; y++) {
+        for (int x = 0; x < GlyphBits::GRID; x++) {
+            if (GetCell(bits, x, y)) {
+                SetCell(rotated, GlyphBits::GRID - 1 - y, x);
+            }
+        }
+    }
+}
+
+/**
+ * Computes the Hamming distance between two glyphs.
+ * @param [in] a The first glyph.
+ * @param [in] b The second glyph.
+ * @return The number of cells that differ.
+ */
+int GlyphLibrary::Distance(const GlyphBits &a, const GlyphBits &b) {
+    int distance = 0;
+    for (int i = 0; i < GlyphBits::WORDS; i++) {
+        distance += __builtin_popcountll(a.words[i] ^ b.words[i]);
+    }
+    return distance;
+}
+
+/**
+ * Fills in the match entry of a glyph rotation.
+ * @param [in] index The glyph index.
+ * @param [in] rotation The number of clockwise turns.
+ * @param [in] bits The rotated glyph.
+ * @param [out] entry The entry.
+ */
+void GlyphLibrary::MakeEntry(int index, int rotation, const GlyphBits &bits, Entry *entry) {
+    const int blocks_per_row = GlyphBits::GRID / GlyphBits::BLOCK;
+
+    entry->index = index;
+    entry->rotation = rotation;
+    entry->bits = bits;
+    entry->count = 0;
+    memset(entry->signature, 0, sizeof(entry->signature));
+    for (int y = 0; y < GlyphBits::GRID; y++) {
+        for (int x = 0; x < GlyphBits::GRID; x++) {
+            if (GetCell(bits, x, y)) {
+                entry->signature[(y / GlyphBits::BLOCK) * blocks_per_row +
+                    x / GlyphBits::BLOCK]++;
+                entry->count++;
+            }
+        }
+    }
+}
+
+/**
+ * Removes all glyphs.
+ */
+void GlyphLibrary::Clear() {
+    m_entries.clear();
+    m_glyphs = 0;
+}
+
+/**
+ * Adds a glyph to the library.
+ * @param [in] index The index to return when the glyph is matched.
+ * @param [in] mask The binary glyph image (see Pack).
+ */
+void GlyphLibrary::Add(int index, const cv::Mat &mask) {
+    GlyphBits bits;
+    Pack(mask, &bits);
+    Add(index, bits);
+}
+
+/**
+ * Adds a glyph to the library.
+ * @param [in] index The index to return when the glyph is matched.
+ * @param [in] bits The packed glyph.
+ */
+void GlyphLibrary::Add(int index, const GlyphBits &bits) {
+    GlyphBits rotated = bits;
+
+    for (int rotation = 0; rotation < 4; rotation++) {
+        Entry entry;
+        MakeEntry(index, rotation, rotated, &entry);
+        m_entries.insert(std::upper_bound(m_entries.begin(), m_entries.end(),
+            entry, [] (const Entry &a, const Entry &b) {
+                return a.count < b.count;
+            }), entry);
+
+        GlyphBits next;
+        Rotate(rotated, &next);
+        rotated = next;
+    }
+    m_glyphs++;
+}
+
+/**
+ * Matches a binary image against the library.
+ * @param [in] mask The binary image (see Pack).
+ * @param [in] max_distance The largest Hamming distance that is a match.
+ * @param [out] rotation If not NULL, the number of clockwise turns of the
+ *                       matched glyph that gives the image.
+ * @param [out] distance If not NULL, the Hamming distance of the match.
+ * @return The index of the closest glyph, or -1 if none is close enough.
+ */
+int GlyphLibrary::Match(const cv::Mat &mask, int max_distance,
+    int *rotation, int *distance) const
+{
+    GlyphBits bits;
+    Pack(mask, &bits);
+    return Match(bits, max_distance, rotation, distance);
+}
+
+/**
+ * Matches a packed glyph against the library.
+ * @param [in] bits The packed glyph.
+ * @param [in] max_distance The largest Hamming distance that is a match.
+ * @param [out] rotation See above.
+ * @param [out] distance See above.
+ * @return See above.
+ */
+int GlyphLibrary::Match(const GlyphBits &bits, int max_distance,
+    int *rotation, int *distance) const
+{
+    Entry query;
+    int best = -1, best_distance = max_distance + 1;
+
+    MakeEntry(-1, 0, bits, &query);
+
+    //Glyphs whose set cell counts differ by more than the distance can't match.
+    auto compare = [] (const Entry &a, const Entry &b) {
+        return a.count < b.count;
+    };
+    Entry lo = query, hi = query;
+    lo.count -= max_distance;
+    hi.count += max_distance;
+    auto end = std::upper_bound(m_entries.begin(), m_entries.end(), hi, compare);
+
+    for (auto it = std::lower_bound(m_entries.begin(), m_entries.end(), lo, compare);
+         it != end; ++it)
+    {
+        //Coarse check: per-block count differences also bound the distance.
+        int bound = 0;
+        for (int i = 0; i < GlyphBits::BLOCKS && bound < best_distance; i++) {
+            bound += std::abs(it->signature[i] - query.signature[i]);
+        }
+        if (bound >= best_distance) {
+            continue;
+        }
+
+        int d = Distance(it->bits, bits);
+        if (d < best_distance) {
+            best_distance = d;
+            best = static_cast<int>(it - m_entries.begin());
+        }
+    }
+
+    if (best < 0) {
+        return -1;
+    }
+    if (rotation) {
+        *rotation = m_entries[best].rotation;
+    }
+    if (distance) {
+        *distance = best_distance;
+    }
+    return m_entries[best].index;
+}
+
+/**
+ * Retrieves the number of glyphs in the library.
+ * @return The number of glyphs.
+ */
+size_t GlyphLibrary::Size() const {
+    return m_glyphs;
+}
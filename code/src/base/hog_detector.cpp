@@ -0,0 +1,131 @@
+/**
+ * @file hog_detector.cpp
+ * @brief Multi-scale HOG (people) detection over the thread pool.
+ */
+
+#include "common.h"
+#include "hog_detector.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace picopter;
+
+/** Most pyramid levels searched in one call **/
+#define HOG_MAX_LEVELS 64
+/** Minimum number of overlapping hits to report a detection **/
+#define HOG_GROUP_THRESHOLD 2
+/** Relative difference for hits to be grouped together **/
+#define HOG_GROUP_EPS 0.2
+
+/**
+ * Constructor.
+ * @param [in] parallel The parallel-for to search the pyramid levels on.
+ */
+HOGDetector::HOGDetector(ParallelFor *parallel)
+: m_parallel(parallel)
+, m_min_scale(1)
+, m_max_scale(8)
+, m_scale_step(1.05)
+, m_stride(8, 8)
+{
+    m_hog.setSVMDetector(cv::HOGDescriptor::getDefaultPeopleDetector());
+}
+
+/**
+ * Sets the range of scales that are searched.
+ * @param [in] min_scale The smallest scale (1 = people the size of the
+ *                       detection window; at least 1).
+ * @param [in] max_scale The largest scale.
+ * @param [in] step The ratio between successive scales (> 1).
+ */
+void HOGDetector::SetScales(double min_scale, double max_scale, double step) {
+    m_min_scale = std::max(min_scale, 1.0);
+    m_max_scale = std::max(max_scale, m_min_scale);
+    m_scale_step = std::max(step, 1.01);
+}
+
+/**
+ * Sets the detection window stride. This is rounded to the block stride.
+ * @param [in] stride The stride, in pixels.
+ */
+void HOGDetector::SetStride(int stride) {
+    int block = m_hog.blockStride.width;
+    stride = std::max(((stride + block / 2) / block) * block, block);
+    m_stride = cv::Size(stride, stride);
+}
+
+/**
+ * Retrieves the detection window size (the smallest person detected).
+ * @return The window size.
+ */
+cv::Size HOGDetector::GetWindowSize() const {
+    return m_hog.winSize;
+}
+
+/**
+ * Retrieves the ratio between successive scales.
+ * @return The scale step.
+ */
+double HOGDetector::GetScaleStep() const {
+    return m_scale_step;
+}
+
+/**
+ * Detects people in an image.
+ * @param [in] grey The greyscale image.
+ * @param [out] found The bounds of each person found.
+ * @param [in] min_scale If non-zero, limits the smallest scale searched.
+ * @param [in] max_scale If non-zero, limits the largest scale searched.
+ */
+void HOGDetector::Detect(const cv::Mat &grey, std::vector<cv::Rect> *found,
+    double min_scale, double max_scale)
+{
+    cv::Size win = m_hog.winSize;
+    double lo = std::max(m_min_scale, min_scale);
+    double hi = max_scale > 0 ? std::min(m_max_scale, max_scale) : m_max_scale;
+
+    found->clear();
+    m_scales.clear();
+    for (double scale = m_min_scale; scale <= hi &&
+        m_scales.size() < HOG_MAX_LEVELS; scale *= m_scale_step)
+    {
+        //Same rounding as the level size, as in detectMultiScale.
+        if (cvRound(grey.cols / scale) < win.width ||
+            cvRound(grey.rows / scale) < win.height)
+        {
+            break;
+        } else if (scale >= lo) {
+            m_scales.push_back(scale);
+        }
+    }
+
+    int levels = static_cast<int>(m_scales.size());
+    if (static_cast<int>(m_levels.size()) < levels) {
+        m_levels.resize(levels);
+        m_hits.resize(levels);
+        m_weights.resize(levels);
+    }
+
+    m_parallel->Run(levels, [&] (int i) {
+        double scale = m_scales[i];
+        cv::Size size(cvRound(grey.cols / scale), cvRound(grey.rows / scale));
+        const cv::Mat *level = &grey;
+
+        if (size != grey.size()) {
+            //Same size as the last frame's level, so the buffer is reused.
+            cv::resize(grey, m_levels[i], size, 0, 0, cv::INTER_LINEAR);
+            level = &m_levels[i];
+        }
+        m_hog.detect(*level, m_hits[i], m_weights[i], 0, m_stride, cv::Size());
+    });
+
+    for (int i = 0; i < levels; i++) {
+        double scale = m_scales[i];
+        cv::Size size(cvRound(win.width * scale), cvRound(win.height * scale));
+        for (const cv::Point &hit : m_hits[i]) {
+            found->push_back(cv::Rect(cvRound(hit.x * scale),
+                cvRound(hit.y * scale), size.width, size.height));
+        }
+    }
+    cv::groupRectangles(*found, HOG_GROUP_THRESHOLD, HOG_GROUP_EPS);
+}
@@ -0,0 +1,102 @@
+/**
+ * @file latency_histogram.cpp
+ * @brief Fixed-bucket latency histogram.
+ */
+
+#include "common.h"
+#include "latency_histogram.h"
+#include <algorithm>
+
+using namespace picopter;
+
+const int64_t LatencyHistogram::BOUNDS[BUCKETS - 1] = {
+    100, 250, 500, 1000, 2000, 5000, 10000, 20000, 35000, 50000,
+    75000, 100000, 200000, 500000, 1000000
+};
+
+/**
+ * Constructor. Creates an empty histogram.
+ */
+LatencyHistogram::LatencyHistogram() {
+    Reset();
+}
+
+/**
+ * Records a latency.
+ * @param [in] latency The latency.
+ */
+void LatencyHistogram::Record(std::chrono::steady_clock::duration latency) {
+    Record(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+}
+
+/**
+ * Records a latency.
+ * @param [in] us The latency (us). Negative values are counted as zero.
+ */
+void LatencyHistogram::Record(int64_t us) {
+    us = std::max(us, static_cast<int64_t>(0));
+    int bucket = std::lower_bound(BOUNDS, BOUNDS + BUCKETS - 1, us) - BOUNDS;
+
+    m_counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_total.fetch_add(static_cast<uint64_t>(us), std::memory_order_relaxed);
+    int64_t max = m_max.load(std::memory_order_relaxed);
+    while (us > max && !m_max.compare_exchange_weak(max, us,
+        std::memory_order_relaxed));
+}
+
+/**
+ * Retrieves the bucket counts.
+ * @param [out] counts The count of each bucket (BUCKETS values).
+ */
+void LatencyHistogram::GetCounts(uint64_t *counts) {
+    for (int i = 0; i < BUCKETS; i++) {
+        counts[i] = m_counts[i].load(std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Summarises the recorded latencies.
+ * @param [out] summary The count, mean, maximum and percentiles (ms).
+ */
+void LatencyHistogram::GetSummary(LatencySummary *summary) {
+    uint64_t counts[BUCKETS];
+    uint64_t count = 0;
+    double max = m_max.load(std::memory_order_relaxed);
+
+    GetCounts(counts);
+    for (int i = 0; i < BUCKETS; i++) {
+        count += counts[i];
+    }
+
+    summary->count = count;
+    summary->mean = count ? m_total.load(std::memory_order_relaxed) / (count * 1000.0) : 0;
+    summary->max = max / 1000.0;
+
+    double *percentiles[] = {&summary->p50, &summary->p95, &summary->p99};
+    const double fractions[] = {0.50, 0.95, 0.99};
+    for (int p = 0; p < 3; p++) {
+        double rank = fractions[p] * count, seen = 0;
+        *percentiles[p] = 0;
+        for (int i = 0; i < BUCKETS && count; i++) {
+            if (counts[i] > 0 && seen + counts[i] >= rank) {
+                double lower = i > 0 ? BOUNDS[i - 1] : 0;
+                double upper = i < BUCKETS - 1 ? std::min<double>(BOUNDS[i], max) : max;
+                double value = lower + (upper - lower) * (rank - seen) / counts[i];
+                *percentiles[p] = std::min(value, max) / 1000.0;
+                break;
+            }
+            seen += counts[i];
+        }
+    }
+}
+
+/**
+ * Clears the histogram.
+ */
+void LatencyHistogram::Reset() {
+    for (int i = 0; i < BUCKETS; i++) {
+        m_counts[i] = 0;
+    }
+    m_total = 0;
+    m_max = 0;
+}
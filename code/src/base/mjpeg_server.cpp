@@ -0,0 +1,338 @@
+/**
+ * @file mjpeg_server.cpp
+ * @brief Serves JPEG frames as an MJPEG (multipart) HTTP stream.
+ */
+
+#include "common.h"
+#include "mjpeg_server.h"
+
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace picopter;
+
+/** The multipart boundary between frames **/
+#define MJPEG_BOUNDARY "picopterframe"
+/** How long a client may take to accept data before it is dropped (s) **/
+#define MJPEG_SEND_TIMEOUT 5
+/** How long a snapshot waits for a fresh frame (ms) **/
+#define MJPEG_SNAPSHOT_TIMEOUT 2000
+/** How often the accept thread checks for shutdown, and streaming clients
+    for hangup while there are no new frames (ms) **/
+#define MJPEG_POLL_INTERVAL 250
+/** Most clients served at once; any more are turned away **/
+#define MJPEG_MAX_CLIENTS 8
+
+static const char stream_header[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Connection: close\r\n"
+    "Cache-Control: no-store, no-cache, must-revalidate, max-age=0\r\n"
+    "Pragma: no-cache\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "Content-Type: multipart/x-mixed-replace;boundary=" MJPEG_BOUNDARY "\r\n"
+    "\r\n";
+
+static const char not_available[] =
+    "HTTP/1.0 503 Service Unavailable\r\n"
+    "Connection: close\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+/**
+ * Constructor. Starts listening for clients.
+ * @param [in] port The TCP port to listen on.
+ * @throws std::invalid_argument if the port cannot be listened on.
+ */
+MjpegServer::MjpegServer(uint16_t port)
+: m_fd(-1)
+, m_port(port)
+, m_stop{false}
+, m_client_count{0}
+, m_sequence(0)
+, m_waiting(0)
+{
+    struct sockaddr_in addr = {0};
+    int reuse = 1;
+
+    m_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m_fd == -1) {
+        throw std::invalid_argument("Could not create socket.");
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(m_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(m_fd, 8) == -1) {
+        close(m_fd);
+        throw std::invalid_argument("Could not listen on the stream port.");
+    }
+
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(m_fd, (struct sockaddr *)&addr, &addr_len) == 0) {
+        m_port = ntohs(addr.sin_port);
+    }
+
+    m_accept_thread = std::async(std::launch::async,
+        &MjpegServer::AcceptClients, this);
+}
+
+/**
+ * Destructor. Disconnects all clients and stops the server.
+ */
+MjpegServer::~MjpegServer() {
+    m_stop = true;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_frame_cv.notify_all();
+    }
+    m_accept_thread.wait();
+    close(m_fd);
+}
+
+/**
+ * Determines if a new frame would be sent to anyone. The caller should only
+ * encode (and publish) a frame if so.
+ * @return true iff a client is waiting for a frame.
+ */
+bool MjpegServer::WantsFrame() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_waiting > 0;
+}
+
+/**
+ * Publishes a frame. Every client that is waiting will send it; clients that
+ * are still sending an older frame will skip it.
+ * @param [in] jpeg The encoded frame.
+ */
+void MjpegServer::Publish(JpegBuffer jpeg) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_latest = std::move(jpeg);
+    m_sequence++;
+    m_frame_cv.notify_all();
+}
+
+/**
+ * Retrieves the number of connected clients.
+ * @return The number of clients.
+ */
+int MjpegServer::GetClients() {
+    return m_client_count;
+}
+
+/**
+ * Retrieves the port that the server is listening on.
+ * @return The port.
+ */
+uint16_t MjpegServer::GetPort() {
+    return m_port;
+}
+
+/**
+ * Accept thread. Accepts clients and reaps the ones that have finished.
+ */
+void MjpegServer::AcceptClients() {
+    struct pollfd pfd = {m_fd, POLLIN, 0};
+    struct timeval timeout = {MJPEG_SEND_TIMEOUT, 0};
+
+    while (!m_stop) {
+        for (auto it = m_clients.begin(); it != m_clients.end();) {
+            if (it->done) {
+                it->thread.wait();
+                close(it->fd);
+                it = m_clients.erase(it);
+                m_client_count--;
+            } else {
+                ++it;
+            }
+        }
+
+        if (poll(&pfd, 1, MJPEG_POLL_INTERVAL) <= 0) {
+            continue;
+        }
+
+        int fd = accept(m_fd, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (m_client_count >= MJPEG_MAX_CLIENTS) {
+            SendAll(fd, not_available, sizeof(not_available) - 1);
+            close(fd);
+            continue;
+        }
+
+        m_clients.emplace_back();
+        Client *client = &m_clients.back();
+        client->fd = fd;
+        client->done = false;
+        client->thread = std::async(std::launch::async,
+            &MjpegServer::ServeClient, this, client);
+        m_client_count++;
+    }
+
+    //Disconnect everyone.
+    for (Client &client : m_clients) {
+        shutdown(client.fd, SHUT_RDWR);
+    }
+    for (Client &client : m_clients) {
+        client.thread.wait();
+        close(client.fd);
+    }
+    m_clients.clear();
+    m_client_count = 0;
+}
+
+/**
+ * Waits for a frame newer than the given one.
+ * @param [in,out] sequence The sequence number of the last frame sent; updated
+ *                          to that of the returned frame.
+ * @param [in] timeout_ms The longest time to wait (-1 for no limit).
+ * @return The frame, or an empty pointer on timeout or shutdown.
+ */
+JpegBuffer MjpegServer::WaitFrame(uint64_t *sequence, int timeout_ms) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto fresh = [&] { return m_stop || m_sequence > *sequence; };
+    bool ready;
+
+    m_waiting++;
+    if (timeout_ms < 0) {
+        m_frame_cv.wait(lock, fresh);
+        ready = true;
+    } else {
+        ready = m_frame_cv.wait_for(lock,
+            std::chrono::milliseconds(timeout_ms), fresh);
+    }
+    m_waiting--;
+
+    if (!ready || m_stop) {
+        return JpegBuffer();
+    }
+    *sequence = m_sequence;
+    return m_latest;
+}
+
+/**
+ * Sends a buffer to a client.
+ * @param [in] fd The client socket.
+ * @param [in] data The data to send.
+ * @param [in] length The number of bytes.
+ * @return true iff everything was sent.
+ */
+bool MjpegServer::SendAll(int fd, const void *data, size_t length) {
+    const char *p = static_cast<const char*>(data);
+    while (length > 0) {
+        ssize_t sent = send(fd, p, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        p += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+/**
+ * Determines if a client has hung up. Anything else the client has sent
+ * since its request is discarded.
+ * @param [in] fd The client socket.
+ * @return true iff the client has closed the connection.
+ */
+bool MjpegServer::ClientClosed(int fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    char discard[256];
+
+    while (poll(&pfd, 1, 0) > 0) {
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            return true;
+        }
+        ssize_t length = recv(fd, discard, sizeof(discard), MSG_DONTWAIT);
+        if (length == 0) {
+            return true;
+        } else if (length < 0) {
+            return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+        }
+    }
+    return false;
+}
+
+/**
+ * Client thread. Reads the request, then sends a snapshot or the stream.
+ * @param [in] client The client to serve.
+ */
+void MjpegServer::ServeClient(Client *client) {
+    char request[1024];
+    char header[256];
+    uint64_t sequence;
+    ssize_t length;
+    size_t total = 0;
+    int fd = client->fd;
+
+    //Only the request line matters; read until the end of the headers.
+    while (total < sizeof(request) - 1) {
+        length = recv(fd, request + total, sizeof(request) - 1 - total, 0);
+        if (length <= 0) {
+            break;
+        }
+        total += length;
+        request[total] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+    request[total] = '\0';
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        sequence = m_sequence;
+    }
+
+    if (total == 0) {
+        //Nothing to serve.
+    } else if (strstr(request, "action=snapshot")) {
+        JpegBuffer jpeg = WaitFrame(&sequence, MJPEG_SNAPSHOT_TIMEOUT);
+        if (!jpeg) {
+            SendAll(fd, not_available, sizeof(not_available) - 1);
+        } else {
+            length = snprintf(header, sizeof(header),
+                "HTTP/1.0 200 OK\r\n"
+                "Connection: close\r\n"
+                "Cache-Control: no-store, no-cache, must-revalidate, max-age=0\r\n"
+                "Access-Control-Allow-Origin: *\r\n"
+                "Content-Type: image/jpeg\r\n"
+                "Content-Length: %zu\r\n\r\n", jpeg->size());
+            if (SendAll(fd, header, length)) {
+                SendAll(fd, jpeg->data(), jpeg->size());
+            }
+        }
+    } else if (SendAll(fd, stream_header, sizeof(stream_header) - 1)) {
+        while (!m_stop) {
+            //Don't wait for a frame indefinitely, so that a client that has
+            //gone does not keep the stream being encoded.
+            JpegBuffer jpeg = WaitFrame(&sequence, MJPEG_POLL_INTERVAL);
+            if (ClientClosed(fd)) {
+                break;
+            } else if (!jpeg) {
+                continue;
+            }
+
+            length = snprintf(header, sizeof(header),
+                "--" MJPEG_BOUNDARY "\r\n"
+                "Content-Type: image/jpeg\r\n"
+                "Content-Length: %zu\r\n\r\n", jpeg->size());
+            if (!SendAll(fd, header, length) ||
+                !SendAll(fd, jpeg->data(), jpeg->size()) ||
+                !SendAll(fd, "\r\n", 2)) {
+                break;
+            }
+        }
+    }
+
+    client->done = true;
+}
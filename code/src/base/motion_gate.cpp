@@ -0,0 +1,124 @@
+/**
+ * @file motion_gate.cpp
+ * @brief Detects when the camera view has not changed.
+ */
+
+#include "common.h"
+#include "motion_gate.h"
+#include <cmath>
+
+using namespace picopter;
+
+/** Pixels sampled along each side of a cell **/
+#define MOTION_SAMPLES 6
+
+/**
+ * Constructor.
+ * @param [in] threshold Largest change in cell brightness (0-255) that is
+ *                       not counted as motion.
+ * @param [in] max_reuse Most consecutive frames that are reported unchanged.
+ * @param [in] max_rotation Largest change in heading, airframe roll or
+ *                          pitch, or gimbal angle (degrees) that is not
+ *                          counted as motion.
+ */
+MotionGate::MotionGate(int threshold, int max_reuse, double max_rotation)
+: m_threshold(threshold)
+, m_max_reuse(max_reuse)
+, m_max_rotation(max_rotation)
+, m_cells(GRID_WIDTH * GRID_HEIGHT)
+, m_pose{}
+, m_reused(0)
+{
+}
+
+/**
+ * Forgets the reference frame; the next frame is always reported changed.
+ */
+void MotionGate::Reset() {
+    m_reference.clear();
+    m_reused = 0;
+}
+
+/**
+ * Measures the brightness of each cell, from a sparse sample of its pixels.
+ * @param [in] image The frame (8 bit, 1 or 3 channels).
+ * @param [out] cells The mean brightness of each cell (0-255).
+ */
+void MotionGate::Measure(const cv::Mat &image, std::vector<int> *cells) {
+    int channels = image.channels();
+
+    for (int gy = 0; gy < GRID_HEIGHT; gy++) {
+        int y0 = (gy * image.rows) / GRID_HEIGHT;
+        int height = ((gy + 1) * image.rows) / GRID_HEIGHT - y0;
+        for (int gx = 0; gx < GRID_WIDTH; gx++) {
+            int x0 = (gx * image.cols) / GRID_WIDTH;
+            int width = ((gx + 1) * image.cols) / GRID_WIDTH - x0;
+            int sum = 0, count = 0;
+
+            for (int sy = 0; sy < MOTION_SAMPLES; sy++) {
+                const uint8_t *row = image.ptr<uint8_t>(
+                    y0 + ((2 * sy + 1) * height) / (2 * MOTION_SAMPLES));
+                for (int sx = 0; sx < MOTION_SAMPLES; sx++) {
+                    const uint8_t *p = row + channels *
+                        (x0 + ((2 * sx + 1) * width) / (2 * MOTION_SAMPLES));
+                    for (int c = 0; c < channels; c++) {
+                        sum += p[c];
+                    }
+                    count += channels;
+                }
+            }
+            (*cells)[gy * GRID_WIDTH + gx] = sum / count;
+        }
+    }
+}
+
+/**
+ * Determines if the aircraft or gimbal has turned (or the aircraft has
+ * rolled or pitched) since the reference frame.
+ * @param [in] pose The current pose.
+ * @return true iff it has turned too far.
+ */
+bool MotionGate::Turned(const FramePose &pose) {
+    const float now[] = {pose.heading, pose.roll, pose.pitch,
+        pose.gimbal_roll, pose.gimbal_pitch, pose.gimbal_yaw};
+    const float then[] = {m_pose.heading, m_pose.roll, m_pose.pitch,
+        m_pose.gimbal_roll, m_pose.gimbal_pitch, m_pose.gimbal_yaw};
+
+    for (size_t i = 0; i < sizeof(now) / sizeof(now[0]); i++) {
+        double delta = std::fabs(std::remainder(now[i] - then[i], 360.0));
+        if (delta > m_max_rotation) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Determines whether a frame is unchanged from the reference frame. If it
+ * has changed, it becomes the new reference.
+ * @param [in] image The frame.
+ * @param [in] pose The pose at which it was captured.
+ * @return true iff the frame is unchanged (its detections may be reused).
+ */
+bool MotionGate::Unchanged(const cv::Mat &image, const FramePose &pose) {
+    if (image.cols < GRID_WIDTH || image.rows < GRID_HEIGHT) {
+        return false;
+    }
+
+    Measure(image, &m_cells);
+    bool unchanged = m_reference.size() == m_cells.size() &&
+        m_reused < m_max_reuse && !Turned(pose);
+    for (size_t i = 0; unchanged && i < m_cells.size(); i++) {
+        unchanged = std::abs(m_cells[i] - m_reference[i]) <= m_threshold;
+    }
+
+    if (unchanged) {
+        m_reused++;
+    } else {
+        m_reference.swap(m_cells);
+        m_cells.resize(m_reference.size());
+        m_pose = pose;
+        m_reused = 0;
+    }
+    return unchanged;
+}
@@ -0,0 +1,111 @@
+/**
+ * @file parallel_for.cpp
+ * @brief Allocation-free parallel-for on top of the thread pool.
+ */
+
+#include "common.h"
+#include "parallel_for.h"
+
+using namespace picopter;
+
+/**
+ * Constructor. Starts the worker loops on the given pool.
+ * @param [in] pool The pool to run the workers on. May be NULL, in which
+ *                  case every loop runs on the calling thread.
+ * @param [in] workers The number of pool threads to take over. This should
+ *                     not exceed the number of threads in the pool.
+ */
+ParallelFor::ParallelFor(ThreadPool *pool, int workers)
+: m_body(nullptr)
+, m_ctx(nullptr)
+, m_count(0)
+, m_next(0)
+, m_done(0)
+, m_stop(false)
+{
+    if (pool) {
+        for (int i = 0; i < workers; i++) {
+            m_workers.emplace_back(pool->enqueue(&ParallelFor::Worker, this));
+        }
+    }
+}
+
+/**
+ * Destructor. Stops the worker loops, returning the threads to the pool.
+ */
+ParallelFor::~ParallelFor() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_start_cv.notify_all();
+    for (auto &worker : m_workers) {
+        worker.wait();
+    }
+}
+
+/**
+ * Retrieves the number of threads that take part in each loop.
+ * @return The number of workers plus the calling thread.
+ */
+int ParallelFor::GetThreads() {
+    return static_cast<int>(m_workers.size()) + 1;
+}
+
+/**
+ * Publishes a loop to the workers, takes part in it, and waits for it to
+ * complete.
+ * @param [in] count The number of iterations.
+ * @param [in] body The loop body.
+ * @param [in] ctx The context to pass to the loop body.
+ */
+void ParallelFor::Dispatch(int count, Body body, void *ctx) {
+    std::lock_guard<std::mutex> dispatch_lock(m_dispatch_mutex);
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    m_body = body;
+    m_ctx = ctx;
+    m_count = count;
+    m_next = 0;
+    m_done = 0;
+    m_start_cv.notify_all();
+
+    RunIterations(lock);
+    m_done_cv.wait(lock, [this] { return m_done == m_count; });
+}
+
+/**
+ * Claims and runs iterations of the current loop until none are left.
+ * Iterations are handed out under the lock so that a worker can never
+ * pick up an iteration of a loop that has already completed.
+ * @param [in] lock The held lock on m_mutex.
+ */
+void ParallelFor::RunIterations(std::unique_lock<std::mutex> &lock) {
+    while (m_next < m_count) {
+        int i = m_next++;
+        Body body = m_body;
+        void *ctx = m_ctx;
+
+        lock.unlock();
+        body(ctx, i);
+        lock.lock();
+
+        if (++m_done == m_count) {
+            m_done_cv.notify_all();
+        }
+    }
+}
+
+/**
+ * Worker loop. Waits for loops to be published and helps run them.
+ */
+void ParallelFor::Worker() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_start_cv.wait(lock, [this] { return m_stop || m_next < m_count; });
+        if (m_stop) {
+            return;
+        }
+        RunIterations(lock);
+    }
+}
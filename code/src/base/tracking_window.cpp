@@ -0,0 +1,128 @@
+/**
+ * @file tracking_window.cpp
+ * @brief Predictive search window for tracking a detected object.
+ */
+
+#include "common.h"
+#include "tracking_window.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace picopter;
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+/** Smallest margin (pixels) added on each side of the object **/
+#define MIN_WINDOW_MARGIN 8
+/** Weight of the latest measurement in the velocity estimate **/
+#define VELOCITY_GAIN 0.5
+/** Longest time (seconds) that the velocity is extrapolated over **/
+#define MAX_PREDICTION_TIME 0.5
+
+/**
+ * Constructor.
+ * @param [in] margin The fraction of the object size to add on each side.
+ * @param [in] full_scan_interval The number of windowed frames between full
+ *                                frame scans (0 to never window).
+ * @param [in] max_misses The number of consecutive frames an object may be
+ *                        missed before the lock is lost.
+ */
+TrackingWindow::TrackingWindow(double margin, int full_scan_interval, int max_misses)
+: m_margin(margin)
+, m_full_scan_interval(full_scan_interval)
+, m_max_misses(max_misses)
+{
+    Reset();
+}
+
+/**
+ * Drops the lock; the next frame will be a full scan.
+ */
+void TrackingWindow::Reset() {
+    m_locked = false;
+    m_misses = 0;
+    m_windowed = 0;
+    m_cx = m_cy = 0;
+    m_vx = m_vy = 0;
+    m_size = cv::Size();
+}
+
+/**
+ * Determines if an object is locked.
+ * @return true iff an object is locked.
+ */
+bool TrackingWindow::IsLocked() const {
+    return m_locked;
+}
+
+/**
+ * Computes the region of the next frame that should be processed.
+ * @param [in] frame The size of the frame.
+ * @param [in] now The capture time of the frame.
+ * @param [out] window The region to process.
+ * @return true iff only the window should be processed; false if the whole
+ *         frame should be scanned.
+ */
+bool TrackingWindow::GetWindow(const cv::Size &frame,
+    steady_clock::time_point now, cv::Rect *window)
+{
+    if (!m_locked || m_windowed >= m_full_scan_interval) {
+        m_windowed = 0;
+        return false;
+    }
+
+    double dt = duration<double>(now - m_last_seen).count();
+    dt = picopter::clamp(dt, 0.0, MAX_PREDICTION_TIME);
+
+    double cx = m_cx + m_vx * dt, cy = m_cy + m_vy * dt;
+    double hw = (m_size.width / 2.0) * (1 + m_margin) + std::fabs(m_vx) * dt + MIN_WINDOW_MARGIN;
+    double hh = (m_size.height / 2.0) * (1 + m_margin) + std::fabs(m_vy) * dt + MIN_WINDOW_MARGIN;
+
+    int x0 = std::max(0, static_cast<int>(cx - hw));
+    int y0 = std::max(0, static_cast<int>(cy - hh));
+    int x1 = std::min(frame.width, static_cast<int>(std::ceil(cx + hw)));
+    int y1 = std::min(frame.height, static_cast<int>(std::ceil(cy + hh)));
+    if (x1 <= x0 || y1 <= y0) {
+        //Predicted off screen; look everywhere.
+        m_windowed = 0;
+        return false;
+    }
+
+    *window = cv::Rect(x0, y0, x1 - x0, y1 - y0);
+    m_windowed++;
+    return true;
+}
+
+/**
+ * Updates the track with the result of processing a frame.
+ * @param [in] time The capture time of the frame.
+ * @param [in] bounds The bounds of the object (in frame coordinates), or
+ *                    NULL if it was not found.
+ */
+void TrackingWindow::Update(steady_clock::time_point time, const cv::Rect *bounds) {
+    if (!bounds) {
+        if (m_locked && ++m_misses > m_max_misses) {
+            Reset();
+        }
+        return;
+    }
+
+    double cx = bounds->x + bounds->width / 2.0;
+    double cy = bounds->y + bounds->height / 2.0;
+    if (m_locked) {
+        double dt = duration<double>(time - m_last_seen).count();
+        if (dt > 0) {
+            m_vx += VELOCITY_GAIN * ((cx - m_cx) / dt - m_vx);
+            m_vy += VELOCITY_GAIN * ((cy - m_cy) / dt - m_vy);
+        }
+    } else {
+        m_vx = m_vy = 0;
+    }
+
+    m_cx = cx;
+    m_cy = cy;
+    m_size = cv::Size(bounds->width, bounds->height);
+    m_last_seen = time;
+    m_locked = true;
+    m_misses = 0;
+}
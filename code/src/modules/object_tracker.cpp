@@ -191,6 +191,7 @@ void ObjectTracker::Run(FlightController *fc, void *opts) {
     pose.pitch = 45;
     pose.yaw = 0;
     fc->fb->ConfigureGimbal();
+    steady_clock::time_point last_capture;
 
     while (!fc->CheckForStop()) {
         fc->fb->SetGimbalPose(pose);
@@ -207,6 +208,12 @@ void ObjectTracker::Run(FlightController *fc, void *opts) {
 
 
         fc->cam->GetDetectedObjects(&locations);
+        //Record how old the detections are by the time they are acted upon.
+        if (locations.size() > 0 && locations.front().capture_time != last_capture) {
+            last_capture = locations.front().capture_time;
+            fc->cam->RecordLatency(CameraStream::LATENCY_DECISION,
+                steady_clock::now() - last_capture);
+        }
         fc->fb->GetGimbalPose(&gimbal);
         fc->gps->GetLatest(&gps_position);
         fc->imu->GetLatest(&imu_data);
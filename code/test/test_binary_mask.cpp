@@ -0,0 +1,142 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "binary_mask.h"
+
+using namespace picopter;
+
+class BinaryMaskTest : public ::testing::Test {
+    protected:
+        BinaryMaskTest()
+        : width(45)
+        , height(30)
+        {
+            LogInit();
+            srand(2468);
+        }
+
+        int width, height;
+
+        cv::Mat RandomMask(int density) {
+            cv::Mat mask(height, width, CV_8UC1);
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    mask.at<uint8_t>(y, x) = (rand() % density == 0) ? 255 : 0;
+                }
+            }
+            return mask;
+        }
+};
+
+TEST_F(BinaryMaskTest, TestRoundTrip) {
+    cv::Mat dense = RandomMask(3), out;
+    BinaryMask mask;
+
+    mask.FromMat(dense);
+    ASSERT_EQ(width, mask.GetWidth());
+    ASSERT_EQ(height, mask.GetHeight());
+    mask.ToMat(out);
+    ASSERT_EQ(height, out.rows);
+    ASSERT_EQ(width, out.cols);
+    for (int y = 0; y < height; y++) {
+        ASSERT_EQ(0, memcmp(dense.ptr<uint8_t>(y), out.ptr<uint8_t>(y), width)) << y;
+    }
+
+    //Render a region that hangs off the mask.
+    cv::Rect roi(10, 5, 40, 30);
+    mask.ToMat(out, roi);
+    for (int y = 0; y < roi.height; y++) {
+        for (int x = 0; x < roi.width; x++) {
+            int sx = roi.x + x, sy = roi.y + y;
+            uint8_t expected = (sx < width && sy < height) ? dense.at<uint8_t>(sy, sx) : 0;
+            ASSERT_EQ(expected, out.at<uint8_t>(y, x)) << x << "," << y;
+        }
+    }
+}
+
+TEST_F(BinaryMaskTest, TestAddRuns) {
+    cv::Mat dense = RandomMask(4);
+    BinaryMask rows, runs;
+    std::vector<PixelRun> encoded;
+
+    rows.FromMat(dense);
+    //Leave the first and last rows empty.
+    for (int y = 1; y < height - 1; y++) {
+        EncodeRuns(dense.ptr<uint8_t>(y), width, y, 0, &encoded);
+    }
+    runs.Reset(width, height);
+    runs.AddRuns(encoded);
+
+    for (int y = 0; y < height; y++) {
+        size_t a, a_end, b, b_end;
+        rows.GetRow(y, &a, &a_end);
+        runs.GetRow(y, &b, &b_end);
+        if (y == 0 || y == height - 1) {
+            ASSERT_EQ(b, b_end);
+        } else {
+            ASSERT_EQ(a_end - a, b_end - b);
+        }
+    }
+}
+
+TEST_F(BinaryMaskTest, TestMoments) {
+    cv::Mat dense = RandomMask(3);
+    BinaryMask mask;
+    MaskMoments expected = {};
+
+    mask.FromMat(dense);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (dense.at<uint8_t>(y, x)) {
+                expected.m00++;
+                expected.m10 += x; expected.m01 += y;
+                expected.m20 += x*x; expected.m02 += y*y; expected.m11 += x*y;
+            }
+        }
+    }
+
+    MaskMoments m = mask.Moments(true);
+    ASSERT_EQ(expected.m00, m.m00);
+    ASSERT_EQ(expected.m10, m.m10);
+    ASSERT_EQ(expected.m01, m.m01);
+    ASSERT_EQ(expected.m20, m.m20);
+    ASSERT_EQ(expected.m02, m.m02);
+    ASSERT_EQ(expected.m11, m.m11);
+    ASSERT_EQ(expected.m00, mask.Area());
+    ASSERT_EQ(0, mask.Moments(false).m20);
+}
+
+TEST_F(BinaryMaskTest, TestBoundingBox) {
+    cv::Mat dense = cv::Mat::zeros(height, width, CV_8UC1);
+    BinaryMask mask;
+    cv::Rect bounds;
+
+    mask.FromMat(dense);
+    ASSERT_FALSE(mask.BoundingBox(&bounds));
+
+    dense.at<uint8_t>(4, 20) = 255;
+    dense.at<uint8_t>(9, 7) = 255;
+    dense.at<uint8_t>(12, 30) = 255;
+    mask.FromMat(dense);
+    ASSERT_TRUE(mask.BoundingBox(&bounds));
+    ASSERT_EQ(cv::Rect(7, 4, 24, 9), bounds);
+}
+
+TEST_F(BinaryMaskTest, TestOverlap) {
+    cv::Mat da = RandomMask(2), db = RandomMask(3);
+    BinaryMask a, b;
+    cv::Rect roi(5, 3, 20, 40);
+    int64_t both = 0, in_roi = 0;
+
+    a.FromMat(da);
+    b.FromMat(db);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            bool set = da.at<uint8_t>(y, x) != 0;
+            both += set && db.at<uint8_t>(y, x);
+            in_roi += set && roi.contains(cv::Point(x, y));
+        }
+    }
+    ASSERT_EQ(both, a.Overlap(b));
+    ASSERT_EQ(both, b.Overlap(a));
+    ASSERT_EQ(in_roi, a.Overlap(roi));
+}
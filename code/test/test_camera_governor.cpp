@@ -0,0 +1,96 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "camera_governor.h"
+
+using picopter::CameraGovernor;
+using picopter::GovernorBounds;
+using picopter::GovernorLevel;
+
+class CameraGovernorTest : public ::testing::Test {
+    protected:
+        CameraGovernorTest()
+        : bounds{320, 160, 80, 40, 50, 200, true, true}
+        {
+            LogInit();
+        }
+
+        GovernorBounds bounds;
+};
+
+TEST_F(CameraGovernorTest, Levels) {
+    std::vector<GovernorLevel> levels = CameraGovernor::BuildLevels(bounds);
+
+    //Stream 50, 100, 200ms; HUD off; widths 106, 80; recording off.
+    ASSERT_EQ(7u, levels.size());
+    EXPECT_EQ(160, levels[0].process_width);
+    EXPECT_EQ(50, levels[0].stream_interval);
+    EXPECT_TRUE(levels[0].hud && levels[0].record);
+    EXPECT_EQ(200, levels[2].stream_interval);
+    EXPECT_FALSE(levels[3].hud);
+    EXPECT_EQ(160, levels[3].process_width);
+    EXPECT_EQ(106, levels[4].process_width);
+    EXPECT_EQ(80, levels[5].process_width);
+    EXPECT_EQ(40, levels[3].pixel_threshold);
+    EXPECT_TRUE(levels[5].record);
+    EXPECT_FALSE(levels[6].record);
+
+    bounds.shed_hud = bounds.shed_record = false;
+    bounds.min_process_width = 200;
+    bounds.max_stream_interval = 0;
+    EXPECT_EQ(1u, CameraGovernor::BuildLevels(bounds).size());
+}
+
+TEST_F(CameraGovernorTest, StepsDownAndUp) {
+    CameraGovernor governor(bounds, 10, 5);
+    int steps = 0;
+
+    //Too slow: steps down one level per holdoff, to the bottom.
+    for (int i = 0; i < 100; i++) {
+        steps += governor.Update(150);
+    }
+    EXPECT_EQ(governor.GetLevels() - 1, governor.GetLevel());
+    EXPECT_EQ(governor.GetLevels() - 1, steps);
+    EXPECT_FALSE(governor.GetSettings().record);
+
+    //Within budget, but not by enough to step up.
+    for (int i = 0; i < 100; i++) {
+        EXPECT_FALSE(governor.Update(80));
+    }
+
+    //Plenty of time: steps up once the smoothed time drops, then waits
+    //three times the holdoff between steps up.
+    int frames = 1;
+    while (!governor.Update(20) && frames < 10) {
+        frames++;
+    }
+    EXPECT_EQ(4, frames);
+    for (int i = 0; i < 14; i++) {
+        EXPECT_FALSE(governor.Update(20));
+    }
+    EXPECT_TRUE(governor.Update(20));
+    for (int i = 0; i < 200; i++) {
+        governor.Update(20);
+    }
+    EXPECT_EQ(0, governor.GetLevel());
+}
+
+TEST_F(CameraGovernorTest, ScalesPixelThreshold) {
+    CameraGovernor governor(bounds, 10, 1);
+    std::vector<int> widths, thresholds;
+
+    //The threshold is an area, so it follows the square of the width.
+    widths.push_back(governor.GetSettings().process_width);
+    thresholds.push_back(governor.GetSettings().pixel_threshold);
+    while (governor.Update(150)) {
+        if (governor.GetSettings().process_width != widths.back()) {
+            widths.push_back(governor.GetSettings().process_width);
+            thresholds.push_back(governor.GetSettings().pixel_threshold);
+        }
+    }
+    ASSERT_EQ(3u, widths.size());
+    EXPECT_EQ(40, thresholds[0]);
+    EXPECT_EQ(106, widths[1]);
+    EXPECT_EQ(17, thresholds[1]);
+    EXPECT_EQ(80, widths[2]);
+    EXPECT_EQ(10, thresholds[2]);
+}
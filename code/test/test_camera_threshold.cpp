@@ -0,0 +1,187 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "camera_threshold.h"
+#include <cmath>
+
+using namespace picopter;
+
+class CameraThresholdTest : public ::testing::Test {
+    protected:
+        CameraThresholdTest()
+        {
+            LogInit();
+            srand(1234);
+        }
+
+        void CheckKernel(ThresholdKernel kernel) {
+            if (!ThresholdKernelSupported(kernel)) {
+                std::cout << "Skipping unsupported kernel "
+                          << GetThresholdKernelName(kernel) << std::endl;
+                return;
+            }
+            for (int bits = 4; bits <= 6; bits++) {
+                CheckKernel(kernel, bits);
+            }
+        }
+
+        void CheckKernel(ThresholdKernel kernel, int bits) {
+            ThresholdRowFn fn = GetThresholdRowKernel(kernel, bits);
+            ThresholdRowFn scalar = GetThresholdRowKernel(THRESH_KERNEL_SCALAR, bits);
+            //A pseudo-random LUT so every index bit affects the result.
+            std::vector<uint8_t> lut(1 << (3*bits));
+            for (size_t i = 0; i < lut.size(); i++) {
+                lut[i] = (rand() % 3 == 0) ? 255 : 0;
+            }
+
+            for (int channels = 3; channels <= 4; channels++) {
+                for (int skip = 1; skip <= 4; skip++) {
+                    for (int width = 0; width <= 67; width++) {
+                        //Exact-size source so any overread would be caught
+                        //by sanitisers.
+                        std::vector<uint8_t> src(width*skip*channels);
+                        std::vector<uint8_t> expected(width), actual(width);
+                        for (size_t i = 0; i < src.size(); i++) {
+                            src[i] = rand() & 0xFF;
+                        }
+
+                        scalar(lut.data(), src.data(),
+                            expected.data(), width, channels, skip);
+                        fn(lut.data(), src.data(), actual.data(),
+                            width, channels, skip);
+                        ASSERT_EQ(expected, actual)
+                            << GetThresholdKernelName(kernel)
+                            << " bits=" << bits
+                            << " channels=" << channels << " skip=" << skip
+                            << " width=" << width;
+                    }
+                }
+            }
+        }
+};
+
+TEST_F(CameraThresholdTest, TestScalarIndexing) {
+    std::vector<uint8_t> index_lut(4096);
+    for (size_t i = 0; i < index_lut.size(); i++) {
+        index_lut[i] = i & 0xFF;
+    }
+    //BGR pixel (b=0x1F, g=0x2F, r=0x3F) -> index 0x321
+    uint8_t src[] = {0x1F, 0x2F, 0x3F};
+    uint8_t dst = 0;
+    ThresholdRowScalar<4>(index_lut.data(), src, &dst, 1, 3, 1);
+    ASSERT_EQ(0x21, dst);
+}
+
+TEST_F(CameraThresholdTest, TestLUTIndexing) {
+    //r=0xFF, g=0x80, b=0x08 at each resolution
+    ASSERT_EQ((0xF << 8) | (0x8 << 4) | 0x0, ColourLUT<4>::Index(0xFF, 0x80, 0x08));
+    ASSERT_EQ((0x1F << 10) | (0x10 << 5) | 0x1, ColourLUT<5>::Index(0xFF, 0x80, 0x08));
+    ASSERT_EQ((0x3F << 12) | (0x20 << 6) | 0x2, ColourLUT<6>::Index(0xFF, 0x80, 0x08));
+    ASSERT_EQ(7, ColourLUT<4>::Unreduce(0));
+    ASSERT_EQ(247, ColourLUT<4>::Unreduce(15));
+    ASSERT_EQ(1, ColourLUT<6>::Unreduce(0));
+
+    ThresholdLUT lut(6);
+    ASSERT_EQ(6, lut.GetBits());
+    ASSERT_EQ(64, lut.GetSize());
+    ASSERT_EQ(static_cast<size_t>(ColourLUT<6>::ENTRIES), lut.GetEntries());
+    ThresholdLUT clamped(8);
+    ASSERT_EQ(6, clamped.GetBits());
+}
+
+TEST_F(CameraThresholdTest, TestYUYVIndexing) {
+    std::vector<uint8_t> index_lut(4096);
+    for (size_t i = 0; i < index_lut.size(); i++) {
+        index_lut[i] = (i >> 4) & 0xFF;
+    }
+    //Pixels 0-3: Y = 0x1F, 0x2F, 0x3F, 0x4F; Cb/Cr = 0x5F/0x6F, then 0x7F/0x8F.
+    uint8_t src[] = {0x1F, 0x5F, 0x2F, 0x6F, 0x3F, 0x7F, 0x4F, 0x8F};
+    uint8_t dst[4] = {0};
+    ThresholdRowFn fn = GetThresholdRowKernel(THRESH_KERNEL_SCALAR, 4,
+        THRESH_INPUT_YUYV);
+    ASSERT_EQ(&ThresholdRowYUYV<4>, fn);
+
+    //The table is indexed on [y][cb][cr]; the entry holds the y and cb bins.
+    fn(index_lut.data(), src, dst, 4, 2, 1);
+    EXPECT_EQ(0x15, dst[0]);
+    EXPECT_EQ(0x25, dst[1]);
+    EXPECT_EQ(0x37, dst[2]);
+    EXPECT_EQ(0x47, dst[3]);
+    fn(index_lut.data(), src, dst, 2, 2, 3);
+    EXPECT_EQ(0x15, dst[0]);
+    EXPECT_EQ(0x47, dst[1]);
+
+    ThresholdLUT lut(5, THRESH_KERNEL_SCALAR, THRESH_INPUT_YUYV);
+    EXPECT_EQ(THRESH_INPUT_YUYV, lut.GetInput());
+    EXPECT_EQ(&ThresholdRowYUYV<5>, lut.GetRowKernel());
+}
+
+TEST_F(CameraThresholdTest, TestSSE2BitExact) {
+    CheckKernel(THRESH_KERNEL_SSE2);
+}
+
+TEST_F(CameraThresholdTest, TestAVX2BitExact) {
+    CheckKernel(THRESH_KERNEL_AVX2);
+}
+
+TEST_F(CameraThresholdTest, TestNEONBitExact) {
+    CheckKernel(THRESH_KERNEL_NEON);
+}
+
+TEST_F(CameraThresholdTest, TestDetectedKernelBitExact) {
+    CheckKernel(DetectThresholdKernel());
+}
+
+TEST_F(CameraThresholdTest, TestUnsupportedFallsBack) {
+    for (int k = THRESH_KERNEL_SCALAR; k <= THRESH_KERNEL_NEON; k++) {
+        ThresholdKernel kernel = static_cast<ThresholdKernel>(k);
+        if (!ThresholdKernelSupported(kernel)) {
+            ASSERT_EQ(&ThresholdRowScalar<4>, GetThresholdRowKernel(kernel));
+            ASSERT_EQ(&ThresholdRowScalar<6>, GetThresholdRowKernel(kernel, 6));
+        }
+    }
+}
+
+TEST_F(CameraThresholdTest, TestPassRange) {
+    ColourPassTable pass;
+    SetPassRange(pass, 0, -10, 20, true);
+    SetPassRange(pass, 1, 50, 60);
+    SetPassRange(pass, 2, -10, 5);
+
+    for (int i = 0; i < 256; i++) {
+        ASSERT_EQ((i <= 20 || (i >= 170 && i <= 180)) ? 0xFF : 0, pass[0][i]) << i;
+        ASSERT_EQ((i >= 50 && i <= 60) ? 0xFF : 0, pass[1][i]) << i;
+        ASSERT_EQ(i <= 5 ? 0xFF : 0, pass[2][i]) << i;
+    }
+}
+
+TEST_F(CameraThresholdTest, TestColourCube) {
+    const size_t entries = 1000;
+    std::vector<uint8_t> cube(3*entries), lut(entries);
+    ColourPassTable pass;
+
+    for (size_t i = 0; i < cube.size(); i++) {
+        cube[i] = rand() & 0xFF;
+    }
+    SetPassRange(pass, 0, -30, 40, true);
+    SetPassRange(pass, 1, 60, 200);
+    SetPassRange(pass, 2, 100, 255);
+    ThresholdColourCube(cube.data(), entries, pass, lut.data());
+
+    for (size_t i = 0; i < entries; i++) {
+        int p1 = cube[i], p2 = cube[entries + i], p3 = cube[2*entries + i];
+        bool in = (p1 <= 40 || (p1 >= 150 && p1 <= 180)) &&
+            p2 >= 60 && p2 <= 200 && p3 >= 100;
+        ASSERT_EQ(in ? 255 : 0, lut[i]) << i;
+    }
+}
+
+TEST_F(CameraThresholdTest, TestOrientation) {
+    //A diagonal line from top-left to bottom-right (y down) is at +45 degrees.
+    MaskMoments m = {};
+    for (int i = 0; i < 20; i++) {
+        m.m00++;
+        m.m10 += i; m.m01 += i;
+        m.m20 += i*i; m.m02 += i*i; m.m11 += i*i;
+    }
+    ASSERT_NEAR(M_PI/4, MomentsOrientation(m), 1e-9);
+}
@@ -0,0 +1,124 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "camshift_tracker.h"
+
+using namespace picopter;
+using std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+class CamShiftTrackerTest : public ::testing::Test {
+    protected:
+        CamShiftTrackerTest()
+        : start(steady_clock::now())
+        {
+            LogInit();
+        }
+
+        steady_clock::time_point start;
+
+        steady_clock::time_point At(int ms) {
+            return start + milliseconds(ms);
+        }
+
+        /**
+         * A black HSV image with one fully saturated square of the given hue.
+         */
+        static cv::Mat Blob(int hue, const cv::Rect &bounds) {
+            cv::Mat hsv(240, 320, CV_8UC3, cv::Scalar(0, 0, 0));
+            hsv(bounds).setTo(cv::Scalar(hue, 255, 255));
+            return hsv;
+        }
+
+        static cv::Mat Histogram(int hue) {
+            cv::Rect bounds(100, 100, 30, 30);
+            cv::Mat hist;
+            CamShiftTracker::LearnHistogram(Blob(hue, bounds), bounds, &hist);
+            return hist;
+        }
+};
+
+TEST_F(CamShiftTrackerTest, CacheFindsSameColour) {
+    HistogramCache cache;
+    cv::Mat green = Histogram(60), cached;
+
+    ASSERT_FALSE(cache.Find(green, &cached));
+    cache.Store(green);
+    ASSERT_EQ(1u, cache.Size());
+    ASSERT_TRUE(cache.Find(Histogram(60), &cached));
+    EXPECT_EQ(0, cv::norm(green, cached, cv::NORM_INF));
+
+    //Storing the same colour again replaces the entry.
+    cache.Store(green);
+    EXPECT_EQ(1u, cache.Size());
+}
+
+TEST_F(CamShiftTrackerTest, CacheRejectsDifferentColour) {
+    HistogramCache cache;
+    cv::Mat cached;
+
+    cache.Store(Histogram(60));
+    EXPECT_FALSE(cache.Find(Histogram(120), &cached));
+    EXPECT_FALSE(cache.Find(Histogram(0), &cached));
+    cache.Store(Histogram(120));
+    EXPECT_EQ(2u, cache.Size());
+}
+
+TEST_F(CamShiftTrackerTest, CacheEvictsLeastRecentlyUsed) {
+    HistogramCache cache(2);
+    cv::Mat red = Histogram(0), green = Histogram(60), blue = Histogram(120);
+    cv::Mat cached;
+
+    cache.Store(red);
+    cache.Store(green);
+    //Using red makes green the least recently used.
+    ASSERT_TRUE(cache.Find(red, &cached));
+    cache.Store(blue);
+    EXPECT_EQ(2u, cache.Size());
+    EXPECT_FALSE(cache.Find(green, &cached));
+    EXPECT_TRUE(cache.Find(red, &cached));
+    EXPECT_TRUE(cache.Find(blue, &cached));
+
+    cache.Clear();
+    EXPECT_EQ(0u, cache.Size());
+    EXPECT_FALSE(cache.Find(red, &cached));
+}
+
+TEST_F(CamShiftTrackerTest, FollowsMovingBlob) {
+    CamShiftTracker tracker;
+    cv::Rect bounds(60, 100, 30, 30);
+
+    ASSERT_FALSE(tracker.IsActive());
+    tracker.Start(7, Histogram(60), bounds, At(0), TrackingWindow());
+    ASSERT_TRUE(tracker.IsActive());
+    EXPECT_EQ(7, tracker.GetId());
+
+    for (int i = 1; i <= 5; i++) {
+        bounds.x += 8;
+        bounds.y += 2;
+        cv::Mat hsv = Blob(60, bounds);
+
+        ASSERT_TRUE(tracker.Update(hsv, At(i * 40))) << "Frame " << i;
+        cv::Point2f centre(bounds.x + bounds.width / 2.0f,
+            bounds.y + bounds.height / 2.0f);
+        EXPECT_NEAR(centre.x, tracker.GetBox().center.x, 2) << "Frame " << i;
+        EXPECT_NEAR(centre.y, tracker.GetBox().center.y, 2) << "Frame " << i;
+        EXPECT_TRUE(tracker.GetBounds().contains(centre)) << "Frame " << i;
+    }
+    EXPECT_TRUE(tracker.IsActive());
+
+    tracker.Stop();
+    EXPECT_FALSE(tracker.IsActive());
+    EXPECT_FALSE(tracker.Update(Blob(60, bounds), At(240)));
+}
+
+TEST_F(CamShiftTrackerTest, StopsWhenLost) {
+    CamShiftTracker tracker;
+    cv::Rect bounds(100, 100, 30, 30);
+    cv::Mat empty = Blob(60, cv::Rect());
+
+    tracker.Start(1, Histogram(60), bounds, At(0), TrackingWindow(0.5, 15, 2));
+    for (int i = 1; i <= 3; i++) {
+        EXPECT_FALSE(tracker.Update(empty, At(i * 40)));
+    }
+    EXPECT_FALSE(tracker.IsActive());
+}
@@ -0,0 +1,106 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "colour_learner.h"
+#include "camera_threshold.h"
+
+using namespace picopter;
+
+class ColourLearnerTest : public ::testing::Test {
+    protected:
+        typedef ColourLUT<4> LUT;
+
+        ColourLearnerTest()
+        : m_hue(LUT::ENTRIES)
+        , m_sat(LUT::ENTRIES)
+        , m_red(LUT::ENTRIES)
+        {
+            LogInit();
+            //A made up colourspace: hue follows red and saturation green.
+            for (int i = 0; i < LUT::ENTRIES; i++) {
+                int r = i >> (2*LUT::BITS), g = (i >> LUT::BITS) & (LUT::SIZE - 1);
+                m_hue[i] = static_cast<uint8_t>((r * 180) / LUT::SIZE);
+                m_sat[i] = LUT::Unreduce(g);
+                m_red[i] = LUT::Unreduce(r);
+            }
+        }
+
+        /** Fills the rows [y0, y1) of a frame with a colour. **/
+        void Fill(cv::Mat &image, int y0, int y1, uint8_t r, uint8_t g) {
+            for (int y = y0; y < y1; y++) {
+                for (int x = 0; x < image.cols; x++) {
+                    image.at<cv::Vec3b>(y, x) = cv::Vec3b(0, g, r);
+                }
+            }
+        }
+
+        std::vector<uint8_t> m_hue, m_sat, m_red;
+};
+
+TEST_F(ColourLearnerTest, RangeIgnoresOutliers) {
+    ColourLearner learner(15, 5, 4);
+    cv::Mat image(100, 40, CV_8UC3);
+    int min = -1, max = -1;
+
+    EXPECT_FALSE(learner.GetRange(m_red.data(), &min, &max));
+
+    Fill(image, 0, 97, 100, 255);
+    Fill(image, 97, 100, 250, 255);
+    learner.Accumulate(image, cv::Rect(0, 0, 40, 100), 2);
+    EXPECT_EQ(1000u, learner.GetSamples());
+
+    ASSERT_TRUE(learner.GetRange(m_red.data(), &min, &max));
+    EXPECT_EQ(LUT::Unreduce(100 >> LUT::SHIFT) - 4, min);
+    EXPECT_EQ(LUT::Unreduce(100 >> LUT::SHIFT) + 4, max);
+}
+
+TEST_F(ColourLearnerTest, HueWrapsAround) {
+    ColourLearner learner(15, 5, 4);
+    cv::Mat image(30, 20, CV_8UC3);
+    int min = -1, max = -1;
+
+    //Equal amounts of hue 0 and hue 168 (i.e. -12), and grey.
+    Fill(image, 0, 10, 0, 255);
+    Fill(image, 10, 20, 250, 255);
+    Fill(image, 20, 30, 128, 0);
+    learner.Accumulate(image, cv::Rect(0, 0, 20, 30), 1);
+
+    ASSERT_TRUE(learner.GetHueRange(m_hue.data(), m_sat.data(), &min, &max));
+    EXPECT_EQ(-16, min);
+    EXPECT_EQ(4, max);
+
+    //Nothing but grey has no hue.
+    Fill(image, 0, 30, 128, 0);
+    learner.Reset(4);
+    learner.Accumulate(image, cv::Rect(0, 0, 20, 30), 1);
+    EXPECT_FALSE(learner.GetHueRange(m_hue.data(), m_sat.data(), &min, &max));
+}
+
+TEST_F(ColourLearnerTest, ForgetsOldFrames) {
+    ColourLearner learner(2, 0, 0);
+    cv::Mat before(10, 10, CV_8UC3), after(10, 10, CV_8UC3);
+    cv::Rect roi(0, 0, 10, 10);
+    int min = -1, max = -1;
+
+    Fill(before, 0, 10, 20, 255);
+    Fill(after, 0, 10, 200, 255);
+    learner.Accumulate(before, roi, 1);
+    learner.Accumulate(before, roi, 1);
+    learner.Accumulate(after, roi, 1);
+    ASSERT_TRUE(learner.GetRange(m_red.data(), &min, &max));
+    EXPECT_EQ(LUT::Unreduce(20 >> LUT::SHIFT), min);
+    EXPECT_EQ(LUT::Unreduce(200 >> LUT::SHIFT), max);
+
+    //Once the newer block fills, the older one is dropped.
+    learner.Accumulate(after, roi, 1);
+    learner.Accumulate(after, roi, 1);
+    EXPECT_EQ(300u, learner.GetSamples());
+    ASSERT_TRUE(learner.GetRange(m_red.data(), &min, &max));
+    EXPECT_EQ(LUT::Unreduce(200 >> LUT::SHIFT), min);
+
+    EXPECT_EQ(5u, learner.GetFrames());
+    learner.Reset(5);
+    EXPECT_EQ(0u, learner.GetFrames());
+    EXPECT_EQ(5, learner.GetBits());
+    EXPECT_EQ(0u, learner.GetSamples());
+    EXPECT_EQ(static_cast<size_t>(ColourLUT<5>::ENTRIES), learner.GetEntries());
+}
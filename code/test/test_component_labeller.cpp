@@ -0,0 +1,157 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "component_labeller.h"
+#include <algorithm>
+
+using namespace picopter;
+
+class ComponentLabellerTest : public ::testing::Test {
+    protected:
+        ComponentLabellerTest()
+        {
+            LogInit();
+            srand(4321);
+        }
+
+        /**
+         * Reference labelling: flood fill with 8-connectivity.
+         */
+        static std::vector<Blob> FloodFill(std::vector<uint8_t> mask, int width, int height) {
+            std::vector<Blob> blobs;
+            std::vector<std::pair<int, int>> stack;
+
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    if (!mask[y*width + x]) {
+                        continue;
+                    }
+                    Blob b = {0, 0, 0, x, y, x, y};
+                    mask[y*width + x] = 0;
+                    stack.push_back(std::make_pair(x, y));
+                    while (!stack.empty()) {
+                        int px = stack.back().first, py = stack.back().second;
+                        stack.pop_back();
+                        b.area++; b.sum_x += px; b.sum_y += py;
+                        b.min_x = std::min(b.min_x, px); b.max_x = std::max(b.max_x, px);
+                        b.min_y = std::min(b.min_y, py); b.max_y = std::max(b.max_y, py);
+                        for (int dy = -1; dy <= 1; dy++) {
+                            for (int dx = -1; dx <= 1; dx++) {
+                                int nx = px + dx, ny = py + dy;
+                                if (nx >= 0 && nx < width && ny >= 0 && ny < height &&
+                                    mask[ny*width + nx]) {
+                                    mask[ny*width + nx] = 0;
+                                    stack.push_back(std::make_pair(nx, ny));
+                                }
+                            }
+                        }
+                    }
+                    blobs.push_back(b);
+                }
+            }
+            return blobs;
+        }
+
+        static bool BlobLess(const Blob &a, const Blob &b) {
+            if (a.min_y != b.min_y) return a.min_y < b.min_y;
+            if (a.min_x != b.min_x) return a.min_x < b.min_x;
+            return a.area < b.area;
+        }
+
+        static void ExpectSameBlobs(std::vector<Blob> a, std::vector<Blob> b) {
+            std::sort(a.begin(), a.end(), BlobLess);
+            std::sort(b.begin(), b.end(), BlobLess);
+            ASSERT_EQ(a.size(), b.size());
+            for (size_t i = 0; i < a.size(); i++) {
+                EXPECT_EQ(a[i].area, b[i].area);
+                EXPECT_EQ(a[i].sum_x, b[i].sum_x);
+                EXPECT_EQ(a[i].sum_y, b[i].sum_y);
+                EXPECT_EQ(a[i].min_x, b[i].min_x);
+                EXPECT_EQ(a[i].max_x, b[i].max_x);
+                EXPECT_EQ(a[i].min_y, b[i].min_y);
+                EXPECT_EQ(a[i].max_y, b[i].max_y);
+            }
+        }
+};
+
+TEST_F(ComponentLabellerTest, TestEncodeRuns) {
+    const uint8_t row[] = {0, 255, 255, 0, 0, 255, 0, 0, 0, 255};
+    std::vector<PixelRun> runs;
+
+    EncodeRuns(row, 10, 3, 0, &runs);
+    ASSERT_EQ(3u, runs.size());
+    EXPECT_EQ(3, runs[0].y);
+    EXPECT_EQ(1, runs[0].start);
+    EXPECT_EQ(3, runs[0].end);
+    EXPECT_EQ(5, runs[1].start);
+    EXPECT_EQ(6, runs[1].end);
+    EXPECT_EQ(9, runs[2].start);
+    EXPECT_EQ(10, runs[2].end);
+
+    //A gap of 2 closes the first break but not the second.
+    runs.clear();
+    EncodeRuns(row, 10, 0, 2, &runs);
+    ASSERT_EQ(2u, runs.size());
+    EXPECT_EQ(1, runs[0].start);
+    EXPECT_EQ(6, runs[0].end);
+    EXPECT_EQ(9, runs[1].start);
+}
+
+TEST_F(ComponentLabellerTest, TestMatchesFloodFill) {
+    ComponentLabeller labeller;
+
+    for (int round = 0; round < 50; round++) {
+        int width = 1 + rand() % 60, height = 1 + rand() % 40;
+        int density = 2 + rand() % 4;
+        std::vector<uint8_t> mask(width*height);
+        std::vector<PixelRun> runs;
+
+        for (size_t i = 0; i < mask.size(); i++) {
+            mask[i] = (rand() % density == 0) ? 255 : 0;
+        }
+        for (int y = 0; y < height; y++) {
+            EncodeRuns(&mask[y*width], width, y, 0, &runs);
+        }
+
+        std::vector<Blob> expected = FloodFill(mask, width, height);
+        ASSERT_EQ(static_cast<int>(expected.size()), labeller.Label(runs));
+        ExpectSameBlobs(expected, labeller.GetBlobs());
+    }
+}
+
+TEST_F(ComponentLabellerTest, TestDiagonalConnectivity) {
+    //A staircase is one component under 8-connectivity.
+    const PixelRun runs[] = {{0, 0, 2}, {1, 2, 4}, {2, 4, 6}, {4, 0, 1}};
+    ComponentLabeller labeller;
+
+    ASSERT_EQ(2, labeller.Label(runs, 4));
+    std::vector<Blob> largest;
+    ASSERT_EQ(1, labeller.SelectLargest(1, 0, &largest));
+    EXPECT_EQ(6, largest[0].area);
+    EXPECT_EQ(0, largest[0].min_x);
+    EXPECT_EQ(5, largest[0].max_x);
+    EXPECT_EQ(2, largest[0].max_y);
+}
+
+TEST_F(ComponentLabellerTest, TestSelectLargest) {
+    ComponentLabeller labeller;
+    std::vector<PixelRun> runs;
+    std::vector<Blob> largest;
+
+    //Blobs of area 1..10, one per row, separated by blank rows.
+    for (int i = 1; i <= 10; i++) {
+        runs.push_back(PixelRun{2*i, 0, i});
+    }
+    ASSERT_EQ(10, labeller.Label(runs));
+
+    ASSERT_EQ(4, labeller.SelectLargest(4, 0, &largest));
+    EXPECT_EQ(10, largest[0].area);
+    EXPECT_EQ(9, largest[1].area);
+    EXPECT_EQ(8, largest[2].area);
+    EXPECT_EQ(7, largest[3].area);
+
+    ASSERT_EQ(2, labeller.SelectLargest(4, 9, &largest));
+    ASSERT_EQ(0, labeller.SelectLargest(0, 0, &largest));
+
+    ASSERT_EQ(0, labeller.Label(std::vector<PixelRun>()));
+    ASSERT_EQ(0, labeller.SelectLargest(4, 0, &largest));
+}
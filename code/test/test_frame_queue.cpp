@@ -0,0 +1,56 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "frame_queue.h"
+
+using picopter::FrameQueue;
+
+class FrameQueueTest : public ::testing::Test {
+    protected:
+        FrameQueueTest() {
+            LogInit();
+        }
+};
+
+TEST_F(FrameQueueTest, DropsOldest) {
+    FrameQueue<int> queue(2);
+    int item;
+
+    for (int i = 1; i <= 3; i++) {
+        item = i;
+        EXPECT_EQ(i < 3, queue.Push(item));
+    }
+    EXPECT_EQ(2u, queue.GetDepth());
+    EXPECT_EQ(1u, queue.GetDropped());
+
+    ASSERT_TRUE(queue.Pop(item));
+    EXPECT_EQ(2, item);
+    ASSERT_TRUE(queue.Pop(item));
+    EXPECT_EQ(3, item);
+}
+
+TEST_F(FrameQueueTest, CloseDiscards) {
+    FrameQueue<int> queue(4);
+    int item = 1;
+
+    queue.Push(item);
+    queue.Close();
+    EXPECT_FALSE(queue.Pop(item));
+    EXPECT_FALSE(queue.Push(item));
+}
+
+TEST_F(FrameQueueTest, CloseDrains) {
+    FrameQueue<int> queue(4);
+    int item;
+
+    for (int i = 0; i < 3; i++) {
+        item = i;
+        queue.Push(item);
+    }
+    queue.Close(true);
+    EXPECT_FALSE(queue.Push(item));
+    for (int i = 0; i < 3; i++) {
+        ASSERT_TRUE(queue.Pop(item));
+        EXPECT_EQ(i, item);
+    }
+    EXPECT_FALSE(queue.Pop(item));
+}
@@ -0,0 +1,110 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "frame_ring.h"
+#include <thread>
+
+using namespace picopter;
+
+class FrameRingTest : public ::testing::Test {
+    protected:
+        FrameRingTest()
+        : name("/picopter_test_frames")
+        {
+            LogInit();
+        }
+
+        const char *name;
+
+        cv::Mat MakeFrame(int width, int height, uint8_t value) {
+            cv::Mat frame(height, width, CV_8UC3);
+            for (int y = 0; y < height; y++) {
+                memset(frame.ptr<uint8_t>(y), value + y, width * 3);
+            }
+            return frame;
+        }
+
+        bool Matches(const cv::Mat &frame, uint8_t value) {
+            for (int y = 0; y < frame.rows; y++) {
+                const uint8_t *row = frame.ptr<uint8_t>(y);
+                for (int x = 0; x < frame.cols * 3; x++) {
+                    if (row[x] != static_cast<uint8_t>(value + y)) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+};
+
+TEST_F(FrameRingTest, NoRing) {
+    EXPECT_THROW(FrameRingReader reader("/picopter_test_missing"),
+        std::invalid_argument);
+}
+
+TEST_F(FrameRingTest, WriteAndRead) {
+    FrameRingWriter writer(name, 3, 32 * 24 * 3);
+    FrameRingReader reader(name);
+    FrameInfo info{}, out;
+    cv::Mat image;
+
+    EXPECT_EQ(0u, reader.GetWritten());
+    EXPECT_FALSE(reader.ReadLatest(&image, &out));
+
+    for (int i = 0; i < 5; i++) {
+        info.id = 100 + i;
+        info.pose.lat = -31.9 - i;
+        info.pose.pitch = -4.5f + i;
+        ASSERT_TRUE(writer.Write(MakeFrame(32, 24, i * 10), info));
+    }
+    EXPECT_EQ(5u, reader.GetWritten());
+
+    ASSERT_TRUE(reader.ReadLatest(&image, &out));
+    EXPECT_EQ(104u, out.id);
+    EXPECT_DOUBLE_EQ(-35.9, out.pose.lat);
+    EXPECT_FLOAT_EQ(-0.5f, out.pose.pitch);
+    EXPECT_EQ(32, out.width);
+    EXPECT_EQ(24, out.height);
+    EXPECT_EQ(CV_8UC3, out.type);
+    EXPECT_TRUE(Matches(image, 40));
+
+    //Only the last three frames are kept.
+    ASSERT_TRUE(reader.Read(2, &image, &out));
+    EXPECT_EQ(102u, out.id);
+    EXPECT_TRUE(Matches(image, 20));
+    EXPECT_FALSE(reader.Read(1, &image, &out));
+    EXPECT_FALSE(reader.Read(5, &image, &out));
+
+    //Too large for a slot.
+    EXPECT_FALSE(writer.Write(MakeFrame(64, 24, 0), info));
+}
+
+TEST_F(FrameRingTest, ConcurrentReader) {
+    FrameRingWriter writer(name, 2, 16 * 16 * 3);
+    FrameRingReader reader(name);
+    std::atomic<bool> stop{false};
+    int torn = 0, read = 0;
+
+    std::thread producer([&] {
+        FrameInfo info{};
+        for (int i = 0; i < 20000; i++) {
+            info.id = i;
+            writer.Write(MakeFrame(16, 16, i % 200), info);
+        }
+        stop = true;
+    });
+
+    cv::Mat image;
+    FrameInfo info;
+    while (!stop) {
+        if (reader.ReadLatest(&image, &info)) {
+            read++;
+            if (!Matches(image, info.id % 200)) {
+                torn++;
+            }
+        }
+    }
+    producer.join();
+
+    EXPECT_EQ(0, torn);
+    EXPECT_GT(read, 0);
+}
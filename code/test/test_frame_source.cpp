@@ -0,0 +1,159 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "frame_source.h"
+#include <unistd.h>
+
+using picopter::ReplaySource;
+using picopter::V4L2Source;
+
+class FrameSourceTest : public ::testing::Test {
+    protected:
+        FrameSourceTest() {
+            LogInit();
+            char path[] = "/tmp/picopter_replayXXXXXX";
+            dir = mkdtemp(path);
+            //Written out of order; replayed in name order.
+            Write("b.png", 20);
+            Write("a.png", 10);
+            Write("c.jpg", 30);
+        }
+
+        ~FrameSourceTest() {
+            for (const char *name : {"a.png", "b.png", "c.jpg"}) {
+                unlink((dir + "/" + name).c_str());
+            }
+            rmdir(dir.c_str());
+        }
+
+        void Write(const char *name, int value) {
+            cv::Mat image(24, 32, CV_8UC3, cv::Scalar(value, value, value));
+            cv::imwrite(dir + "/" + name, image);
+        }
+
+        std::string dir;
+};
+
+TEST_F(FrameSourceTest, ReplaysDirectoryInOrder) {
+    ReplaySource source(dir, 0, 0, 0, false);
+    cv::Mat image;
+
+    EXPECT_FALSE(source.IsRealTime());
+    EXPECT_EQ(cv::Size(32, 24), source.GetSize());
+    for (int value = 10; value <= 30; value += 10) {
+        ASSERT_TRUE(source.Grab());
+        ASSERT_TRUE(source.Retrieve(&image));
+        EXPECT_NEAR(value, image.at<cv::Vec3b>(12, 16)[0], 2);
+    }
+    EXPECT_FALSE(source.Grab());
+}
+
+TEST_F(FrameSourceTest, LoopsAndResizes) {
+    ReplaySource source(dir, 16, 0, 0, true);
+    cv::Mat image;
+
+    EXPECT_EQ(cv::Size(16, 12), source.GetSize());
+    for (int i = 0; i < 7; i++) {
+        ASSERT_TRUE(source.Grab());
+        ASSERT_TRUE(source.Retrieve(&image));
+        EXPECT_EQ(cv::Size(16, 12), image.size());
+    }
+}
+
+TEST_F(FrameSourceTest, Paced) {
+    ReplaySource source(dir, 0, 0, 100, true);
+    auto start = std::chrono::steady_clock::now();
+
+    EXPECT_TRUE(source.IsRealTime());
+    for (int i = 0; i < 6; i++) {
+        ASSERT_TRUE(source.Grab());
+    }
+    //The first frame is due immediately, then one every 10ms.
+    EXPECT_GE(std::chrono::steady_clock::now() - start,
+        std::chrono::milliseconds(45));
+}
+
+TEST_F(FrameSourceTest, ReplaysAsYUYV) {
+    ReplaySource source(dir, 0, 0, 0, false, picopter::FRAME_YUYV);
+    cv::Mat image;
+
+    EXPECT_EQ(picopter::FRAME_YUYV, source.GetFormat());
+    ASSERT_TRUE(source.Grab());
+    ASSERT_TRUE(source.Retrieve(&image));
+    ASSERT_EQ(CV_8UC2, image.type());
+    EXPECT_EQ(cv::Size(32, 24), image.size());
+    //Grey 10 is Y 25 in video range, with neutral chroma.
+    EXPECT_NEAR(25, image.at<cv::Vec2b>(12, 16)[0], 2);
+    EXPECT_EQ(128, image.at<cv::Vec2b>(12, 16)[1]);
+
+    //A pair of red pixels.
+    cv::Mat red(1, 2, CV_8UC3, cv::Scalar(0, 0, 255)), yuyv;
+    picopter::ConvertToYUYV(red, &yuyv);
+    EXPECT_EQ(82, yuyv.at<cv::Vec2b>(0, 0)[0]);
+    EXPECT_EQ(90, yuyv.at<cv::Vec2b>(0, 0)[1]);
+    EXPECT_EQ(82, yuyv.at<cv::Vec2b>(0, 1)[0]);
+    EXPECT_EQ(240, yuyv.at<cv::Vec2b>(0, 1)[1]);
+}
+
+TEST_F(FrameSourceTest, MissingSource) {
+    EXPECT_THROW(ReplaySource("/nonexistent/picopter.avi", 0, 0, 0, false),
+        std::invalid_argument);
+    EXPECT_THROW(V4L2Source("/nonexistent/video0", 320, 240, 30),
+        std::invalid_argument);
+    EXPECT_THROW(V4L2Source(dir + "/a.png", 320, 240, 30),
+        std::invalid_argument);
+}
+
+TEST_F(FrameSourceTest, ReplayIsNotLent) {
+    ReplaySource source(dir, 0, 0, 0, false);
+    picopter::FrameLease lease = std::make_shared<int>(0);
+    picopter::SourceStats stats;
+    cv::Mat image;
+
+    ASSERT_TRUE(source.Grab());
+    ASSERT_TRUE(source.Borrow(&image, &lease));
+    EXPECT_FALSE(lease);
+    EXPECT_FALSE(image.empty());
+    EXPECT_FALSE(source.GetStats(&stats));
+}
+
+//Needs a capture device, e.g. the vivid test driver:
+//  modprobe vivid && PICOPTER_V4L2_DEVICE=/dev/video0 ./run-tests
+TEST_F(FrameSourceTest, V4L2LendsBuffers) {
+    const char *device = getenv("PICOPTER_V4L2_DEVICE");
+    if (!device) {
+        std::cout << "Skipping; PICOPTER_V4L2_DEVICE is not set" << std::endl;
+        return;
+    }
+
+    V4L2Source source(device, 320, 240, 30, picopter::FRAME_YUYV, 4);
+    std::vector<picopter::FrameLease> leases;
+    picopter::SourceStats stats;
+    auto now = std::chrono::steady_clock::now();
+    cv::Mat image;
+
+    //Only 4 - 2 buffers can be lent; the rest are copied.
+    for (int i = 0; i < 4; i++) {
+        picopter::FrameLease lease;
+        std::chrono::steady_clock::time_point captured;
+        ASSERT_TRUE(source.Grab());
+        if (source.GetCaptureTime(&captured)) {
+            EXPECT_LT(std::abs(std::chrono::duration_cast<std::chrono::seconds>(
+                captured - now).count()), 5);
+        }
+        ASSERT_TRUE(source.Borrow(&image, &lease));
+        EXPECT_EQ(CV_8UC2, image.type());
+        EXPECT_EQ(source.GetSize(), image.size());
+        leases.push_back(lease);
+    }
+    ASSERT_TRUE(source.GetStats(&stats));
+    EXPECT_EQ(4u, stats.frames);
+    EXPECT_EQ(2, stats.lent);
+    EXPECT_EQ(2u, stats.copied);
+    EXPECT_EQ(2, stats.queued);
+
+    leases.clear();
+    ASSERT_TRUE(source.GetStats(&stats));
+    EXPECT_EQ(0, stats.lent);
+    EXPECT_EQ(4, stats.queued);
+    ASSERT_TRUE(source.Grab());
+}
@@ -0,0 +1,129 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "glyph_library.h"
+
+using namespace picopter;
+
+class GlyphLibraryTest : public ::testing::Test {
+    protected:
+        GlyphLibraryTest() {
+            LogInit();
+            srand(1357);
+        }
+
+        GlyphBits RandomGlyph() {
+            GlyphBits bits{};
+            for (int i = 0; i < GlyphBits::CELLS; i++) {
+                if (rand() % 2) {
+                    bits.words[i / 64] |= UINT64_C(1) << (i % 64);
+                }
+            }
+            return bits;
+        }
+
+        GlyphBits Flip(GlyphBits bits, int count) {
+            for (int i = 0; i < count; i++) {
+                int cell = (i * 37) % GlyphBits::CELLS;
+                bits.words[cell / 64] ^= UINT64_C(1) << (cell % 64);
+            }
+            return bits;
+        }
+};
+
+TEST_F(GlyphLibraryTest, PackAndRotate) {
+    cv::Mat mask(GlyphBits::GRID, GlyphBits::GRID, CV_8UC1, cv::Scalar(0));
+    mask.at<uint8_t>(0, 1) = 255;
+
+    GlyphBits bits, rotated, full;
+    GlyphLibrary::Pack(mask, &bits);
+    EXPECT_EQ(UINT64_C(2), bits.words[0]);
+
+    //(1, 0) turned clockwise is (GRID - 1, 1).
+    GlyphLibrary::Rotate(bits, &rotated);
+    EXPECT_EQ(UINT64_C(0), rotated.words[0] & 2);
+    EXPECT_NE(UINT64_C(0), rotated.words[0] & (UINT64_C(1) << (GlyphBits::GRID * 2 - 1)));
+
+    full = rotated;
+    for (int i = 0; i < 3; i++) {
+        GlyphBits next;
+        GlyphLibrary::Rotate(full, &next);
+        full = next;
+    }
+    EXPECT_EQ(0, GlyphLibrary::Distance(full, bits));
+}
+
+TEST_F(GlyphLibraryTest, MatchAllRotations) {
+    GlyphLibrary library;
+    std::vector<GlyphBits> glyphs;
+
+    for (int i = 0; i < 100; i++) {
+        glyphs.push_back(RandomGlyph());
+        library.Add(i, glyphs.back());
+    }
+    ASSERT_EQ(100u, library.Size());
+
+    for (int i = 0; i < 100; i += 7) {
+        GlyphBits query = Flip(glyphs[i], 10);
+        for (int r = 0; r < 4; r++) {
+            int rotation = -1, distance = -1;
+            EXPECT_EQ(i, library.Match(query, 30, &rotation, &distance));
+            EXPECT_EQ(r, rotation);
+            EXPECT_EQ(10, distance);
+
+            GlyphBits next;
+            GlyphLibrary::Rotate(query, &next);
+            query = next;
+        }
+    }
+}
+
+TEST_F(GlyphLibraryTest, MatchesBruteForce) {
+    GlyphLibrary library;
+    std::vector<GlyphBits> glyphs;
+
+    //Glyphs close to each other, so that the pruning is exercised.
+    GlyphBits base = RandomGlyph();
+    for (int i = 0; i < 50; i++) {
+        glyphs.push_back(Flip(base, 3 + i * 2));
+        library.Add(i, glyphs.back());
+    }
+
+    for (int trial = 0; trial < 200; trial++) {
+        GlyphBits query = Flip(base, trial % 120);
+        int max_distance = trial % 60;
+        int expected = -1, expected_distance = max_distance + 1;
+
+        for (int i = 0; i < 50; i++) {
+            GlyphBits rotated = glyphs[i];
+            for (int r = 0; r < 4; r++) {
+                int d = GlyphLibrary::Distance(rotated, query);
+                if (d < expected_distance) {
+                    expected_distance = d;
+                    expected = i;
+                }
+                GlyphBits next;
+                GlyphLibrary::Rotate(rotated, &next);
+                rotated = next;
+            }
+        }
+
+        int distance = -1;
+        int match = library.Match(query, max_distance, NULL, &distance);
+        if (expected < 0) {
+            EXPECT_EQ(-1, match);
+        } else {
+            EXPECT_EQ(expected_distance, distance);
+        }
+    }
+}
+
+TEST_F(GlyphLibraryTest, RejectsUnknown) {
+    GlyphLibrary library;
+    library.Add(0, RandomGlyph());
+    library.Add(1, RandomGlyph());
+
+    EXPECT_EQ(-1, library.Match(RandomGlyph(), 20));
+    library.Clear();
+    EXPECT_EQ(0u, library.Size());
+    EXPECT_EQ(-1, library.Match(RandomGlyph(), GlyphBits::CELLS));
+}
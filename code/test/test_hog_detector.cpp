@@ -0,0 +1,114 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "hog_detector.h"
+#include <algorithm>
+
+using picopter::HOGDetector;
+using picopter::ParallelFor;
+
+class HOGDetectorTest : public ::testing::Test {
+    protected:
+        HOGDetectorTest()
+        : pool(3)
+        , image(240, 320, CV_8UC1)
+        {
+            LogInit();
+            //A vertical gradient with three people of different sizes.
+            for (int y = 0; y < image.rows; y++) {
+                image.row(y).setTo(150 + y / 8);
+            }
+            Person(10, 20, 1.4, 40);
+            Person(130, 60, 1.0, 30);
+            Person(220, 30, 1.5, 60);
+        }
+
+        ThreadPool pool;
+        cv::Mat image;
+
+        /**
+         * Draws a stick figure filling a detection window (64x128) scaled by
+         * s, with its top left corner at (x, y).
+         */
+        void Person(int x, int y, double s, int shade) {
+            auto at = [&] (int px, int py) {
+                return cv::Point(static_cast<int>(x + px * s),
+                    static_cast<int>(y + py * s));
+            };
+            cv::Scalar colour(shade);
+
+            cv::circle(image, at(32, 24), static_cast<int>(9 * s), colour, -1);
+            cv::rectangle(image, at(22, 34), at(42, 74), colour, -1);
+            cv::line(image, at(24, 38), at(16, 72), colour, static_cast<int>(6 * s));
+            cv::line(image, at(40, 38), at(48, 72), colour, static_cast<int>(6 * s));
+            cv::line(image, at(27, 72), at(22, 112), colour, static_cast<int>(8 * s));
+            cv::line(image, at(37, 72), at(42, 112), colour, static_cast<int>(8 * s));
+        }
+
+        /**
+         * Clips (newer versions of detectMultiScale clip to the image) and
+         * sorts detections so they can be compared.
+         */
+        std::vector<cv::Rect> Normalise(std::vector<cv::Rect> found) {
+            cv::Rect frame(0, 0, image.cols, image.rows);
+            for (cv::Rect &r : found) {
+                r &= frame;
+            }
+            std::sort(found.begin(), found.end(), [] (const cv::Rect &a, const cv::Rect &b) {
+                return a.x != b.x ? a.x < b.x : a.y < b.y;
+            });
+            return found;
+        }
+
+        std::vector<cv::Rect> Detect(ParallelFor *parallel) {
+            HOGDetector detector(parallel);
+            std::vector<cv::Rect> found;
+
+            detector.SetScales(1, 8, 1.05);
+            detector.SetStride(8);
+            detector.Detect(image, &found);
+            return found;
+        }
+};
+
+TEST_F(HOGDetectorTest, MatchesDetectMultiScale) {
+    ParallelFor pf(&pool, 3);
+    cv::HOGDescriptor hog;
+    std::vector<cv::Rect> expected;
+
+    hog.setSVMDetector(cv::HOGDescriptor::getDefaultPeopleDetector());
+    hog.detectMultiScale(image, expected, 0, cv::Size(8, 8), cv::Size(),
+        1.05, 2);
+    ASSERT_EQ(3u, expected.size());
+    EXPECT_EQ(Normalise(expected), Normalise(Detect(&pf)));
+}
+
+TEST_F(HOGDetectorTest, SameResultOnAnyThreadCount) {
+    ParallelFor serial(NULL, 0), pf(&pool, 3);
+    std::vector<cv::Rect> expected = Detect(&serial);
+
+    ASSERT_EQ(1, serial.GetThreads());
+    ASSERT_EQ(4, pf.GetThreads());
+    ASSERT_FALSE(expected.empty());
+    for (int i = 0; i < 5; i++) {
+        EXPECT_EQ(expected, Detect(&pf));
+    }
+}
+
+TEST_F(HOGDetectorTest, ReusesBuffersAcrossCalls) {
+    ParallelFor pf(&pool, 3);
+    HOGDetector detector(&pf);
+    std::vector<cv::Rect> first, second;
+
+    detector.Detect(image, &first);
+    detector.Detect(image, &second);
+    EXPECT_EQ(first, second);
+
+    //Limiting the scales drops the largest person.
+    detector.Detect(image, &second, 1, 1.3);
+    ASSERT_FALSE(second.empty());
+    EXPECT_LT(second.size(), first.size());
+    for (const cv::Rect &r : second) {
+        EXPECT_LE(r.height, cvRound(128 * 1.3));
+        EXPECT_FALSE(r.contains(cv::Point(268, 128)));
+    }
+}
@@ -0,0 +1,79 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "latency_histogram.h"
+
+using picopter::LatencyHistogram;
+using picopter::LatencySummary;
+
+class LatencyHistogramTest : public ::testing::Test {
+    protected:
+        LatencyHistogramTest() {
+            LogInit();
+        }
+};
+
+TEST_F(LatencyHistogramTest, Buckets) {
+    LatencyHistogram histogram;
+    uint64_t counts[LatencyHistogram::BUCKETS];
+
+    histogram.Record(0);
+    histogram.Record(100);
+    histogram.Record(101);
+    histogram.Record(-5);
+    histogram.Record(std::chrono::seconds(5));
+    histogram.GetCounts(counts);
+
+    EXPECT_EQ(3u, counts[0]);
+    EXPECT_EQ(1u, counts[1]);
+    EXPECT_EQ(1u, counts[LatencyHistogram::BUCKETS - 1]);
+}
+
+TEST_F(LatencyHistogramTest, Summary) {
+    LatencyHistogram histogram;
+    LatencySummary summary;
+
+    histogram.GetSummary(&summary);
+    EXPECT_EQ(0u, summary.count);
+    EXPECT_EQ(0, summary.p50);
+
+    //1ms to 100ms, evenly.
+    for (int i = 1; i <= 100; i++) {
+        histogram.Record(std::chrono::milliseconds(i));
+    }
+    histogram.GetSummary(&summary);
+    EXPECT_EQ(100u, summary.count);
+    EXPECT_NEAR(50.5, summary.mean, 1e-9);
+    EXPECT_NEAR(100, summary.max, 1e-9);
+    //Only accurate to within a bucket.
+    EXPECT_GT(summary.p50, 35);
+    EXPECT_LE(summary.p50, 75);
+    EXPECT_GT(summary.p95, 75);
+    EXPECT_LE(summary.p99, 100);
+    EXPECT_LE(summary.p50, summary.p95);
+    EXPECT_LE(summary.p95, summary.p99);
+
+    histogram.Reset();
+    histogram.GetSummary(&summary);
+    EXPECT_EQ(0u, summary.count);
+    EXPECT_EQ(0, summary.max);
+}
+
+TEST_F(LatencyHistogramTest, ConcurrentRecords) {
+    LatencyHistogram histogram;
+    LatencySummary summary;
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&histogram, t] {
+            for (int i = 0; i < 10000; i++) {
+                histogram.Record(static_cast<int64_t>(i % 1000 + t));
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    histogram.GetSummary(&summary);
+    EXPECT_EQ(40000u, summary.count);
+    EXPECT_NEAR(1.002, summary.max, 1e-9);
+}
@@ -0,0 +1,90 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "motion_gate.h"
+
+using picopter::MotionGate;
+using picopter::FramePose;
+
+class MotionGateTest : public ::testing::Test {
+    protected:
+        MotionGateTest()
+        : image(240, 320, CV_8UC3)
+        , pose{}
+        {
+            LogInit();
+            srand(2468);
+            for (int y = 0; y < image.rows; y++) {
+                uint8_t *row = image.ptr<uint8_t>(y);
+                for (int x = 0; x < image.cols * 3; x++) {
+                    row[x] = (x / 3 + y) % 200;
+                }
+            }
+        }
+
+        /** Adds a little sensor noise **/
+        void Noise() {
+            for (int y = 0; y < image.rows; y++) {
+                uint8_t *row = image.ptr<uint8_t>(y);
+                for (int x = 0; x < image.cols * 3; x++) {
+                    row[x] = picopter::clamp(row[x] + rand() % 5 - 2, 0, 255);
+                }
+            }
+        }
+
+        cv::Mat image;
+        FramePose pose;
+};
+
+TEST_F(MotionGateTest, StaticScene) {
+    MotionGate gate(12, 100);
+
+    EXPECT_FALSE(gate.Unchanged(image, pose));
+    for (int i = 0; i < 10; i++) {
+        Noise();
+        EXPECT_TRUE(gate.Unchanged(image, pose));
+    }
+
+    gate.Reset();
+    EXPECT_FALSE(gate.Unchanged(image, pose));
+    EXPECT_TRUE(gate.Unchanged(image, pose));
+}
+
+TEST_F(MotionGateTest, ObjectMoves) {
+    MotionGate gate(12, 100);
+
+    EXPECT_FALSE(gate.Unchanged(image, pose));
+    //A bright 40x40 object appears.
+    for (int y = 100; y < 140; y++) {
+        memset(image.ptr<uint8_t>(y) + 150 * 3, 255, 40 * 3);
+    }
+    EXPECT_FALSE(gate.Unchanged(image, pose));
+    //It is now the reference.
+    EXPECT_TRUE(gate.Unchanged(image, pose));
+}
+
+TEST_F(MotionGateTest, PoseAndReuseLimit) {
+    MotionGate gate(12, 3, 2.0);
+
+    EXPECT_FALSE(gate.Unchanged(image, pose));
+    pose.gimbal_pitch = 1.5;
+    pose.heading = 359.5;
+    EXPECT_TRUE(gate.Unchanged(image, pose));
+    pose.heading = 3;
+    EXPECT_FALSE(gate.Unchanged(image, pose));
+
+    //Only reused three times in a row.
+    for (int i = 0; i < 3; i++) {
+        EXPECT_TRUE(gate.Unchanged(image, pose));
+    }
+    EXPECT_FALSE(gate.Unchanged(image, pose));
+    EXPECT_TRUE(gate.Unchanged(image, pose));
+
+    //The airframe rolling or pitching counts as turning.
+    pose.roll = 2.5;
+    EXPECT_FALSE(gate.Unchanged(image, pose));
+    pose.pitch = -2.5;
+    EXPECT_FALSE(gate.Unchanged(image, pose));
+    pose.roll = 3.5;
+    pose.pitch = -1;
+    EXPECT_TRUE(gate.Unchanged(image, pose));
+}
@@ -0,0 +1,74 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "parallel_for.h"
+
+using picopter::ParallelFor;
+
+class ParallelForTest : public ::testing::Test {
+    protected:
+        ParallelForTest()
+        : pool(3)
+        {
+            LogInit();
+        }
+
+        ThreadPool pool;
+};
+
+TEST_F(ParallelForTest, TestAllIterationsRunOnce) {
+    ParallelFor pf(&pool, 3);
+    std::vector<std::atomic<int>> hits(37);
+
+    ASSERT_EQ(4, pf.GetThreads());
+    for (int round = 0; round < 500; round++) {
+        for (auto &h : hits) {
+            h = 0;
+        }
+        pf.Run(static_cast<int>(hits.size()), [&] (int i) {
+            hits[i]++;
+        });
+        for (auto &h : hits) {
+            ASSERT_EQ(1, h);
+        }
+    }
+}
+
+TEST_F(ParallelForTest, TestSerialFallback) {
+    ParallelFor pf(NULL, 3);
+    std::thread::id caller = std::this_thread::get_id();
+    int sum = 0;
+
+    ASSERT_EQ(1, pf.GetThreads());
+    pf.Run(10, [&] (int i) {
+        ASSERT_EQ(caller, std::this_thread::get_id());
+        sum += i;
+    });
+    ASSERT_EQ(45, sum);
+}
+
+TEST_F(ParallelForTest, TestEmptyLoop) {
+    ParallelFor pf(&pool, 3);
+    pf.Run(0, [] (int i) {
+        FAIL();
+    });
+}
+
+TEST_F(ParallelForTest, TestConcurrentCallers) {
+    ParallelFor pf(&pool, 3);
+    std::atomic<int> total{0};
+    std::vector<std::thread> callers;
+
+    for (int t = 0; t < 4; t++) {
+        callers.emplace_back([&] {
+            for (int round = 0; round < 200; round++) {
+                pf.Run(8, [&] (int i) {
+                    total++;
+                });
+            }
+        });
+    }
+    for (auto &t : callers) {
+        t.join();
+    }
+    ASSERT_EQ(4 * 200 * 8, total);
+}
@@ -0,0 +1,106 @@
+#include "gtest/gtest.h"
+#include "common.h"
+#include "tracking_window.h"
+
+using namespace picopter;
+using std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+class TrackingWindowTest : public ::testing::Test {
+    protected:
+        TrackingWindowTest()
+        : frame(320, 240)
+        , start(steady_clock::now())
+        {
+            LogInit();
+        }
+
+        cv::Size frame;
+        steady_clock::time_point start;
+
+        steady_clock::time_point At(int ms) {
+            return start + milliseconds(ms);
+        }
+};
+
+TEST_F(TrackingWindowTest, FullScanUntilLocked) {
+    TrackingWindow tracker(0.5, 5, 2);
+    cv::Rect window;
+
+    ASSERT_FALSE(tracker.IsLocked());
+    ASSERT_FALSE(tracker.GetWindow(frame, At(0), &window));
+    tracker.Update(At(0), NULL);
+    ASSERT_FALSE(tracker.GetWindow(frame, At(40), &window));
+
+    cv::Rect bounds(100, 100, 20, 10);
+    tracker.Update(At(40), &bounds);
+    ASSERT_TRUE(tracker.IsLocked());
+    ASSERT_TRUE(tracker.GetWindow(frame, At(80), &window));
+    EXPECT_EQ(bounds, bounds & window);
+    EXPECT_LT(window.area(), frame.area());
+}
+
+TEST_F(TrackingWindowTest, PeriodicFullScan) {
+    TrackingWindow tracker(0.5, 3, 2);
+    cv::Rect bounds(100, 100, 20, 20), window;
+
+    tracker.Update(At(0), &bounds);
+    for (int i = 0; i < 3; i++) {
+        ASSERT_TRUE(tracker.GetWindow(frame, At(i * 10), &window));
+        tracker.Update(At(i * 10), &bounds);
+    }
+    ASSERT_FALSE(tracker.GetWindow(frame, At(30), &window));
+    tracker.Update(At(30), &bounds);
+    ASSERT_TRUE(tracker.GetWindow(frame, At(40), &window));
+}
+
+TEST_F(TrackingWindowTest, LockLost) {
+    TrackingWindow tracker(0.5, 100, 2);
+    cv::Rect bounds(100, 100, 20, 20), window;
+
+    tracker.Update(At(0), &bounds);
+    tracker.Update(At(10), NULL);
+    tracker.Update(At(20), NULL);
+    ASSERT_TRUE(tracker.IsLocked());
+    ASSERT_TRUE(tracker.GetWindow(frame, At(30), &window));
+    tracker.Update(At(30), NULL);
+    ASSERT_FALSE(tracker.IsLocked());
+    ASSERT_FALSE(tracker.GetWindow(frame, At(40), &window));
+}
+
+TEST_F(TrackingWindowTest, FollowsMotion) {
+    TrackingWindow tracker(0.25, 100, 2);
+    cv::Rect window;
+
+    //Move 4 pixels right every 20ms (200px/s).
+    for (int i = 0; i < 10; i++) {
+        cv::Rect bounds(20 + i * 4, 100, 10, 10);
+        tracker.Update(At(i * 20), &bounds);
+    }
+
+    cv::Rect last(56, 100, 10, 10), next(60, 100, 10, 10);
+    ASSERT_TRUE(tracker.GetWindow(frame, At(200), &window));
+    EXPECT_EQ(next, next & window);
+    //The window leads the object.
+    EXPECT_GT(window.x + window.width - (next.x + next.width),
+        last.x - window.x);
+
+    //A stationary object gets a smaller window.
+    TrackingWindow still(0.25, 100, 2);
+    cv::Rect still_window;
+    for (int i = 0; i < 10; i++) {
+        still.Update(At(i * 20), &last);
+    }
+    ASSERT_TRUE(still.GetWindow(frame, At(200), &still_window));
+    EXPECT_LT(still_window.area(), window.area());
+}
+
+TEST_F(TrackingWindowTest, ClippedToFrame) {
+    TrackingWindow tracker(1, 100, 2);
+    cv::Rect bounds(310, 230, 10, 10), window;
+
+    tracker.Update(At(0), &bounds);
+    ASSERT_TRUE(tracker.GetWindow(frame, At(10), &window));
+    EXPECT_EQ(window, window & cv::Rect(0, 0, frame.width, frame.height));
+    EXPECT_EQ(bounds, bounds & window);
+}